@@ -0,0 +1,138 @@
+/*
+ *  afdstat.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ *  print metrics of the workers that written to shared metrics segment.
+ *
+ *  usage: afdstat path [interval-sec [count]]
+ */
+
+#include "libasyncfd_metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+// print a row of slot; rates are calculated from difference of prev
+static void print_slot( const char *name, afd_metrics_slot_t *cur, 
+                        afd_metrics_slot_t *prev, double sec )
+{
+    afd_metrics_slot_t diff = *cur;
+    uint64_t total = 0;
+    int i = 0;
+    
+    if( prev )
+    {
+        diff.niter -= prev->niter;
+        diff.nevt -= prev->nevt;
+        diff.busy -= prev->busy;
+        diff.idle -= prev->idle;
+        for(; i < AFD_HIST_NBUCKET; i++ ){
+            diff.cblat.count[i] -= prev->cblat.count[i];
+            diff.iterlat.count[i] -= prev->iterlat.count[i];
+            diff.rxlat.count[i] -= prev->rxlat.count[i];
+        }
+    }
+    total = diff.busy + diff.idle;
+    
+    printf( "%-8s %7d %7d %10.0f %10.0f %6.1f %10llu %10llu %10llu %10llu\n", 
+            name, (int)cur->pid, (int)cur->nreg, 
+            sec > 0 ? diff.niter / sec : (double)diff.niter, 
+            sec > 0 ? diff.nevt / sec : (double)diff.nevt,
+            total ? (double)diff.busy * 100 / total : 0.0,
+            (unsigned long long)afd_hist_percentile( &diff.cblat, 50 ),
+            (unsigned long long)afd_hist_percentile( &diff.cblat, 99 ),
+            (unsigned long long)afd_hist_percentile( &diff.iterlat, 99 ),
+            (unsigned long long)afd_hist_percentile( &diff.rxlat, 99 ) );
+}
+
+static void print_header( double sec )
+{
+    printf( "%-8s %7s %7s %10s %10s %6s %10s %10s %10s %10s\n", 
+            "slot", "pid", "watch", sec > 0 ? "iter/s" : "iter", 
+            sec > 0 ? "evt/s" : "evt", "busy%", 
+            "cb-p50ns", "cb-p99ns", "iter-p99ns", "rx-p99ns" );
+}
+
+int main( int argc, const char *argv[] )
+{
+    afd_metrics_t *m = NULL;
+    afd_metrics_slot_t *prev = NULL;
+    afd_metrics_slot_t *cur = NULL;
+    double sec = 0;
+    struct timespec ts;
+    long count = -1;
+    char name[16];
+    int nslot = 0;
+    int i = 0;
+    
+    if( argc < 2 ){
+        fprintf( stderr, "usage: %s path [interval-sec [count]]\n", argv[0] );
+        return EXIT_FAILURE;
+    }
+    else if( !( m = afd_metrics_open( argv[1] ) ) ){
+        fprintf( stderr, "failed to open %s: %s\n", argv[1], strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+    else if( argc > 2 && ( sec = atof( argv[2] ) ) <= 0 ){
+        fprintf( stderr, "invalid interval: %s\n", argv[2] );
+        return EXIT_FAILURE;
+    }
+    else if( argc > 3 ){
+        count = atol( argv[3] );
+    }
+    
+    nslot = afd_metrics_nslot( m );
+    // slots and total
+    if( !( prev = calloc( nslot + 1, sizeof( afd_metrics_slot_t ) ) ) ||
+        !( cur = calloc( nslot + 1, sizeof( afd_metrics_slot_t ) ) ) ){
+        fprintf( stderr, "failed to calloc: %s\n", strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+    
+    for( i = 0; i < nslot; i++ ){
+        afd_metrics_read( m, i, &prev[i] );
+    }
+    afd_metrics_sum( m, &prev[nslot] );
+    // print total counters
+    if( sec <= 0 )
+    {
+        print_header( 0 );
+        for( i = 0; i < nslot; i++ ){
+            snprintf( name, sizeof( name ), "%d", i );
+            print_slot( name, &prev[i], NULL, 0 );
+        }
+        print_slot( "total", &prev[nslot], NULL, 0 );
+    }
+    // print rates of each interval
+    else while( count-- )
+    {
+        ts.tv_sec = (time_t)sec;
+        ts.tv_nsec = (long)( ( sec - (double)ts.tv_sec ) * 1e9 );
+        // keep sleeping if interrupted by signal
+        while( nanosleep( &ts, &ts ) == -1 && errno == EINTR ){}
+        for( i = 0; i < nslot; i++ ){
+            afd_metrics_read( m, i, &cur[i] );
+        }
+        afd_metrics_sum( m, &cur[nslot] );
+        print_header( sec );
+        for( i = 0; i < nslot; i++ ){
+            snprintf( name, sizeof( name ), "%d", i );
+            print_slot( name, &cur[i], &prev[i], sec );
+        }
+        print_slot( "total", &cur[nslot], &prev[nslot], sec );
+        printf( "\n" );
+        memcpy( prev, cur, sizeof( afd_metrics_slot_t ) * ( nslot + 1 ) );
+    }
+    
+    free( prev );
+    free( cur );
+    afd_metrics_dealloc( m );
+    
+    return EXIT_SUCCESS;
+}
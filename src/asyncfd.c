@@ -8,13 +8,20 @@
  */
 
 #include "libasyncfd.h"
+#include "libasyncfd_admit.h"
+#include "libasyncfd_trace.h"
 #include "asyncfd_private.h"
+#include "asyncfd_probes.h"
 #include <stdarg.h>
 #include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/un.h>
+#include <sys/ioctl.h>
+#if HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h>
+#endif
 
 // FQDN maximum length:(include dot separator)
 // FQDN(255) + null-terminator
@@ -27,6 +34,16 @@
 // port range: 1-65535 + null-terminator
 #define ASYNCSOCK_PORT_LEN          6
 
+#if USE_USDT
+// semaphores of static tracepoints
+AFD_PROBE_SEMAPHORE( wait__entry );
+AFD_PROBE_SEMAPHORE( wait__return );
+AFD_PROBE_SEMAPHORE( dispatch );
+AFD_PROBE_SEMAPHORE( watch );
+AFD_PROBE_SEMAPHORE( unwatch );
+AFD_PROBE_SEMAPHORE( timer__update );
+#endif
+
 static afd_sock_t *_afd_sock_alloc_inet( int type, const char *addr, size_t len )
 {
     if( len < ASYNCSOCK_INETPATH_MAX )
@@ -241,28 +258,83 @@ int afd_listen( afd_sock_t *as, int backlog )
     return -1;
 }
 
+int afd_sock_outq( int fd, size_t *unsent, size_t *inflight )
+{
+#if defined(SIOCOUTQ) && defined(SIOCOUTQNSD)
+    // SIOCOUTQ: not sent + not acked, SIOCOUTQNSD: not sent only
+    int outq = 0;
+    int nsd = 0;
+    
+    if( ioctl( fd, SIOCOUTQ, &outq ) == -1 || 
+        ioctl( fd, SIOCOUTQNSD, &nsd ) == -1 ){
+        return -1;
+    }
+    // queue may change between two calls
+    else if( nsd > outq ){
+        nsd = outq;
+    }
+    *unsent = (size_t)nsd;
+    *inflight = (size_t)( outq - nsd );
+    
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
 
 
-struct _afd_state_t {
+// register wake-up event that will be triggered by afd_unloop
+// NOTE: udata of wake-up event is NULL, so _afd_loop will skip it
+static int _afd_state_wakeup_init( afd_state_t *state )
+{
 #if USE_KQUEUE
-    struct kevent *rcv_evs;
+    struct kevent evt;
+    
+    EV_SET( &evt, 0, EVFILT_USER, EV_ADD|EV_CLEAR, 0, 0, NULL );
+    return kevent( state->fd, &evt, 1, NULL, 0, NULL );
 
 #elif USE_EPOLL
-    struct epoll_event *rcv_evs;
+    struct epoll_event evt = {
+        // edge trigger: no need to read counter
+        .events = EPOLLIN|EPOLLET,
+        .data.ptr = NULL
+    };
+    
+    if( ( state->wakefd = eventfd( 0, EFD_NONBLOCK|EFD_CLOEXEC ) ) != -1 )
+    {
+        if( epoll_ctl( state->fd, EPOLL_CTL_ADD, state->wakefd, &evt ) == 0 ){
+            return 0;
+        }
+        close( state->wakefd );
+    }
+    
+    return -1;
 #endif
-    int32_t nrcv;
-    int32_t nreg;
-    int32_t fd;
-    int running;
-    afd_loop_cleanup_cb cleanup;
-    void *udata;
-};
+}
 
+// trigger wake-up event
+static void _afd_loop_wakeup( afd_state_t *state )
+{
+#if USE_KQUEUE
+    struct kevent evt;
+    
+    EV_SET( &evt, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL );
+    kevent( state->fd, &evt, 1, NULL, 0, NULL );
+#elif USE_EPOLL
+    uint64_t val = 1;
+    
+    if( write( state->wakefd, &val, sizeof( val ) ) == -1 ){
+        pfelog( write, "failed to wake up loop" );
+    }
+#endif
+}
 
 static afd_state_t *_afd_state_alloc( int32_t nevs, afd_loop_cleanup_cb cb, 
                                        void *udata )
 {
-    afd_state_t *state = palloc( afd_state_t );
+    // NOTE: state is mapped to be migrated to NUMA node by afd_loop_bind_cpu
+    afd_state_t *state = _afd_node_alloc( -1, 0, sizeof( afd_state_t ) );
     
     if( state )
     {
@@ -280,16 +352,56 @@ static afd_state_t *_afd_state_alloc( int32_t nevs, afd_loop_cleanup_cb cb,
 #endif
 #endif
         ){
+            if( _afd_state_wakeup_init( state ) == -1 ){
+                close( state->fd );
+                pdealloc( state->rcv_evs );
+                _afd_node_dealloc( state );
+                return NULL;
+            }
             state->nrcv = nevs;
             state->nreg = 0;
             state->running = 0;
+            state->shared = 0;
+            state->node = -1;
+            state->mflags = 0;
+            memset( (void*)&state->arena, 0, sizeof( afd_arena_t ) );
+            state->nevt = 0;
+            state->prio = 0;
+            state->bulk_evs = NULL;
+            state->nbulk = 0;
+            state->maxbulk = 0;
+            state->bulk_budget = 0;
+            state->defer = NULL;
+            state->ndefer = 0;
+            state->maxdefer = 0;
+            state->mtlock = 0;
+            state->mtslots = NULL;
+            state->epoch = 1;
+            state->gp = 0;
+            state->balanced = 0;
+            state->busy = 0;
+            state->shed_to = NULL;
+            state->shed = 0;
+            state->metrics = NULL;
+            state->slowcb = 0;
+            state->rxstamp = 0;
+            state->tdisp = 0;
+            state->watchdog = 0;
+            state->thread = pthread_self();
+            state->since = 0;
+            state->curw = NULL;
+            state->trace = NULL;
+            state->admit = NULL;
+            state->prepare = NULL;
+            state->check = NULL;
             state->cleanup = cb;
+            state->udata = udata;
             return state;
         }
         else if( state->rcv_evs ){
             pdealloc( state->rcv_evs );
         }
-        pdealloc( state );
+        _afd_node_dealloc( state );
     }
     
     return NULL;
@@ -298,11 +410,24 @@ static afd_state_t *_afd_state_alloc( int32_t nevs, afd_loop_cleanup_cb cb,
 static int _afd_state_realloc( afd_state_t *state, int32_t nevs )
 {
 #if USE_KQUEUE
-    struct kevent *evs = prealloc( nevs, struct kevent, state->rcv_evs );
+    struct kevent *evs = NULL;
 #elif USE_EPOLL
-    struct epoll_event *evs = prealloc( nevs, struct epoll_event, state->rcv_evs );
+    struct epoll_event *evs = NULL;
 #endif
     
+    // allocate on NUMA node
+    // NOTE: received events will not be used after resized
+    if( state->node != -1 )
+    {
+        if( ( evs = _afd_node_alloc( state->node, state->mflags, 
+                                     nevs * sizeof( *evs ) ) ) ){
+            _afd_node_dealloc( state->rcv_evs );
+        }
+    }
+    else {
+        evs = prealloc( nevs, typeof( *evs ), state->rcv_evs );
+    }
+    
     if( evs ){
         state->rcv_evs = evs;
         state->nrcv = nevs;
@@ -312,14 +437,54 @@ static int _afd_state_realloc( afd_state_t *state, int32_t nevs )
     return -1;
 }
 
+// call deallocation functions of deferred watches that released before or 
+// at epoch
+static void _afd_defer_flush( afd_state_t *state, uint64_t epoch )
+{
+    afd_defer_t *defer = state->defer;
+    int n = 0;
+    int i = 0;
+    
+    for(; i < state->ndefer; i++ )
+    {
+        if( defer[i].epoch <= epoch ){
+            defer[i].cb( defer[i].w );
+        }
+        else {
+            defer[n++] = defer[i];
+        }
+    }
+    state->ndefer = n;
+}
+
 static void _afd_state_dealloc( afd_state_t *state )
 {
     afd_loop_cleanup_cb cb = state->cleanup;
     void *udata = state->udata;
     
+    if( state->trace ){
+        _afd_trace_dealloc( state->trace );
+    }
+    if( state->admit ){
+        _afd_admit_dealloc( state->admit );
+    }
+    if( state->defer ){
+        _afd_defer_flush( state, UINT64_MAX );
+        pdealloc( state->defer );
+    }
+    pdealloc( state->bulk_evs );
     close( state->fd );
-    pdealloc( state->rcv_evs );
-    pdealloc( state );
+#if USE_EPOLL
+    close( state->wakefd );
+#endif
+    _afd_arena_release( &state->arena );
+    if( state->node != -1 ){
+        _afd_node_dealloc( state->rcv_evs );
+    }
+    else {
+        pdealloc( state->rcv_evs );
+    }
+    _afd_node_dealloc( state );
     
     // call user cleanup code
     if( cb ){
@@ -337,6 +502,7 @@ afd_loop_t *afd_loop_alloc( afd_sock_t *as, int32_t nevts,
         
         if( loop && ( loop->state = _afd_state_alloc( nevts, cb, udata ) ) ){
             loop->as = as;
+            loop->now = _afd_hrtime();
             return loop;
         }
         
@@ -355,61 +521,481 @@ void afd_loop_dealloc( afd_loop_t *loop )
     pdealloc( loop );
 }
 
+static inline void _afd_loop_hook( afd_loop_t *loop, afd_hook_t *h )
+{
+    // hook callback may remove itself from list
+    for(; h; h = h->next ){
+        h->cb( loop, h );
+    }
+}
+
+static int _afd_loop_shed( afd_loop_t *loop, afd_watch_t *w )
+{
+    afd_state_t *state = loop->state;
+    afd_loop_t *to = state->shed_to;
+    
+    // claim a shed count
+    if( to && __sync_fetch_and_sub( &state->shed, 1 ) > 0 ){
+        // event will be delivered to destination loop on success
+        return afd_watch_move( loop, to, w );
+    }
+    
+    return -1;
+}
+
+#if USE_USDT
+static void _afd_watch_dispatch_probe( afd_loop_t *loop, afd_watch_t *w, 
+                                       int hup )
+{
+    // NOTE: w may be deallocated by callback
+    int fd = w->fd;
+    uint8_t flg = w->flg;
+    void *udata = w->udata;
+    uint64_t t = _afd_hrtime();
+    
+    w->cb( loop, w, w->flg, hup );
+    AFD_PROBE4( dispatch, fd, flg, udata, _afd_hrtime() - t );
+}
+#endif
+
+static inline void _afd_watch_dispatch( afd_loop_t *loop, afd_watch_t *w, 
+                                        int hup )
+{
+    switch( w->flg ) {
+        case AS_EV_READ:
+        case AS_EV_WRITE:
+        case AS_EV_TIMER:
+#if USE_USDT
+            if( AFD_PROBE_ENABLED( dispatch ) ){
+                _afd_watch_dispatch_probe( loop, w, hup );
+                break;
+            }
+#endif
+            w->cb( loop, w, w->flg, hup );
+        break;
+        default:
+            plog( "unknown event" );
+            break;
+    }
+}
+
+void _afd_loop_dispatch( afd_loop_t *loop, afd_watch_t *w, int hup )
+{
+    _afd_watch_dispatch( loop, w, hup );
+}
+
+#if USE_KQUEUE
+static void _afd_watch_dispatch_timed( afd_loop_t *loop, afd_watch_t *w, 
+                                       struct kevent *evt, uint64_t *tcb )
+#elif USE_EPOLL
+static void _afd_watch_dispatch_timed( afd_loop_t *loop, afd_watch_t *w, 
+                                       struct epoll_event *evt, uint64_t *tcb )
+#endif
+{
+    afd_state_t *state = loop->state;
+    // NOTE: w may be deallocated by callback
+    int fd = w->fd;
+    uint8_t flg = w->flg;
+    void *udata = w->udata;
+    uint64_t tnext = 0;
+    
+#if USE_KQUEUE
+    int hup = evt->flags & EV_EOF;
+#elif USE_EPOLL
+    int hup = evt->events & (EPOLLERR|EPOLLRDHUP|EPOLLHUP);
+#endif
+    size_t rec = 0;
+    
+    // NOTE: record event before dispatch to keep order of unwatch record 
+    //       that will be written by callback
+    if( state->trace )
+    {
+#if USE_KQUEUE
+        uint8_t ev = ( evt->filter == EVFILT_WRITE ) ? AFD_TRACE_EV_OUT : 
+                                                       AFD_TRACE_EV_IN;
+        
+        if( evt->flags & EV_EOF ){
+            ev |= AFD_TRACE_EV_HUP;
+        }
+        if( evt->flags & EV_ERROR ){
+            ev |= AFD_TRACE_EV_ERR;
+        }
+#elif USE_EPOLL
+        uint8_t ev = 0;
+        
+        if( evt->events & EPOLLIN ){
+            ev |= AFD_TRACE_EV_IN;
+        }
+        if( evt->events & EPOLLOUT ){
+            ev |= AFD_TRACE_EV_OUT;
+        }
+        if( evt->events & (EPOLLRDHUP|EPOLLHUP) ){
+            ev |= AFD_TRACE_EV_HUP;
+        }
+        if( evt->events & EPOLLERR ){
+            ev |= AFD_TRACE_EV_ERR;
+        }
+#endif
+        rec = _afd_trace_event( state->trace, fd, flg, ev );
+    }
+    state->curw = w;
+    state->tdisp = *tcb;
+    _afd_watch_dispatch( loop, w, hup );
+    state->curw = NULL;
+    state->tdisp = 0;
+    
+    // duration of callback
+    tnext = _afd_hrtime();
+    if( state->trace ){
+        _afd_trace_done( state->trace, rec, tnext - *tcb );
+    }
+    if( state->metrics ){
+        afd_hist_add( &state->metrics->cblat, tnext - *tcb );
+    }
+    if( state->slowcb && tnext - *tcb >= state->slowcb ){
+        afd_log_warn( "slow callback: fd %d flg %u udata %p %llu ns", fd, 
+                      flg, udata, tnext - *tcb );
+    }
+    *tcb = tnext;
+}
+
+#if USE_KQUEUE
+static inline void _afd_watch_dispatch_evt( afd_loop_t *loop, afd_watch_t *w, 
+                                            struct kevent *evt, int timed, 
+                                            uint64_t *tcb )
+#elif USE_EPOLL
+static inline void _afd_watch_dispatch_evt( afd_loop_t *loop, afd_watch_t *w, 
+                                            struct epoll_event *evt, int timed, 
+                                            uint64_t *tcb )
+#endif
+{
+    if( timed ){
+        _afd_watch_dispatch_timed( loop, w, evt, tcb );
+    }
+    else {
+#if USE_KQUEUE
+        _afd_watch_dispatch( loop, w, evt->flags & EV_EOF );
+#elif USE_EPOLL
+        _afd_watch_dispatch( loop, w, 
+                             evt->events & (EPOLLERR|EPOLLRDHUP|EPOLLHUP) );
+#endif
+    }
+}
+
+// append event of bulk watch to bulk_evs
+#if USE_KQUEUE
+static int _afd_bulk_push( afd_state_t *state, afd_watch_t *w, 
+                           struct kevent *evt )
+#elif USE_EPOLL
+static int _afd_bulk_push( afd_state_t *state, afd_watch_t *w, 
+                           struct epoll_event *evt )
+#endif
+{
+    // already carried over
+    if( w->attr & AFD_WATCH_CARRIED ){
+        return 0;
+    }
+    else if( state->nbulk == state->maxbulk )
+    {
+        int max = state->maxbulk ? state->maxbulk * 2 : state->nrcv;
+#if USE_KQUEUE
+        struct kevent *evs = prealloc( max, struct kevent, state->bulk_evs );
+#elif USE_EPOLL
+        struct epoll_event *evs = prealloc( max, struct epoll_event, 
+                                            state->bulk_evs );
+#endif
+        if( !evs ){
+            return -1;
+        }
+        state->bulk_evs = evs;
+        state->maxbulk = max;
+    }
+    
+    w->attr |= AFD_WATCH_CARRIED;
+    state->bulk_evs[state->nbulk++] = *evt;
+    
+    return 0;
+}
+
+// remove carried event of w from bulk_evs
+static void _afd_bulk_remove( afd_state_t *state, afd_watch_t *w )
+{
+    int i = 0;
+    
+    w->attr &= ~AFD_WATCH_CARRIED;
+    for(; i < state->nbulk; i++ )
+    {
+#if USE_KQUEUE
+        if( _afd_watch_untag( state->bulk_evs[i].udata ) == w ){
+            state->bulk_evs[i].udata = NULL;
+            break;
+        }
+#elif USE_EPOLL
+        if( _afd_watch_untag( state->bulk_evs[i].data.ptr ) == w ){
+            state->bulk_evs[i].data.ptr = NULL;
+            break;
+        }
+#endif
+    }
+}
+
+// dispatch received events in the order of priority class; control, normal 
+// and bulk. bulk events over the budget are carried over to next iteration.
+static void _afd_loop_prio( afd_loop_t *loop, int nevt, int timed, 
+                            uint64_t *tcb )
+{
+    afd_state_t *state = loop->state;
+    afd_watch_t *w;
+    void *tag = NULL;
+    int nnorm = 0;
+    int i = 0;
+    uint64_t t = 0;
+#if USE_KQUEUE
+    struct kevent *evt = NULL;
+#elif USE_EPOLL
+    struct epoll_event *evt = NULL;
+#endif
+    
+    // dispatch control events, and pick normal events up to the head of 
+    // rcv_evs and bulk events to bulk_evs
+    for(; i < nevt; i++ )
+    {
+        evt = &state->rcv_evs[i];
+#if USE_KQUEUE
+        tag = evt->udata;
+#elif USE_EPOLL
+        tag = evt->data.ptr;
+#endif
+        if( !( w = _afd_watch_untag( tag ) ) || _afd_watch_stale( w, tag ) ){
+            continue;
+        }
+        else if( state->shed > 0 && ( w->attr & AS_EV_MOVABLE ) && 
+                 _afd_loop_shed( loop, w ) == 0 ){
+            continue;
+        }
+        else if( w->attr & AS_EV_CONTROL ){
+            _afd_watch_dispatch_evt( loop, w, evt, timed, tcb );
+        }
+        // dispatch as normal event if failed to expand bulk_evs
+        else if( !( w->attr & AS_EV_BULK ) || 
+                 _afd_bulk_push( state, w, evt ) == -1 ){
+            state->rcv_evs[nnorm++] = *evt;
+        }
+    }
+    
+    // NOTE: callbacks may deregister the watches of remaining events
+    for( i = 0; i < nnorm; i++ )
+    {
+        evt = &state->rcv_evs[i];
+#if USE_KQUEUE
+        tag = evt->udata;
+#elif USE_EPOLL
+        tag = evt->data.ptr;
+#endif
+        if( ( w = _afd_watch_untag( tag ) ) && !_afd_watch_stale( w, tag ) ){
+            _afd_watch_dispatch_evt( loop, w, evt, timed, tcb );
+        }
+    }
+    
+    if( state->bulk_budget ){
+        t = _afd_hrtime();
+    }
+    for( i = 0; i < state->nbulk; )
+    {
+        evt = &state->bulk_evs[i++];
+#if USE_KQUEUE
+        tag = evt->udata;
+#elif USE_EPOLL
+        tag = evt->data.ptr;
+#endif
+        if( ( w = _afd_watch_untag( tag ) ) && !_afd_watch_stale( w, tag ) )
+        {
+            w->attr &= ~AFD_WATCH_CARRIED;
+            _afd_watch_dispatch_evt( loop, w, evt, timed, tcb );
+            // budget exhausted
+            if( state->bulk_budget && 
+                _afd_hrtime() - t >= state->bulk_budget ){
+                break;
+            }
+        }
+    }
+    // carry over remaining events
+    if( ( state->nbulk -= i ) ){
+        memmove( state->bulk_evs, state->bulk_evs + i, 
+                 sizeof( *state->bulk_evs ) * state->nbulk );
+    }
+}
+
+#if USE_EPOLL && HAVE_EPOLL_PWAIT2
+// 1 if epoll_pwait2 is not supported by kernel
+static int _afd_nopwait2 = 0;
+#endif
+
 static int _afd_loop( afd_loop_t *loop, struct timespec *timeout )
 {
     afd_state_t *state = loop->state;
     afd_watch_t *w;
+    void *tag = NULL;
     int nevt = 0;
+    int nrcv = 0;
     int i = 0;
+    afd_metrics_slot_t *metrics = NULL;
+    uint64_t t = 0;
+    uint64_t tcb = 0;
+    int timed = 0;
+    struct timespec nowait = { 0, 0 };
+    struct timespec recheck = { 0, AFD_ADMIT_RECHECK_MSEC * 1000000L };
+    struct timespec *tmo = NULL;
 #if USE_KQUEUE
     struct kevent *evt = NULL;
-    struct timespec *tval = timeout;
 #elif USE_EPOLL
     struct epoll_event *evt = NULL;
-    int tval = ( !timeout ) ? -1 : 
-                timeout->tv_sec * 1000 + timeout->tv_nsec * 1000;
+    int tval = 0;
 #endif
 
+    // target of backtrace capture
+    state->thread = pthread_self();
     do
     {
+        _afd_loop_hook( loop, state->prepare );
+        // expand receive events container
+        // NOTE: ignore an error and receive events as much as possible
+        if( ( nrcv = state->nreg ) > state->nrcv && 
+            _afd_state_realloc( state, nrcv ) == -1 ){
+            nrcv = state->nrcv;
+        }
+        // wait for the watches that will be registered(or moved) from other 
+        // thread even if no watches registered
+        else if( nrcv < 1 ){
+            nrcv = 1;
+        }
+        metrics = state->metrics;
+        if( ( timed = metrics || state->slowcb || state->watchdog || 
+                      state->trace ) ){
+            t = _afd_hrtime();
+        }
+        state->since = 0;
+        // do not wait for new events while bulk events are carried over
+        if( state->nbulk ){
+            tmo = &nowait;
+        }
+        // wake up to resume paused accepting even if no events arrive
+        else if( state->admit && afd_admit_paused( loop ) == 1 &&
+                 ( !timeout || timeout->tv_sec || 
+                   timeout->tv_nsec > recheck.tv_nsec ) ){
+            tmo = &recheck;
+        }
+        else {
+            tmo = timeout;
+        }
+        AFD_PROBE2( wait__entry, state->fd, nrcv );
 #if USE_KQUEUE
-        nevt = kevent( state->fd, NULL, 0, state->rcv_evs, state->nreg, tval );
+        nevt = kevent( state->fd, NULL, 0, state->rcv_evs, nrcv, tmo );
 
 #elif USE_EPOLL
-        nevt = epoll_pwait( state->fd, state->rcv_evs, state->nreg, tval, NULL );
+#if HAVE_EPOLL_PWAIT2
+        // fallback to epoll_pwait if kernel does not support epoll_pwait2
+        if( !_afd_nopwait2 && 
+            ( nevt = epoll_pwait2( state->fd, state->rcv_evs, nrcv, tmo, 
+                                   NULL ) ) == -1 && errno == ENOSYS ){
+            _afd_nopwait2 = 1;
+        }
+        if( _afd_nopwait2 )
+#endif
+        {
+            // round up to milliseconds
+            tval = ( !tmo ) ? -1 : 
+                   tmo->tv_sec * 1000 + ( tmo->tv_nsec + 999999 ) / 1000000;
+            nevt = epoll_pwait( state->fd, state->rcv_evs, nrcv, tval, NULL );
+        }
 #endif
-        if( nevt > 0 )
+        AFD_PROBE2( wait__return, nevt, nevt == -1 ? errno : 0 );
+        // cache current time
+        loop->now = _afd_hrtime();
+        if( timed ){
+            tcb = loop->now;
+            if( metrics ){
+                metrics->idle += tcb - t;
+            }
+            t = tcb;
+            // start of busy time for stall detector
+            if( state->watchdog ){
+                state->since = t;
+            }
+            if( state->trace && nevt > 0 ){
+                _afd_trace_wait( state->trace, nevt, t );
+            }
+        }
+        else if( state->balanced || state->admit ){
+            t = loop->now;
+        }
+        if( nevt > 0 && state->prio ){
+            state->nevt = nevt;
+            _afd_loop_prio( loop, nevt, timed, &tcb );
+            state->nevt = 0;
+        }
+        else if( nevt > 0 )
         {
+            state->nevt = nevt;
             for( i = 0; i < nevt; i++ )
             {
                 evt = &state->rcv_evs[i];
 #if USE_KQUEUE
-                w = (afd_watch_t*)evt->udata;
-#elif USE_EPOLL
-                w = (afd_watch_t*)evt->data.ptr;
-#endif
-                switch( w->flg ) {
-                    case AS_EV_READ:
-                    case AS_EV_WRITE:
-                    case AS_EV_TIMER:
-#if USE_KQUEUE
-                        w->cb( loop, w, w->flg, evt->flags & EV_EOF );
+                tag = evt->udata;
 #elif USE_EPOLL
-                        w->cb( loop, w, w->flg, 
-                               evt->events & (EPOLLERR|EPOLLRDHUP|EPOLLHUP) );
+                tag = evt->data.ptr;
 #endif
-                    break;
-                    default:
-                        plog( "unknown event" );
-                        break;
+                // wake-up event, or deregistered or moved to other loop
+                if( !( w = _afd_watch_untag( tag ) ) || _afd_watch_stale( w, tag ) ){
+                    continue;
                 }
+                // move to other loop if overloaded
+                else if( state->shed > 0 && ( w->attr & AS_EV_MOVABLE ) && 
+                         _afd_loop_shed( loop, w ) == 0 ){
+                    continue;
+                }
+                _afd_watch_dispatch_evt( loop, w, evt, timed, &tcb );
             }
+            state->nevt = 0;
         }
         else if( nevt == -1 ){
-            break;
+            if( errno != EINTR || !state->running ){
+                break;
+            }
+            // keep running if interrupted by signal
+            nevt = 0;
+        }
+        // dispatch carried over bulk events
+        else if( state->nbulk ){
+            _afd_loop_prio( loop, 0, timed, &tcb );
+        }
+        _afd_loop_hook( loop, state->check );
+        // deallocate watches that released in this iteration
+        if( state->ndefer ){
+            _afd_defer_flush( state, UINT64_MAX );
+        }
+        if( timed || state->balanced || state->admit )
+        {
+            t = _afd_hrtime() - t;
+            if( metrics ){
+                metrics->nreg = state->nreg;
+                metrics->niter++;
+                metrics->nevt += nevt;
+                metrics->busy += t;
+                afd_hist_add( &metrics->iterlat, t );
+            }
+            if( state->balanced ){
+                state->busy += t;
+            }
+            // pause or resume accepting
+            if( state->admit ){
+                _afd_admit_update( loop, t );
+            }
         }
     
     } while( state->running );
+    // time outside of the loop(e.g. after afd_loop_once) is not a stall
+    state->since = 0;
     
     return nevt;
 }
@@ -417,11 +1003,13 @@ static int _afd_loop( afd_loop_t *loop, struct timespec *timeout )
 
 int afd_loop( afd_loop_t *loop )
 {
-    if( !loop->state->running ){
-        struct timespec timeout = { 1, 0 };
-        
+    if( loop->state->shared ){
+        errno = EINVAL;
+        return -1;
+    }
+    else if( !loop->state->running ){
         loop->state->running = 1;
-        return _afd_loop( loop, &timeout );
+        return _afd_loop( loop, NULL );
     }
     
     // already running
@@ -432,7 +1020,11 @@ int afd_loop( afd_loop_t *loop )
 
 int afd_loop_once( afd_loop_t *loop, struct timespec *timeout )
 {
-    if( !loop->state->running ){
+    if( loop->state->shared ){
+        errno = EINVAL;
+        return -1;
+    }
+    else if( !loop->state->running ){
         return _afd_loop( loop, timeout );
     }
     
@@ -442,29 +1034,408 @@ int afd_loop_once( afd_loop_t *loop, struct timespec *timeout )
 }
 
 
-void afd_unloop( afd_loop_t *loop )
+int afd_loop_fd( afd_loop_t *loop )
 {
-    loop->state->running = 0;
+    return loop->state->fd;
 }
 
 
-int afd_watch_init( afd_watch_t *w, int fd, afd_evflag_e flg, afd_watch_cb cb, 
-                    void *udata )
+int afd_loop_step( afd_loop_t *loop, uint64_t *deadline )
 {
-    // valid defined descriptor, flag, callbacks
-    if( fd > 0 && flg && ( flg & AS_EV_ISVALID ) == 0 && cb )
-    {
-        // set passed args
-        w->fd = fd;
-        w->fflg = 0;
-        w->cb = NULL;
-        w->udata = udata;
-        
-        // init filter
-        // kqueue will catch hang-up event on default.
-        if( flg & AS_EV_EDGE ){
-            flg &= ~AS_EV_EDGE; 
-#if USE_KQUEUE
+    struct timespec nowait = { 0, 0 };
+    int nevt = afd_loop_once( loop, &nowait );
+    
+    if( nevt != -1 && deadline ){
+        // carried over events will not be notified by loop descriptor
+        if( loop->state->nbulk ){
+            *deadline = loop->now;
+        }
+        // paused accepting will be resumed by next iteration
+        else if( loop->state->admit && afd_admit_paused( loop ) == 1 ){
+            *deadline = loop->now + AFD_ADMIT_RECHECK_MSEC * 1000000ULL;
+        }
+        else {
+            *deadline = UINT64_MAX;
+        }
+    }
+    
+    return nevt;
+}
+
+
+void afd_loop_bulk_budget( afd_loop_t *loop, uint64_t nsec )
+{
+    loop->state->bulk_budget = nsec;
+}
+
+
+// watch that is dispatched by current thread of shared loop.
+// it will be cleared if the callback deregistered or moved the watch.
+static __thread afd_watch_t *_afd_mtw = NULL;
+// watch that is dispatched by afd_watch_eager before registration.
+// it will be cleared if the callback registered or deregistered the watch.
+static __thread afd_watch_t *_afd_eagerw = NULL;
+
+#define _afd_watch_lock(w) \
+    while( __sync_lock_test_and_set( &(w)->lock, 1 ) ){}
+#define _afd_watch_unlock(w) \
+    __sync_lock_release( &(w)->lock )
+
+// re-arm oneshot event of watch
+// NOTE: must be called with lock of watch
+static int _afd_watch_rearm( afd_state_t *state, afd_watch_t *w )
+{
+#if USE_KQUEUE
+    struct kevent evt;
+    
+    // use address for ident if kqueue timer event
+    EV_SET( &evt, w->filter == EVFILT_TIMER ? (uintptr_t)w : (uintptr_t)w->fd, 
+            w->filter, EV_ENABLE|EV_DISPATCH, 0, 0, _afd_watch_tag( w ) );
+    return kevent( state->fd, &evt, 1, NULL, 0, NULL );
+    
+#elif USE_EPOLL
+    struct epoll_event evt = {
+        .events = w->filter|EPOLLONESHOT,
+        .data.ptr = _afd_watch_tag( w )
+    };
+    
+    return epoll_ctl( state->fd, EPOLL_CTL_MOD, w->fd, &evt );
+#endif
+}
+
+#define _afd_mtlock(state) \
+    while( __sync_lock_test_and_set( &(state)->mtlock, 1 ) ){}
+#define _afd_mtunlock(state) \
+    __sync_lock_release( &(state)->mtlock )
+
+// start grace period of deferred watches
+// NOTE: must be called with mtlock
+static void _afd_gp_start( afd_state_t *state )
+{
+    afd_mtslot_t *slot = state->mtslots;
+    
+    for(; slot; slot = slot->next ){
+        slot->snap = slot->seq;
+    }
+    state->gp = state->epoch++;
+}
+
+// deallocate deferred watches of current grace period after all threads 
+// finished the events that received before it started.
+// NOTE: must be called with mtlock
+static void _afd_gp_reclaim( afd_state_t *state )
+{
+    afd_mtslot_t *slot = state->mtslots;
+    uint64_t seq = 0;
+    
+    for(; slot; slot = slot->next )
+    {
+        seq = slot->seq;
+        // still dispatching, or still waiting since grace period started
+        if( seq < slot->snap + 1 + ( slot->snap & 1 ) )
+        {
+            // wake up thread to pass through
+            if( seq == slot->snap && ( seq & 1 ) ){
+                _afd_loop_wakeup( state );
+            }
+            return;
+        }
+    }
+    
+    _afd_defer_flush( state, state->gp );
+    state->gp = 0;
+    // watches that released after grace period started
+    if( state->ndefer ){
+        _afd_gp_start( state );
+    }
+}
+
+int afd_loop_share( afd_loop_t *loop )
+{
+    afd_state_t *state = loop->state;
+    
+    // watches must be registered in oneshot mode
+    if( state->nreg || state->running ){
+        errno = EBUSY;
+        return -1;
+    }
+    state->shared = 1;
+    
+    return 0;
+}
+
+int afd_loop_mt( afd_loop_t *loop, int32_t nevts )
+{
+    afd_state_t *state = loop->state;
+    afd_mtslot_t slot = {
+        .next = NULL,
+        .seq = 1,
+        .snap = 0
+    };
+    afd_watch_t *w = NULL;
+    void *tag = NULL;
+    int nevt = 0;
+    int i = 0;
+    int hup = 0;
+    uint64_t t = 0;
+#if USE_KQUEUE
+    struct kevent *evs = NULL;
+    struct kevent *evt = NULL;
+#elif USE_EPOLL
+    struct epoll_event *evs = NULL;
+    struct epoll_event *evt = NULL;
+#endif
+    
+    if( !state->shared || nevts < 1 ){
+        errno = EINVAL;
+        return -1;
+    }
+    // receive events container of calling thread
+    else if( !( evs = pnalloc( nevts, typeof( *evs ) ) ) ){
+        return -1;
+    }
+    
+    // join to threads of loop
+    _afd_mtlock( state );
+    slot.next = state->mtslots;
+    state->mtslots = &slot;
+    _afd_mtunlock( state );
+    
+    state->running = 1;
+    do
+    {
+        AFD_PROBE2( wait__entry, state->fd, nevts );
+#if USE_KQUEUE
+        nevt = kevent( state->fd, NULL, 0, evs, nevts, NULL );
+#elif USE_EPOLL
+        nevt = epoll_wait( state->fd, evs, nevts, -1 );
+#endif
+        // start dispatching
+        __sync_add_and_fetch( &slot.seq, 1 );
+        AFD_PROBE2( wait__return, nevt, nevt == -1 ? errno : 0 );
+        if( nevt == -1 ){
+            __sync_add_and_fetch( &slot.seq, 1 );
+            // keep running if interrupted by signal
+            if( errno == EINTR ){
+                continue;
+            }
+            break;
+        }
+        loop->now = _afd_hrtime();
+        for( i = 0; i < nevt; i++ )
+        {
+            evt = &evs[i];
+#if USE_KQUEUE
+            tag = evt->udata;
+            hup = evt->flags & EV_EOF;
+#elif USE_EPOLL
+            tag = evt->data.ptr;
+            hup = evt->events & (EPOLLERR|EPOLLRDHUP|EPOLLHUP);
+#endif
+            // wake-up event
+            if( !( w = _afd_watch_untag( tag ) ) ){
+                // pass to next waiting thread
+                if( !state->running ){
+                    _afd_loop_wakeup( state );
+                }
+                continue;
+            }
+            // deregistered or moved by other thread
+            else if( _afd_watch_stale( w, tag ) ){
+                continue;
+            }
+            
+            _afd_mtw = w;
+            if( state->slowcb )
+            {
+                // NOTE: w may be deallocated by callback
+                int fd = w->fd;
+                uint8_t flg = w->flg;
+                void *udata = w->udata;
+                
+                t = _afd_hrtime();
+                _afd_watch_dispatch( loop, w, hup );
+                t = _afd_hrtime() - t;
+                if( t >= state->slowcb ){
+                    afd_log_warn( "slow callback: fd %d flg %u udata %p %llu ns", 
+                                  fd, flg, udata, t );
+                }
+            }
+            else {
+                _afd_watch_dispatch( loop, w, hup );
+            }
+            // other threads can receive events of w after re-armed.
+            // NOTE: w may be deregistered by the callback of other watch, 
+            //       but its memory is kept until this thread finishes 
+            //       received events.(see afd_watch_release)
+            if( _afd_mtw == w )
+            {
+                _afd_watch_lock( w );
+                if( !_afd_watch_stale( w, tag ) && 
+                    _afd_watch_rearm( state, w ) == -1 ){
+                    pfelog( _afd_watch_rearm, "failed to re-arm watch: fd %d", 
+                            w->fd );
+                }
+                _afd_watch_unlock( w );
+            }
+            _afd_mtw = NULL;
+        }
+        // finish dispatching
+        __sync_add_and_fetch( &slot.seq, 1 );
+        if( state->gp ){
+            _afd_mtlock( state );
+            _afd_gp_reclaim( state );
+            _afd_mtunlock( state );
+        }
+    
+    } while( state->running );
+    
+    // leave from threads of loop
+    _afd_mtlock( state );
+    if( state->mtslots == &slot ){
+        state->mtslots = slot.next;
+    }
+    else {
+        afd_mtslot_t *prev = state->mtslots;
+        
+        while( prev->next != &slot ){
+            prev = prev->next;
+        }
+        prev->next = slot.next;
+    }
+    // no thread refers to deferred watches
+    if( !state->mtslots ){
+        _afd_defer_flush( state, UINT64_MAX );
+        state->gp = 0;
+    }
+    else if( state->gp ){
+        _afd_gp_reclaim( state );
+    }
+    _afd_mtunlock( state );
+    pdealloc( evs );
+    
+    return ( nevt == -1 ) ? -1 : 0;
+}
+
+
+void afd_unloop( afd_loop_t *loop )
+{
+    afd_state_t *state = loop->state;
+    
+    if( state->running )
+    {
+        state->running = 0;
+        // wake up the loop that is waiting in other thread
+        // NOTE: threads of shared loop wake up each other in chain
+        if( state->shared || !pthread_equal( state->thread, pthread_self() ) ){
+            _afd_loop_wakeup( state );
+        }
+    }
+}
+
+
+int afd_hook_init( afd_hook_t *h, afd_hook_cb cb, void *udata )
+{
+    if( cb ){
+        h->next = NULL;
+        h->cb = cb;
+        h->udata = udata;
+        return 0;
+    }
+    
+    // invalid arguments
+    errno = EINVAL;
+    
+    return -1;
+}
+
+static int _afd_hook_add( afd_hook_t **list, afd_hook_t *h )
+{
+    if( h->cb )
+    {
+        // append to tail
+        for(; *list; list = &(*list)->next )
+        {
+            // already registered
+            if( *list == h ){
+                errno = EALREADY;
+                return -1;
+            }
+        }
+        h->next = NULL;
+        *list = h;
+        return 0;
+    }
+    
+    // uninitialized hook
+    errno = EINVAL;
+    
+    return -1;
+}
+
+static int _afd_hook_del( afd_hook_t **list, afd_hook_t *h )
+{
+    for(; *list; list = &(*list)->next )
+    {
+        // NOTE: do not clear h->next that will be used by _afd_loop_hook
+        if( *list == h ){
+            *list = h->next;
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+int afd_loop_on_prepare( afd_loop_t *loop, afd_hook_t *h )
+{
+    return _afd_hook_add( &loop->state->prepare, h );
+}
+
+int afd_loop_on_check( afd_loop_t *loop, afd_hook_t *h )
+{
+    return _afd_hook_add( &loop->state->check, h );
+}
+
+int afd_loop_off_hook( afd_loop_t *loop, afd_hook_t *h )
+{
+    if( _afd_hook_del( &loop->state->prepare, h ) == 0 ||
+        _afd_hook_del( &loop->state->check, h ) == 0 ){
+        return 0;
+    }
+    
+    // not registered
+    errno = ENOENT;
+    
+    return -1;
+}
+
+
+int afd_watch_init( afd_watch_t *w, int fd, afd_evflag_e flg, afd_watch_cb cb, 
+                    void *udata )
+{
+    // valid defined descriptor, flag, callbacks
+    if( fd > 0 && flg && ( flg & AS_EV_ISVALID ) == 0 && cb )
+    {
+        // set passed args
+        w->fd = fd;
+        w->attr = flg & (AS_EV_MOVABLE|AS_EV_CONTROL|AS_EV_BULK);
+        w->lock = 0;
+        w->fflg = 0;
+        w->cb = NULL;
+        w->udata = udata;
+        flg &= ~(AS_EV_MOVABLE|AS_EV_CONTROL|AS_EV_BULK);
+        // watch belongs to only one priority class
+        if( ( w->attr & AS_EV_CONTROL ) && ( w->attr & AS_EV_BULK ) ){
+            errno = EINVAL;
+            return -1;
+        }
+        
+        // init filter
+        // kqueue will catch hang-up event on default.
+        if( flg & AS_EV_EDGE ){
+            flg &= ~AS_EV_EDGE; 
+#if USE_KQUEUE
             w->fflg = EV_ADD|EV_CLEAR;
 #elif USE_EPOLL
             w->filter = EPOLLRDHUP|EPOLLET;
@@ -512,26 +1483,53 @@ int afd_watch_init( afd_watch_t *w, int fd, afd_evflag_e flg, afd_watch_cb cb,
     return -1;
 }
 
-int afd_timer_init( afd_watch_t *w, struct timespec *tspec, afd_watch_cb cb, 
+int afd_watch_lowat( afd_watch_t *w, int lowat )
+{
+    if( w->flg != AS_EV_WRITE || lowat < 0 ){
+        errno = EINVAL;
+        return -1;
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    return setsockopt( w->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, 
+                       (socklen_t)sizeof( lowat ) );
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+// 1 if tspec is a positive interval
+static inline int _afd_timer_valid( struct timespec *tspec )
+{
+    return tspec->tv_sec >= 0 && tspec->tv_nsec >= 0 && 
+           tspec->tv_nsec < 1000000000L && ( tspec->tv_sec || tspec->tv_nsec );
+}
+
+int afd_timer_init( afd_timer_t *t, struct timespec *tspec, afd_watch_cb cb, 
                     void *udata )
 {
+    afd_watch_t *w = &t->w;
+    
     w->cb = NULL;
-    if( tspec && cb )
+    if( tspec && cb && _afd_timer_valid( tspec ) )
     {
         // set passed args
         w->udata = udata;
         w->flg = AS_EV_TIMER;
+        w->attr = 0;
+        w->lock = 0;
         
 #if USE_KQUEUE
         w->fd = 0;
         w->filter = EVFILT_TIMER;
         w->fflg = EV_ADD;
-        afd_timer_update( w, tspec );
+        afd_timer_update( t, tspec );
 #elif USE_EPOLL
         w->flg = AS_EV_TIMER;
         w->filter = EPOLLRDHUP|EPOLLIN;
-        w->tspec.it_value = (struct timespec){ .tv_sec = 0, .tv_nsec = 0 };
-        afd_timer_update( w, tspec );
+        w->fflg = 0;
+        t->tspec.it_value = (struct timespec){ .tv_sec = 0, .tv_nsec = 0 };
+        afd_timer_update( t, tspec );
         w->fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC );
         if( w->fd == -1 ){
             return -1;
@@ -546,70 +1544,184 @@ int afd_timer_init( afd_watch_t *w, struct timespec *tspec, afd_watch_cb cb,
     return -1;
 }
 
-void afd_timer_update( afd_watch_t *w, struct timespec *tspec )
+int afd_timer_update( afd_timer_t *t, struct timespec *tspec )
 {
+    // zero interval disarms timerfd, and kqueue rejects it
+    if( !_afd_timer_valid( tspec ) ){
+        errno = EINVAL;
+        return -1;
+    }
+    
     // update time interval
 #if USE_KQUEUE
-    w->tspec = (struct timespec){ 
+    t->tspec = (struct timespec){ 
         .tv_sec = tspec->tv_sec,
         .tv_nsec = tspec->tv_nsec
     };
 #elif USE_EPOLL
-    w->tspec.it_interval = (struct timespec){
+    t->tspec.it_interval = (struct timespec){
         .tv_sec = tspec->tv_sec,
         .tv_nsec = tspec->tv_nsec
     };
 #endif
+    AFD_PROBE3( timer__update, &t->w, tspec->tv_sec, tspec->tv_nsec );
+    
+    return 0;
 }
 
-int afd_watch( afd_loop_t *loop, afd_watch_t *w )
+int _afd_timer_arm( afd_state_t *state, afd_watch_t *w, int fire )
+{
+#if USE_KQUEUE
+    struct kevent evt;
+    
+    // fire once and keep registered
+    EV_SET( &evt, (uintptr_t)w, EVFILT_TIMER, 
+            fire ? EV_ADD|EV_ENABLE|EV_DISPATCH : EV_ADD|EV_DISABLE, 
+            NOTE_NSECONDS, 1, _afd_watch_tag( w ) );
+    return kevent( state->fd, &evt, 1, NULL, 0, NULL );
+
+#elif USE_EPOLL
+    struct itimerspec tspec = {
+        .it_interval = { 0, 0 },
+        .it_value = { 0, fire ? 1 : 0 }
+    };
+    
+    return timerfd_settime( w->fd, 0, &tspec, NULL );
+#endif
+}
+
+// remove remaining events of w from received events of current iteration
+static void _afd_watch_scrub( afd_state_t *state, afd_watch_t *w )
+{
+    int i = 0;
+    
+    for(; i < state->nevt; i++ )
+    {
+#if USE_KQUEUE
+        if( _afd_watch_untag( state->rcv_evs[i].udata ) == w ){
+            state->rcv_evs[i].udata = NULL;
+        }
+#elif USE_EPOLL
+        if( _afd_watch_untag( state->rcv_evs[i].data.ptr ) == w ){
+            state->rcv_evs[i].data.ptr = NULL;
+        }
+#endif
+    }
+}
+
+// register event to state
+static int _afd_watch_add( afd_state_t *state, afd_watch_t *w )
 {
     int rc = 0;
+    
+    // generation tag cannot be stored to the address
+    if( _afd_watch_untaggable( w ) ){
+        errno = EINVAL;
+        return -1;
+    }
 #if USE_KQUEUE
     struct kevent evt;
+    // disable event after delivery to one thread of shared loop
+    uint16_t fflg = state->shared ? w->fflg|EV_DISPATCH : w->fflg;
     
     if( w->filter == EVFILT_TIMER ){
-        EV_SET( &evt, (uintptr_t)w, EVFILT_TIMER, w->fflg, NOTE_NSECONDS, 
-                w->tspec.tv_sec * 1000000000 + w->tspec.tv_nsec, (void*)w );
+        struct timespec *tspec = &((afd_timer_t*)w)->tspec;
+        
+        EV_SET( &evt, (uintptr_t)w, EVFILT_TIMER, fflg, NOTE_NSECONDS, 
+                tspec->tv_sec * 1000000000 + tspec->tv_nsec, _afd_watch_tag( w ) );
     }
     else {
-        EV_SET( &evt, w->fd, w->filter, w->fflg, 0, 0, (void*)w );
+        EV_SET( &evt, w->fd, w->filter, fflg, 0, 0, _afd_watch_tag( w ) );
     }
     // register event
-    rc = kevent( loop->state->fd, &evt, 1, NULL, 0, NULL );
+    rc = kevent( state->fd, &evt, 1, NULL, 0, NULL );
 
 #elif USE_EPOLL
     struct epoll_event evt;
     
+    // set udata pointer with generation tag
+    evt.data.ptr = _afd_watch_tag( w );
+    evt.events = w->filter;
+    // disable event after delivery to one thread of shared loop
+    if( state->shared ){
+        evt.events |= EPOLLONESHOT;
+    }
+    // register event
+    rc = epoll_ctl( state->fd, EPOLL_CTL_ADD, w->fd, &evt );
+#endif
+    // increment number of registered event
+    // NOTE: receive events container will be expanded by _afd_loop
+    if( !rc ){
+        __sync_add_and_fetch( &state->nreg, 1 );
+        // dispatch events in the order of priority class from now on
+        if( w->attr & (AS_EV_CONTROL|AS_EV_BULK) ){
+            state->prio = 1;
+        }
+    }
+    
+    return rc;
+}
+
+// deregister event from state
+static int _afd_watch_del( afd_state_t *state, afd_watch_t *w )
+{
+    int rc = 0;
+#if USE_KQUEUE
+    struct kevent evt;
+    
+    // use address for ident if kqueue timer event
+    if( w->filter == EVFILT_TIMER ){
+        EV_SET( &evt, (uintptr_t)w, w->filter, EV_DELETE, 0, 0, NULL );
+    }
+    else {
+        EV_SET( &evt, w->fd, w->filter, EV_DELETE, 0, 0, NULL );
+    }
+    // deregister event
+    rc = kevent( state->fd, &evt, 1, NULL, 0, NULL );
+    
+#elif USE_EPOLL
+    struct epoll_event evt;
+    
+    // deregister event
+    // do not set null to event argument for portability
+    rc = epoll_ctl( state->fd, EPOLL_CTL_DEL, w->fd, &evt );
+#endif
+    
+    // decrement number of registered event
+    if( !rc ){
+        __sync_sub_and_fetch( &state->nreg, 1 );
+    }
+    
+    return rc;
+}
+
+int afd_watch( afd_loop_t *loop, afd_watch_t *w )
+{
+    int rc = 0;
+    
+    // callback of afd_watch_eager registered the watch by itself
+    if( _afd_eagerw == w ){
+        _afd_eagerw = NULL;
+    }
+#if USE_EPOLL
     if( w->flg & AS_EV_TIMER )
     {
-        struct timespec cur;
+        struct itimerspec *tspec = &((afd_timer_t*)w)->tspec;
         
-        // get current time
-        if( clock_gettime( CLOCK_MONOTONIC, &cur ) == -1 ){
-            return -1;
-        }
-        // set first invocation time
-        w->tspec.it_value = (struct timespec){ 
-            .tv_sec = cur.tv_sec +  w->tspec.it_interval.tv_sec,
-            .tv_nsec = cur.tv_nsec + w->tspec.it_interval.tv_nsec
-        };
-        if( timerfd_settime( w->fd, TFD_TIMER_ABSTIME, &w->tspec, NULL ) == -1 ){
+        // set first invocation time relative to current time
+        tspec->it_value = tspec->it_interval;
+        if( timerfd_settime( w->fd, 0, tspec, NULL ) == -1 ){
             return -1;
         }
     }
-    // set udata pointer
-    evt.data.ptr = (void*)w;
-    evt.events = w->filter;
-    // register event
-    rc = epoll_ctl( loop->state->fd, EPOLL_CTL_ADD, w->fd, &evt );
 #endif
-    // realloc receive events container
-    if( !rc && 
-        ++loop->state->nreg > loop->state->nrcv && 
-        _afd_state_realloc( loop->state, loop->state->nreg ) == -1 ){
-        return -1;
+    // enable RX timestamps of socket
+    // NOTE: ignore an error of the descriptor that is not a socket
+    if( loop->state->rxstamp && w->flg == AS_EV_READ ){
+        afd_rxstamp_enable( w->fd, loop->state->rxstamp );
     }
+    rc = _afd_watch_add( loop->state, w );
+    AFD_PROBE3( watch, w->fd, w->flg, rc );
     
     return rc;
 }
@@ -632,49 +1744,84 @@ int afd_nwatch( afd_loop_t *loop, ... )
     return 0;
 }
 
+int afd_watch_eager( afd_loop_t *loop, afd_watch_t *w )
+{
+    afd_watch_t *prev = _afd_eagerw;
+    ssize_t len = 0;
+    char c = 0;
+    
+    if( w->flg != AS_EV_READ ){
+        errno = EINVAL;
+        return -1;
+    }
+    
+    // register if data has not arrived yet
+    len = recv( w->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT );
+    if( len == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK || 
+                       errno == ENOTSOCK ) ){
+        return afd_watch( loop, w );
+    }
+    
+    // dispatch as the event loop does. end of stream and errors are 
+    // passed as hang-up.
+    _afd_eagerw = w;
+    _afd_loop_dispatch( loop, w, len < 1 );
+    // callback kept the watch
+    if( _afd_eagerw == w ){
+        _afd_eagerw = prev;
+        return afd_watch( loop, w );
+    }
+    _afd_eagerw = prev;
+    
+    return 0;
+}
+
 int afd_unwatch( afd_loop_t *loop, int closefd, afd_watch_t *w )
 {
     if( w->cb )
     {
-        int rc = 0;
-#if USE_KQUEUE
-        struct kevent evt;
-        
-        // use address for ident if kqueue timer event
-        if( w->filter == EVFILT_TIMER )
-        {
-            EV_SET( &evt, (uintptr_t)w, w->filter, EV_DELETE, 0, 0, NULL );
-            // deregister event
-            rc = kevent( loop->state->fd, &evt, 1, NULL, 0, NULL );
+        AFD_PROBE3( unwatch, w->fd, w->flg, closefd );
+        if( loop->state->trace ){
+            _afd_trace_unwatch( loop->state->trace, w->fd );
         }
-        else
-        {
-            EV_SET( &evt, w->fd, w->filter, EV_DELETE, 0, 0, NULL );
-            // deregister event
-            rc = kevent( loop->state->fd, &evt, 1, NULL, 0, NULL );
-            if( closefd ){
-                shutdown( w->fd, SHUT_RDWR );
-                close( w->fd );
-            }
+        // skip remaining events of w
+        // NOTE: exclude re-arming by other thread of shared loop
+        if( loop->state->shared ){
+            _afd_watch_lock( w );
+            _afd_watch_del( loop->state, w );
+            w->gen++;
+            _afd_watch_unlock( w );
         }
-        
+        else {
+            _afd_watch_del( loop->state, w );
+            w->gen++;
+        }
+        // carried over event refers to w in next iteration
+        if( w->attr & AFD_WATCH_CARRIED ){
+            _afd_bulk_remove( loop->state, w );
+        }
+#if AFD_WATCH_UNTAGGED
+        // generation of w is not passed with events
+        _afd_watch_scrub( loop->state, w );
+#endif
+        // do not re-arm deregistered watch
+        if( _afd_mtw == w ){
+            _afd_mtw = NULL;
+        }
+        // do not register deregistered watch
+        else if( _afd_eagerw == w ){
+            _afd_eagerw = NULL;
+        }
+#if USE_KQUEUE
+        // kqueue timer event has no descriptor
+        if( closefd && w->filter != EVFILT_TIMER ){
 #elif USE_EPOLL
-        struct epoll_event evt;
-        
-        // deregister event
-        // do not set null to event argument for portability
-        rc = epoll_ctl( loop->state->fd, EPOLL_CTL_DEL, w->fd, &evt );
         // use timerfd with epoll
         if( closefd ){
+#endif
             shutdown( w->fd, SHUT_RDWR );
             close( w->fd );
         }
-#endif
-    
-        // decrement number of registered event
-        if( !rc ){
-            loop->state->nreg--;
-        }
     }
     
     return 0;
@@ -695,5 +1842,211 @@ int afd_unnwatch( afd_loop_t *loop, int closefd, ... )
     return rc;
 }
 
+int afd_watch_release( afd_loop_t *loop, afd_watch_t *w, afd_watch_free_cb cb )
+{
+    afd_state_t *state = loop->state;
+    
+    if( !cb ){
+        errno = EINVAL;
+        return -1;
+    }
+    else if( state->shared )
+    {
+        _afd_mtlock( state );
+        // no thread has received events
+        if( !state->mtslots ){
+            _afd_mtunlock( state );
+            cb( w );
+            return 0;
+        }
+    }
+    // not dispatching
+    else if( !state->nevt ){
+        cb( w );
+        return 0;
+    }
+    
+    if( state->ndefer == state->maxdefer )
+    {
+        int maxdefer = state->maxdefer ? state->maxdefer * 2 : 16;
+        afd_defer_t *defer = prealloc( maxdefer, afd_defer_t, state->defer );
+        
+        if( !defer ){
+            if( state->shared ){
+                _afd_mtunlock( state );
+            }
+            return -1;
+        }
+        state->defer = defer;
+        state->maxdefer = maxdefer;
+    }
+    state->defer[state->ndefer++] = (afd_defer_t){
+        .w = w,
+        .cb = cb,
+        .epoch = state->epoch
+    };
+    if( state->shared )
+    {
+        if( !state->gp ){
+            _afd_gp_start( state );
+        }
+        _afd_mtunlock( state );
+    }
+    
+    return 0;
+}
+
+int afd_watch_move( afd_loop_t *from, afd_loop_t *to, afd_watch_t *w )
+{
+    afd_state_t *state = from->state;
+    int rc = 0;
+    
+    if( from == to || !w->cb ){
+        errno = EINVAL;
+        return -1;
+    }
+    
+    // skip remaining events of w that other threads of shared loop received
+    if( state->shared ){
+        _afd_watch_lock( w );
+    }
+    w->gen++;
+    // register to destination loop at first
+    if( _afd_watch_add( to->state, w ) == -1 ){
+        w->gen--;
+        rc = -1;
+    }
+    else if( _afd_watch_del( state, w ) == -1 ){
+        int err = errno;
+        // rollback
+        _afd_watch_del( to->state, w );
+        w->gen--;
+        errno = err;
+        rc = -1;
+    }
+    if( state->shared ){
+        _afd_watch_unlock( w );
+    }
+    if( rc == -1 ){
+        return -1;
+    }
+    else if( _afd_mtw == w ){
+        _afd_mtw = NULL;
+    }
+    else if( w->attr & AFD_WATCH_CARRIED ){
+        _afd_bulk_remove( state, w );
+    }
+    
+    // remove remaining events of w from current iteration, so "from" never 
+    // refers to w that may be deallocated by "to"
+    _afd_watch_scrub( state, w );
+    
+    return 0;
+}
+
+
+typedef struct {
+    afd_loop_t *loop;
+    uint64_t busy;
+} afd_balancer_ent_t;
+
+struct _afd_balancer_t {
+    int nloop;
+    int nmove;
+    double threshold;
+    uint64_t last;
+    afd_balancer_ent_t *ents;
+};
+
+afd_balancer_t *afd_balancer_alloc( afd_loop_t **loops, int nloop, 
+                                    double threshold, int nmove )
+{
+    if( nloop > 1 && threshold > 0 && threshold < 1 && nmove > 0 )
+    {
+        afd_balancer_t *b = palloc( afd_balancer_t );
+        
+        if( b && ( b->ents = pnalloc( nloop, afd_balancer_ent_t ) ) )
+        {
+            int i = 0;
+            
+            b->nloop = nloop;
+            b->nmove = nmove;
+            b->threshold = threshold;
+            b->last = _afd_hrtime();
+            for(; i < nloop; i++ ){
+                loops[i]->state->balanced = 1;
+                b->ents[i].loop = loops[i];
+                b->ents[i].busy = loops[i]->state->busy;
+            }
+            return b;
+        }
+        
+        pdealloc( b );
+        return NULL;
+    }
+    
+    // invalid arguments
+    errno = EINVAL;
+    
+    return NULL;
+}
+
+void afd_balancer_dealloc( afd_balancer_t *b )
+{
+    int i = 0;
+    
+    for(; i < b->nloop; i++ ){
+        b->ents[i].loop->state->shed = 0;
+        b->ents[i].loop->state->balanced = 0;
+    }
+    pdealloc( b->ents );
+    pdealloc( b );
+}
+
+int afd_balance( afd_balancer_t *b )
+{
+    uint64_t now = _afd_hrtime();
+    double elapsed = (double)( now - b->last );
+    double load[b->nloop];
+    int idle = 0;
+    int noverload = 0;
+    int i = 0;
+    
+    if( elapsed <= 0 ){
+        return 0;
+    }
+    
+    // calc busy ratio of each loop since last call
+    for(; i < b->nloop; i++ )
+    {
+        uint64_t busy = b->ents[i].loop->state->busy;
+        
+        load[i] = (double)( busy - b->ents[i].busy ) / elapsed;
+        b->ents[i].busy = busy;
+        if( load[i] < load[idle] ){
+            idle = i;
+        }
+    }
+    b->last = now;
+    
+    // mark overloaded loops
+    for( i = 0; i < b->nloop; i++ )
+    {
+        afd_state_t *state = b->ents[i].loop->state;
+        
+        if( i != idle && load[i] > b->threshold && load[idle] < b->threshold ){
+            state->shed_to = b->ents[idle].loop;
+            __sync_synchronize();
+            state->shed = b->nmove;
+            noverload++;
+        }
+        else {
+            state->shed = 0;
+        }
+    }
+    
+    return noverload;
+}
+
 
 
@@ -0,0 +1,145 @@
+/*
+ *  asyncfd_admit.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+#include "libasyncfd_admit.h"
+#include "asyncfd_private.h"
+
+// weight of moving average of loop lag(1/8)
+#define AFD_ADMIT_LAG_SHIFT 3
+
+struct _afd_admit_t {
+    afd_admit_conf_t conf;
+    afd_watch_t *listen;
+    int paused;
+    volatile int64_t nconn;
+    volatile int64_t outq;
+    uint64_t lag;
+};
+
+
+void _afd_admit_update( afd_loop_t *loop, uint64_t busy )
+{
+    afd_admit_t *admit = loop->state->admit;
+    afd_admit_conf_t *conf = &admit->conf;
+    int64_t nconn = admit->nconn;
+    int64_t outq = admit->outq;
+    
+    // exponential moving average
+    admit->lag = admit->lag - ( admit->lag >> AFD_ADMIT_LAG_SHIFT ) +
+                 ( busy >> AFD_ADMIT_LAG_SHIFT );
+    
+    if( !admit->paused )
+    {
+        if( ( conf->maxconn && nconn >= conf->maxconn ) ||
+            ( conf->maxoutq && outq >= (int64_t)conf->maxoutq ) ||
+            ( conf->maxlag && admit->lag >= conf->maxlag ) )
+        {
+            if( afd_unwatch( loop, 0, admit->listen ) == 0 ){
+                admit->paused = 1;
+                afd_log_info( "pause accepting: conn %lld outq %lld lag %llu ns",
+                              nconn, outq, admit->lag );
+            }
+        }
+    }
+    // resume if all values fall to low watermarks
+    else if( ( !conf->maxconn || nconn <= conf->lowconn ) &&
+             ( !conf->maxoutq || outq <= (int64_t)conf->lowoutq ) &&
+             ( !conf->maxlag || admit->lag <= conf->lowlag ) )
+    {
+        if( afd_watch( loop, admit->listen ) == 0 ){
+            admit->paused = 0;
+            afd_log_info( "resume accepting: conn %lld outq %lld lag %llu ns",
+                          nconn, outq, admit->lag );
+        }
+        else {
+            pfelog( afd_watch, "failed to resume accepting" );
+        }
+    }
+}
+
+void _afd_admit_dealloc( afd_admit_t *admit )
+{
+    pdealloc( admit );
+}
+
+
+int afd_admit_init( afd_loop_t *loop, afd_watch_t *listen,
+                    const afd_admit_conf_t *conf )
+{
+    afd_admit_t *admit = loop->state->admit;
+    
+    if( !listen || !conf || conf->lowconn > conf->maxconn ||
+        conf->lowoutq > conf->maxoutq || conf->lowlag > conf->maxlag ){
+        errno = EINVAL;
+        return -1;
+    }
+    // keep current state and counters
+    else if( admit ){
+        if( admit->paused && admit->listen != listen ){
+            errno = EBUSY;
+            return -1;
+        }
+        admit->conf = *conf;
+        admit->listen = listen;
+        return 0;
+    }
+    else if( !( admit = palloc( afd_admit_t ) ) ){
+        return -1;
+    }
+    
+    admit->conf = *conf;
+    admit->listen = listen;
+    admit->paused = 0;
+    admit->nconn = 0;
+    admit->outq = 0;
+    admit->lag = 0;
+    loop->state->admit = admit;
+    
+    return 0;
+}
+
+void afd_admit_dispose( afd_loop_t *loop )
+{
+    afd_admit_t *admit = loop->state->admit;
+    
+    if( admit ){
+        loop->state->admit = NULL;
+        if( admit->paused ){
+            afd_watch( loop, admit->listen );
+        }
+        _afd_admit_dealloc( admit );
+    }
+}
+
+void afd_admit_conn( afd_loop_t *loop, int delta )
+{
+    afd_admit_t *admit = loop->state->admit;
+    
+    // NOTE: connection may be moved to other loop by other thread
+    if( admit ){
+        __sync_add_and_fetch( &admit->nconn, delta );
+    }
+}
+
+void afd_admit_outq( afd_loop_t *loop, int64_t delta )
+{
+    afd_admit_t *admit = loop->state->admit;
+    
+    if( admit ){
+        __sync_add_and_fetch( &admit->outq, delta );
+    }
+}
+
+int afd_admit_paused( afd_loop_t *loop )
+{
+    afd_admit_t *admit = loop->state->admit;
+    
+    return admit ? admit->paused : -1;
+}
+
@@ -0,0 +1,214 @@
+/*
+ *  asyncfd_frame.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include "libasyncfd_frame.h"
+#include "asyncfd_private.h"
+
+// value of length prefix
+static inline uint64_t _afd_frame_prefix( afd_frame_t *f, const char *p )
+{
+    const unsigned char *u = (const unsigned char*)p;
+    uint64_t v = 0;
+    int i = 0;
+    
+    if( f->conf.le ){
+        for( i = f->conf.prefix - 1; i >= 0; i-- ){
+            v = v << 8 | u[i];
+        }
+    }
+    else {
+        for(; i < f->conf.prefix; i++ ){
+            v = v << 8 | u[i];
+        }
+    }
+    
+    return v;
+}
+
+// total length of the frame at the head of unparsed data, 0 if incomplete,
+// or -1 on failure.
+static ssize_t _afd_frame_len( afd_frame_t *f, const char *p, size_t len,
+                               size_t *off, size_t *plen )
+{
+    afd_frame_conf_t *conf = &f->conf;
+    
+    // length prefixed
+    if( conf->prefix )
+    {
+        uint64_t v = 0;
+        
+        if( len < conf->prefix ){
+            return 0;
+        }
+        v = _afd_frame_prefix( f, p );
+        if( conf->inclusive && v < conf->prefix ){
+            errno = EBADMSG;
+            return -1;
+        }
+        else if( v > conf->maxlen ||
+                 ( !conf->inclusive && ( v += conf->prefix ) > conf->maxlen ) ){
+            errno = EMSGSIZE;
+            return -1;
+        }
+        else if( len < v ){
+            return 0;
+        }
+        *off = conf->prefix;
+        *plen = v - conf->prefix;
+        
+        return (ssize_t)v;
+    }
+    else
+    {
+        const char *s = p + f->scan;
+        const char *e = p + len;
+        
+        // find delimiter from the position that has not been searched
+        while( ( s = memchr( s, conf->delim[0], e - s ) ) )
+        {
+            // rest of delimiter has not arrived
+            if( (size_t)( e - s ) < conf->dlen ){
+                break;
+            }
+            else if( !memcmp( s, conf->delim, conf->dlen ) ){
+                f->scan = 0;
+                *off = 0;
+                *plen = s - p;
+                return (ssize_t)( *plen + conf->dlen );
+            }
+            s++;
+        }
+        
+        f->scan = s ? (size_t)( s - p ) : len;
+        if( len >= conf->maxlen ){
+            errno = EMSGSIZE;
+            return -1;
+        }
+        
+        return 0;
+    }
+}
+
+
+int afd_frame_init( afd_frame_t *f, const afd_frame_conf_t *conf,
+                    afd_frame_cb cb, void *udata )
+{
+    size_t size = AFD_FRAME_BUFSIZE;
+    
+    if( !conf || !cb || !conf->maxlen ||
+        ( conf->prefix && conf->prefix != 1 && conf->prefix != 2 &&
+          conf->prefix != 4 && conf->prefix != 8 ) ||
+        ( conf->prefix && conf->maxlen < conf->prefix ) ||
+        ( !conf->prefix &&
+          ( !conf->dlen || conf->dlen > AFD_FRAME_MAX_DELIM ||
+            conf->maxlen < conf->dlen ) ) ){
+        errno = EINVAL;
+        return -1;
+    }
+    else if( conf->maxlen > size ){
+        size = conf->maxlen;
+    }
+    
+    if( !( f->buf = pnalloc( size, char ) ) ){
+        return -1;
+    }
+    f->conf = *conf;
+    f->size = size;
+    f->head = 0;
+    f->tail = 0;
+    f->scan = 0;
+    f->cb = cb;
+    f->udata = udata;
+    
+    return 0;
+}
+
+void afd_frame_dispose( afd_frame_t *f )
+{
+    pdealloc( f->buf );
+    f->buf = NULL;
+}
+
+
+int afd_frame_parse( afd_frame_t *f )
+{
+    struct iovec msgs[AFD_FRAME_BATCH];
+    int nmsg = 0;
+    int err = 0;
+    ssize_t flen = 0;
+    size_t off = 0;
+    size_t plen = 0;
+    
+    while( ( flen = _afd_frame_len( f, f->buf + f->head, f->tail - f->head,
+                                    &off, &plen ) ) > 0 )
+    {
+        msgs[nmsg].iov_base = f->buf + f->head + off;
+        msgs[nmsg].iov_len = plen;
+        f->head += flen;
+        if( ++nmsg == AFD_FRAME_BATCH )
+        {
+            if( f->cb( f, msgs, nmsg ) == -1 ){
+                errno = ECANCELED;
+                return -1;
+            }
+            nmsg = 0;
+        }
+    }
+    
+    // pass complete frames before failure
+    err = errno;
+    if( nmsg && f->cb( f, msgs, nmsg ) == -1 ){
+        errno = ECANCELED;
+        return -1;
+    }
+    else if( flen == -1 ){
+        errno = err;
+        return -1;
+    }
+    // reuse buffer from the head
+    else if( f->head == f->tail ){
+        f->head = f->tail = 0;
+    }
+    
+    return 0;
+}
+
+
+ssize_t afd_frame_read( afd_frame_t *f, int fd )
+{
+    ssize_t len = 0;
+    
+    // buffer is filled with the frames that callback left
+    if( f->tail == f->size && !f->head && afd_frame_parse( f ) == -1 ){
+        return -1;
+    }
+    // move incomplete frame to the head of buffer if buffer is full or the
+    // rest of length prefixed frame does not fit in
+    if( f->head &&
+             ( f->tail == f->size ||
+               ( f->conf.prefix && f->tail - f->head >= f->conf.prefix &&
+                 f->head + _afd_frame_prefix( f, f->buf + f->head ) +
+                 ( f->conf.inclusive ? 0 : f->conf.prefix ) > f->size ) ) ){
+        f->tail -= f->head;
+        memmove( f->buf, f->buf + f->head, f->tail );
+        f->head = 0;
+    }
+    
+    if( ( len = read( fd, f->buf + f->tail, f->size - f->tail ) ) > 0 ){
+        f->tail += len;
+        if( afd_frame_parse( f ) == -1 ){
+            return -1;
+        }
+    }
+    
+    return len;
+}
+
@@ -0,0 +1,489 @@
+/*
+ *  asyncfd_http.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+#include "libasyncfd_http.h"
+#include "asyncfd_private.h"
+#include <string.h>
+#include <stddef.h>
+#include <strings.h>
+#include <unistd.h>
+
+#if HAVE_NMMINTRIN_H && HAVE_IMMINTRIN_H && defined(__GNUC__) && \
+    ( defined(__x86_64__) || defined(__i386__) )
+#include <nmmintrin.h>
+#include <immintrin.h>
+#define AFD_HTTP_SIMD   1
+#endif
+
+/*
+    scanner of the request bytes.
+    return pointer to the first delimiter(control character) or end.
+*/
+typedef const char *(*afd_http_scan_fn)( const char *p, const char *end );
+
+// token: method and uri are delimited by SP or control characters
+#define _afd_http_istokdelim(c) \
+    ((unsigned char)(c) <= 0x20 || (unsigned char)(c) == 0x7f)
+// value: header value is delimited by control characters except HTAB
+#define _afd_http_isvaldelim(c) \
+    (((unsigned char)(c) < 0x20 && (c) != '\t') || (unsigned char)(c) == 0x7f)
+
+static const char *_afd_http_scan_token( const char *p, const char *end )
+{
+    for(; p < end && !_afd_http_istokdelim( *p ); p++ ){}
+    return p;
+}
+
+static const char *_afd_http_scan_value( const char *p, const char *end )
+{
+    for(; p < end && !_afd_http_isvaldelim( *p ); p++ ){}
+    return p;
+}
+
+#if AFD_HTTP_SIMD
+
+#define AFD_HTTP_SSE42_MODE \
+    (_SIDD_UBYTE_OPS|_SIDD_CMP_RANGES|_SIDD_LEAST_SIGNIFICANT)
+
+// NOTE: ranges must be 16 bytes for unaligned load
+static const char AFD_HTTP_TOKEN_RANGES[16] = "\x00\x20\x7f\x7f";
+static const char AFD_HTTP_VALUE_RANGES[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+
+__attribute__((target("sse4.2")))
+static const char *_afd_http_scan_token_sse42( const char *p, const char *end )
+{
+    const __m128i ranges = _mm_loadu_si128( (const __m128i*)AFD_HTTP_TOKEN_RANGES );
+    int idx = 0;
+    
+    for(; end - p >= 16; p += 16 )
+    {
+        idx = _mm_cmpestri( ranges, 4, _mm_loadu_si128( (const __m128i*)p ),
+                            16, AFD_HTTP_SSE42_MODE );
+        if( idx != 16 ){
+            return p + idx;
+        }
+    }
+    
+    return _afd_http_scan_token( p, end );
+}
+
+__attribute__((target("sse4.2")))
+static const char *_afd_http_scan_value_sse42( const char *p, const char *end )
+{
+    const __m128i ranges = _mm_loadu_si128( (const __m128i*)AFD_HTTP_VALUE_RANGES );
+    int idx = 0;
+    
+    for(; end - p >= 16; p += 16 )
+    {
+        idx = _mm_cmpestri( ranges, 6, _mm_loadu_si128( (const __m128i*)p ),
+                            16, AFD_HTTP_SSE42_MODE );
+        if( idx != 16 ){
+            return p + idx;
+        }
+    }
+    
+    return _afd_http_scan_value( p, end );
+}
+
+// mask of bytes that less than or equal to lim or DEL
+__attribute__((target("avx2")))
+static inline unsigned int _afd_http_ctlmask_avx2( __m256i b, char lim )
+{
+    const __m256i vlim = _mm256_set1_epi8( lim );
+    __m256i m = _mm256_cmpeq_epi8( _mm256_max_epu8( b, vlim ), vlim );
+    
+    m = _mm256_or_si256( m, _mm256_cmpeq_epi8( b, _mm256_set1_epi8( 0x7f ) ) );
+    return (unsigned int)_mm256_movemask_epi8( m );
+}
+
+__attribute__((target("avx2")))
+static const char *_afd_http_scan_token_avx2( const char *p, const char *end )
+{
+    unsigned int mask = 0;
+    
+    for(; end - p >= 32; p += 32 )
+    {
+        mask = _afd_http_ctlmask_avx2( _mm256_loadu_si256( (const __m256i*)p ),
+                                       0x20 );
+        if( mask ){
+            return p + __builtin_ctz( mask );
+        }
+    }
+    
+    return _afd_http_scan_token( p, end );
+}
+
+__attribute__((target("avx2")))
+static const char *_afd_http_scan_value_avx2( const char *p, const char *end )
+{
+    const __m256i tab = _mm256_set1_epi8( '\t' );
+    unsigned int mask = 0;
+    __m256i b;
+    
+    for(; end - p >= 32; p += 32 )
+    {
+        b = _mm256_loadu_si256( (const __m256i*)p );
+        // exclude HTAB
+        mask = _afd_http_ctlmask_avx2( b, 0x1f ) &
+               ~(unsigned int)_mm256_movemask_epi8( _mm256_cmpeq_epi8( b, tab ) );
+        if( mask ){
+            return p + __builtin_ctz( mask );
+        }
+    }
+    
+    return _afd_http_scan_value( p, end );
+}
+
+static const char *_afd_http_scan_token_init( const char *p, const char *end );
+static const char *_afd_http_scan_value_init( const char *p, const char *end );
+static afd_http_scan_fn _afd_http_token_fn = _afd_http_scan_token_init;
+static afd_http_scan_fn _afd_http_value_fn = _afd_http_scan_value_init;
+
+// select scanners by cpu features at first call
+static void _afd_http_simd_init( void )
+{
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) ){
+        _afd_http_token_fn = _afd_http_scan_token_avx2;
+        _afd_http_value_fn = _afd_http_scan_value_avx2;
+    }
+    else if( __builtin_cpu_supports( "sse4.2" ) ){
+        _afd_http_token_fn = _afd_http_scan_token_sse42;
+        _afd_http_value_fn = _afd_http_scan_value_sse42;
+    }
+    else {
+        _afd_http_token_fn = _afd_http_scan_token;
+        _afd_http_value_fn = _afd_http_scan_value;
+    }
+}
+
+static const char *_afd_http_scan_token_init( const char *p, const char *end )
+{
+    _afd_http_simd_init();
+    return _afd_http_token_fn( p, end );
+}
+
+static const char *_afd_http_scan_value_init( const char *p, const char *end )
+{
+    _afd_http_simd_init();
+    return _afd_http_value_fn( p, end );
+}
+
+#else
+
+static afd_http_scan_fn _afd_http_token_fn = _afd_http_scan_token;
+static afd_http_scan_fn _afd_http_value_fn = _afd_http_scan_value;
+
+#endif
+
+
+void afd_http_req_init( afd_http_req_t *req )
+{
+    req->prev = 0;
+    req->hlen = 0;
+}
+
+// return pointer to the end of headers(next to empty line), or NULL
+static const char *_afd_http_eoh( const char *p, const char *end )
+{
+    const char *lf = NULL;
+    
+    while( ( lf = memchr( p, '\n', end - p ) ) )
+    {
+        p = lf + 1;
+        // LF LF or LF CR LF
+        if( p < end && *p == '\n' ){
+            return p + 1;
+        }
+        else if( end - p > 1 && p[0] == '\r' && p[1] == '\n' ){
+            return p + 2;
+        }
+    }
+    
+    return NULL;
+}
+
+// return pointer to the next line, or NULL if p is not end of line
+static inline const char *_afd_http_eol( const char *p, const char *end )
+{
+    if( p == end ){
+        return NULL;
+    }
+    else if( *p == '\n' ){
+        return p + 1;
+    }
+    else if( *p == '\r' && end - p > 1 && p[1] == '\n' ){
+        return p + 2;
+    }
+    
+    return NULL;
+}
+
+// check a comma separated value list contains token.(case insensitive)
+static int _afd_http_hastoken( const char *val, size_t vlen, const char *tok,
+                               size_t tlen )
+{
+    const char *end = val + vlen;
+    const char *p = val;
+    
+    for(; end - p >= (ptrdiff_t)tlen; p++ )
+    {
+        if( strncasecmp( p, tok, tlen ) == 0 &&
+            ( p == val || p[-1] == ',' || p[-1] == ' ' || p[-1] == '\t' ) &&
+            ( p + tlen == end || p[tlen] == ',' || p[tlen] == ' ' ||
+              p[tlen] == '\t' ) ){
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+// return 0 on success, or errno on failure
+static int _afd_http_parse_hdr( afd_http_req_t *req, afd_http_hdr_t *hdr )
+{
+    const char *p = hdr->val;
+    const char *end = p + hdr->vlen;
+    size_t clen = 0;
+    
+    switch( hdr->nlen )
+    {
+        case 10:
+            if( strncasecmp( hdr->name, "connection", 10 ) == 0 )
+            {
+                if( _afd_http_hastoken( p, hdr->vlen, "close", 5 ) ){
+                    req->keepalive = 0;
+                }
+                else if( _afd_http_hastoken( p, hdr->vlen, "keep-alive", 10 ) ){
+                    req->keepalive = 1;
+                }
+            }
+        break;
+        case 14:
+            if( strncasecmp( hdr->name, "content-length", 14 ) == 0 )
+            {
+                // empty value or duplicated
+                if( p == end || req->body ){
+                    return EINVAL;
+                }
+                for(; p < end; p++ )
+                {
+                    if( *p < '0' || *p > '9' ||
+                        clen > ( SIZE_MAX - 9 ) / 10 ){
+                        return EINVAL;
+                    }
+                    clen = clen * 10 + ( *p - '0' );
+                }
+                req->clen = clen;
+                // mark content-length found(body will be set after parsed)
+                req->body = p;
+            }
+        break;
+        case 17:
+            if( strncasecmp( hdr->name, "transfer-encoding", 17 ) == 0 &&
+                !( hdr->vlen == 8 && strncasecmp( p, "identity", 8 ) == 0 ) ){
+                return ENOTSUP;
+            }
+        break;
+    }
+    
+    return 0;
+}
+
+// return length of headers, or negative errno on failure
+static ssize_t _afd_http_parse( afd_http_req_t *req, const char *buf,
+                                const char *end )
+{
+    const char *p = buf;
+    const char *q = NULL;
+    afd_http_hdr_t *hdr = NULL;
+    int rc = 0;
+    
+    // ignore empty lines before request-line
+    while( ( q = _afd_http_eol( p, end ) ) ){
+        p = q;
+    }
+    
+    // method SP uri SP HTTP/1.x
+    req->method = p;
+    q = _afd_http_token_fn( p, end );
+    if( q == p || *q != ' ' ){
+        return -EINVAL;
+    }
+    req->mlen = q - p;
+    req->uri = p = q + 1;
+    q = _afd_http_token_fn( p, end );
+    if( q == p || *q != ' ' ){
+        return -EINVAL;
+    }
+    req->ulen = q - p;
+    p = q + 1;
+    if( end - p < 9 || memcmp( p, "HTTP/1.", 7 ) != 0 ||
+        p[7] < '0' || p[7] > '9' || !( q = _afd_http_eol( p + 8, end ) ) ){
+        return -EINVAL;
+    }
+    req->minor = p[7] - '0';
+    // HTTP/1.1 default persistent connection
+    req->keepalive = req->minor > 0;
+    req->body = NULL;
+    req->clen = 0;
+    req->nhdr = 0;
+    p = q;
+    
+    // headers
+    while( !( q = _afd_http_eol( p, end ) ) )
+    {
+        if( req->nhdr == AFD_HTTP_MAX_HEADERS ){
+            return -ENOBUFS;
+        }
+        hdr = &req->hdr[req->nhdr++];
+        // field-name ":"
+        hdr->name = p;
+        for(; *p != ':'; p++ )
+        {
+            // obs-fold or invalid character
+            if( _afd_http_istokdelim( *p ) ){
+                return -EINVAL;
+            }
+        }
+        if( !( hdr->nlen = p - hdr->name ) ){
+            return -EINVAL;
+        }
+        // skip OWS
+        for( p++; *p == ' ' || *p == '\t'; p++ ){}
+        // field-value
+        hdr->val = p;
+        p = _afd_http_value_fn( p, end );
+        if( !( q = _afd_http_eol( p, end ) ) ){
+            return -EINVAL;
+        }
+        // trim OWS
+        for(; p > hdr->val && ( p[-1] == ' ' || p[-1] == '\t' ); p-- ){}
+        hdr->vlen = p - hdr->val;
+        p = q;
+        
+        if( ( rc = _afd_http_parse_hdr( req, hdr ) ) ){
+            return -rc;
+        }
+    }
+    
+    return q - buf;
+}
+
+ssize_t afd_http_parse_req( afd_http_req_t *req, const char *buf, size_t len )
+{
+    const char *end = buf + len;
+    const char *eoh = NULL;
+    ssize_t hlen = (ssize_t)req->hlen;
+    
+    // parse headers unless parsed already while waiting for the body
+    if( !hlen )
+    {
+        // end of headers has not arrived yet
+        if( !( eoh = _afd_http_eoh( buf + ( req->prev > 3 ? req->prev - 3 : 0 ),
+                                    end ) ) ){
+            req->prev = len;
+            return AFD_HTTP_EAGAIN;
+        }
+        // NOTE: request-line and headers are always terminated by eoh
+        else if( ( hlen = _afd_http_parse( req, buf, eoh ) ) < 0 ){
+            req->prev = 0;
+            errno = (int)-hlen;
+            return -1;
+        }
+        else if( hlen != eoh - buf ){
+            req->prev = 0;
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    
+    // body has not arrived yet
+    if( len - hlen < req->clen ){
+        req->hlen = (size_t)hlen;
+        return AFD_HTTP_EAGAIN;
+    }
+    
+    req->prev = 0;
+    req->hlen = 0;
+    req->body = req->clen ? buf + hlen : NULL;
+    
+    return hlen + req->clen;
+}
+
+const afd_http_hdr_t *afd_http_req_header( afd_http_req_t *req,
+                                           const char *name, size_t len )
+{
+    int i = 0;
+    
+    for(; i < req->nhdr; i++ )
+    {
+        if( req->hdr[i].nlen == len &&
+            strncasecmp( req->hdr[i].name, name, len ) == 0 ){
+            return &req->hdr[i];
+        }
+    }
+    
+    return NULL;
+}
+
+
+void afd_http_res_init( afd_http_res_t *res )
+{
+    res->niov = 0;
+    res->cur = 0;
+    res->len = 0;
+}
+
+int afd_http_res_add( afd_http_res_t *res, const void *buf, size_t len )
+{
+    if( len )
+    {
+        if( res->niov == AFD_HTTP_MAX_IOV ){
+            errno = ENOBUFS;
+            return -1;
+        }
+        res->iov[res->niov].iov_base = (void*)buf;
+        res->iov[res->niov].iov_len = len;
+        res->niov++;
+        res->len += len;
+    }
+    
+    return 0;
+}
+
+ssize_t afd_http_res_flush( afd_http_res_t *res, int fd )
+{
+    ssize_t rv = 0;
+    size_t len = 0;
+    
+    if( res->cur < res->niov &&
+        ( rv = writev( fd, res->iov + res->cur, res->niov - res->cur ) ) > 0 )
+    {
+        len = (size_t)rv;
+        res->len -= len;
+        // skip written buffers
+        while( res->cur < res->niov && len >= res->iov[res->cur].iov_len ){
+            len -= res->iov[res->cur].iov_len;
+            res->cur++;
+        }
+        // written partially
+        if( len ){
+            res->iov[res->cur].iov_base = (char*)res->iov[res->cur].iov_base + len;
+            res->iov[res->cur].iov_len -= len;
+        }
+        // all written
+        else if( res->cur == res->niov ){
+            res->cur = res->niov = 0;
+        }
+    }
+    
+    return rv;
+}
+
@@ -0,0 +1,611 @@
+/*
+ *  asyncfd_log.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+#include "libasyncfd_log.h"
+#include "asyncfd_private.h"
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+// size of format buffer of flusher
+#define AFD_LOG_BUFSIZE     65536
+// maximum length of a line
+#define AFD_LOG_LINEMAX     1024
+
+// log record
+typedef struct {
+    uint64_t ts;
+    const char *fn;
+    const char *fmt;
+    int8_t lv;
+    int8_t witherr;
+    int8_t nargs;
+    int err;
+    int64_t args[AFD_LOG_MAXARGS];
+} afd_logrec_t;
+
+// single-producer/single-consumer ring of each thread
+typedef struct _afd_logring_t afd_logring_t;
+struct _afd_logring_t {
+    // written by producer(busy is 1 while writing a record)
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t drops;
+    volatile int busy;
+    // written by consumer
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t ndrops;
+    // 1 if thread exited
+    int dead;
+    uint64_t mask;
+    afd_logring_t *next;
+    afd_logrec_t *recs;
+};
+
+// logger
+typedef struct {
+    int fd;
+    int interval;
+    size_t nrec;
+    volatile int running;
+    pthread_t th;
+    char buf[AFD_LOG_BUFSIZE];
+} afd_logger_t;
+
+static const char *AFD_LOG_LVSTR[] = {
+    "ERR", "WARN", "INFO", "DEBUG"
+};
+
+int _afd_log_curlv = AFD_LOG_DEBUG;
+
+static pthread_mutex_t _afd_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _afd_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _afd_log_key;
+static afd_logger_t *volatile _afd_logger = NULL;
+// number of records of ring to be allocated.
+// NOTE: producers do not refer to the logger that will be freed by 
+//       afd_log_close
+static size_t _afd_log_nrec = 0;
+// logger of parent process that has no flusher thread in child process
+static afd_logger_t *_afd_log_forked = NULL;
+static pthread_once_t _afd_log_atfork_once = PTHREAD_ONCE_INIT;
+// rings of all threads
+static afd_logring_t *_afd_log_rings = NULL;
+static uint64_t _afd_log_drops = 0;
+static __thread afd_logring_t *_afd_log_ring = NULL;
+
+
+/*
+    format a message of record without va_list.
+    NOTE: '*' of width and precision is not supported.
+*/
+static size_t _afd_log_vformat( char *buf, size_t size, const char *fmt,
+                                int nargs, const int64_t *args )
+{
+    const char *p = fmt;
+    const char *s = NULL;
+    size_t len = 0;
+    char spec[32];
+    size_t slen = 0;
+    int lmod = 0;
+    int n = 0;
+    int i = 0;
+    int64_t a = 0;
+    
+    while( *p && len + 1 < size )
+    {
+        if( *p != '%' ){
+            buf[len++] = *p++;
+            continue;
+        }
+        else if( p[1] == '%' ){
+            buf[len++] = '%';
+            p += 2;
+            continue;
+        }
+        
+        // flags, width and precision
+        for( s = p++; *p && strchr( "-+ #0123456789.", *p ); p++ ){}
+        if( ( slen = (size_t)( p - s ) ) > sizeof( spec ) - 4 ){
+            break;
+        }
+        memcpy( spec, s, slen );
+        // length modifier
+        for( lmod = 0; *p && strchr( "hlLqjzt", *p ); p++ ){
+            lmod += ( *p == 'l' ) ? 1 : ( *p == 'h' ) ? 0 : 2;
+        }
+        if( !*p ){
+            break;
+        }
+        
+        a = ( i < nargs ) ? args[i++] : 0;
+        switch( *p )
+        {
+            case 'd':
+            case 'i':
+                memcpy( spec + slen, "ll", 2 );
+                spec[slen + 2] = *p;
+                spec[slen + 3] = 0;
+                n = snprintf( buf + len, size - len, spec,
+                              lmod ? (long long)a : (long long)(int)a );
+            break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                memcpy( spec + slen, "ll", 2 );
+                spec[slen + 2] = *p;
+                spec[slen + 3] = 0;
+                n = snprintf( buf + len, size - len, spec,
+                              lmod ? (unsigned long long)a :
+                                     (unsigned long long)(unsigned int)a );
+            break;
+            case 'c':
+            case 'p':
+            case 's':
+                spec[slen] = *p;
+                spec[slen + 1] = 0;
+                if( *p == 'c' ){
+                    n = snprintf( buf + len, size - len, spec, (int)a );
+                }
+                else if( *p == 'p' ){
+                    n = snprintf( buf + len, size - len, spec, (void*)(intptr_t)a );
+                }
+                else {
+                    n = snprintf( buf + len, size - len, spec,
+                                  a ? (const char*)(intptr_t)a : "(null)" );
+                }
+            break;
+            // unsupported conversion
+            default:
+                n = snprintf( buf + len, size - len, "%.*s",
+                              (int)( p + 1 - s ), s );
+        }
+        p++;
+        if( n < 0 ){
+            break;
+        }
+        len += (size_t)n;
+    }
+    
+    if( len >= size ){
+        len = size - 1;
+    }
+    buf[len] = 0;
+    
+    return len;
+}
+
+// format a message in the same format as plog/pelog/pfelog
+static size_t _afd_log_message( char *buf, size_t size, afd_logrec_t *rec )
+{
+    char ebuf[128];
+    const char *estr = "";
+    size_t len = 0;
+    
+    if( rec->witherr && rec->err ){
+#if ( _POSIX_C_SOURCE >= 200112L ) && !_GNU_SOURCE
+        estr = strerror_r( rec->err, ebuf, sizeof( ebuf ) ) ? "" : ebuf;
+#else
+        estr = strerror_r( rec->err, ebuf, sizeof( ebuf ) );
+#endif
+    }
+    
+    // failed to fn(): strerror - message
+    if( rec->fn ){
+        len = (size_t)snprintf( buf, size, "failed to %s(): %s - ", rec->fn,
+                                estr );
+        if( len >= size ){
+            return size - 1;
+        }
+    }
+    len += _afd_log_vformat( buf + len, size - len, rec->fmt, rec->nargs,
+                             rec->args );
+    // message : strerror
+    if( rec->witherr && !rec->fn && len < size ){
+        len += (size_t)snprintf( buf + len, size - len, " : %s", estr );
+    }
+    if( len >= size - 1 ){
+        len = size - 2;
+    }
+    buf[len++] = '\n';
+    buf[len] = 0;
+    
+    return len;
+}
+
+static void _afd_log_write( int fd, const char *buf, size_t len )
+{
+    ssize_t rv = 0;
+    
+    while( len )
+    {
+        if( ( rv = write( fd, buf, len ) ) > 0 ){
+            buf += rv;
+            len -= (size_t)rv;
+        }
+        else if( rv == -1 && errno != EINTR ){
+            break;
+        }
+    }
+}
+
+
+static void _afd_log_ring_dealloc( afd_logring_t *ring )
+{
+    pdealloc( ring->recs );
+    pdealloc( ring );
+}
+
+// thread exit
+static void _afd_log_ring_release( void *arg )
+{
+    afd_logring_t *ring = (afd_logring_t*)arg;
+    afd_logring_t **ptr = &_afd_log_rings;
+    
+    // log of other destructors will allocate new ring
+    _afd_log_ring = NULL;
+    pthread_mutex_lock( &_afd_log_mutex );
+    // flusher will remove it after drained
+    if( _afd_logger || ring->head != ring->tail ){
+        ring->dead = 1;
+    }
+    // no flusher to remove it
+    else
+    {
+        for(; *ptr; ptr = &(*ptr)->next )
+        {
+            if( *ptr == ring ){
+                *ptr = ring->next;
+                break;
+            }
+        }
+        _afd_log_ring_dealloc( ring );
+    }
+    pthread_mutex_unlock( &_afd_log_mutex );
+}
+
+static void _afd_log_key_init( void )
+{
+    pthread_key_create( &_afd_log_key, _afd_log_ring_release );
+}
+
+static afd_logring_t *_afd_log_ring_alloc( size_t nrec )
+{
+    afd_logring_t *ring = NULL;
+    
+    if( posix_memalign( (void**)&ring, 64, sizeof( afd_logring_t ) ) == 0 )
+    {
+        if( ( ring->recs = pnalloc( nrec, afd_logrec_t ) ) ){
+            ring->head = ring->tail = 0;
+            ring->drops = ring->ndrops = 0;
+            ring->dead = 0;
+            ring->busy = 0;
+            ring->mask = nrec - 1;
+            pthread_once( &_afd_log_once, _afd_log_key_init );
+            pthread_setspecific( _afd_log_key, ring );
+            pthread_mutex_lock( &_afd_log_mutex );
+            ring->next = _afd_log_rings;
+            _afd_log_rings = ring;
+            pthread_mutex_unlock( &_afd_log_mutex );
+            return ring;
+        }
+        pdealloc( ring );
+    }
+    
+    return NULL;
+}
+
+void _afd_log_emit( int lv, const char *fn, int witherr, const char *fmt,
+                    int nargs, ... )
+{
+    int err = errno;
+    afd_logring_t *ring = _afd_log_ring;
+    afd_logrec_t *rec = NULL;
+    afd_logrec_t tmp;
+    struct timespec ts;
+    uint64_t head = 0;
+    va_list args;
+    int i = 0;
+    
+    // create ring at first
+    if( !ring && _afd_logger &&
+        !( ring = _afd_log_ring = _afd_log_ring_alloc( _afd_log_nrec ) ) ){
+        errno = err;
+        return;
+    }
+    // tell afd_log_close that a record is being written before checking 
+    // logger
+    else if( ring ){
+        ring->busy = 1;
+        __sync_synchronize();
+    }
+    
+    // write to stdout synchronously if logger is not opened
+    if( !_afd_logger ){
+        rec = &tmp;
+    }
+    else
+    {
+        head = ring->head;
+        // ring is full
+        if( head - __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) > ring->mask ){
+            ring->drops++;
+            __atomic_store_n( &ring->busy, 0, __ATOMIC_RELEASE );
+            errno = err;
+            return;
+        }
+        rec = &ring->recs[head & ring->mask];
+    }
+    
+    clock_gettime( CLOCK_REALTIME, &ts );
+    rec->ts = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    rec->fn = fn;
+    rec->fmt = fmt;
+    rec->lv = (int8_t)lv;
+    rec->witherr = (int8_t)witherr;
+    rec->nargs = (int8_t)( nargs < AFD_LOG_MAXARGS ? nargs : AFD_LOG_MAXARGS );
+    rec->err = err;
+    va_start( args, nargs );
+    for(; i < rec->nargs; i++ ){
+        rec->args[i] = va_arg( args, int64_t );
+    }
+    va_end( args );
+    
+    if( rec == &tmp ){
+        char buf[AFD_LOG_LINEMAX];
+        
+        _afd_log_message( buf, sizeof( buf ), rec );
+        fputs( buf, stdout );
+    }
+    // publish record
+    else {
+        __atomic_store_n( &ring->head, head + 1, __ATOMIC_RELEASE );
+    }
+    if( ring ){
+        __atomic_store_n( &ring->busy, 0, __ATOMIC_RELEASE );
+    }
+    
+    errno = err;
+}
+
+
+// format records of ring; return number of records
+static size_t _afd_log_drain( afd_logger_t *logger, afd_logring_t *ring,
+                              size_t *len )
+{
+    uint64_t head = __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE );
+    uint64_t tail = ring->tail;
+    uint64_t drops = ring->drops;
+    afd_logrec_t *rec = NULL;
+    time_t sec = 0;
+    struct tm tm;
+    size_t n = 0;
+    
+    for(; tail != head; tail++, n++ )
+    {
+        // flush buffer
+        if( sizeof( logger->buf ) - *len < AFD_LOG_LINEMAX + 64 ){
+            _afd_log_write( logger->fd, logger->buf, *len );
+            *len = 0;
+        }
+        rec = &ring->recs[tail & ring->mask];
+        sec = (time_t)( rec->ts / 1000000000ULL );
+        localtime_r( &sec, &tm );
+        *len += (size_t)snprintf( logger->buf + *len, 64,
+                                  "%04d-%02d-%02d %02d:%02d:%02d.%06d [%s] ",
+                                  tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                                  tm.tm_hour, tm.tm_min, tm.tm_sec,
+                                  (int)( rec->ts % 1000000000ULL / 1000 ),
+                                  AFD_LOG_LVSTR[rec->lv] );
+        *len += _afd_log_message( logger->buf + *len, AFD_LOG_LINEMAX, rec );
+        // release record
+        __atomic_store_n( &ring->tail, tail + 1, __ATOMIC_RELEASE );
+    }
+    
+    // report dropped records
+    if( drops != ring->ndrops )
+    {
+        if( sizeof( logger->buf ) - *len < 128 ){
+            _afd_log_write( logger->fd, logger->buf, *len );
+            *len = 0;
+        }
+        *len += (size_t)snprintf( logger->buf + *len, 128,
+                                  "[WARN] %llu log records dropped\n",
+                                  (unsigned long long)( drops - ring->ndrops ) );
+        __sync_add_and_fetch( &_afd_log_drops, drops - ring->ndrops );
+        ring->ndrops = drops;
+    }
+    
+    return n;
+}
+
+static void _afd_log_flush( afd_logger_t *logger )
+{
+    afd_logring_t **ptr = &_afd_log_rings;
+    afd_logring_t *ring = NULL;
+    size_t len = 0;
+    
+    pthread_mutex_lock( &_afd_log_mutex );
+    while( ( ring = *ptr ) )
+    {
+        _afd_log_drain( logger, ring, &len );
+        // remove ring of exited thread
+        if( ring->dead ){
+            *ptr = ring->next;
+            _afd_log_ring_dealloc( ring );
+        }
+        else {
+            ptr = &ring->next;
+        }
+    }
+    pthread_mutex_unlock( &_afd_log_mutex );
+    
+    if( len ){
+        _afd_log_write( logger->fd, logger->buf, len );
+    }
+}
+
+static void *_afd_log_flusher( void *arg )
+{
+    afd_logger_t *logger = (afd_logger_t*)arg;
+    struct timespec ts = {
+        .tv_sec = logger->interval / 1000,
+        .tv_nsec = ( logger->interval % 1000 ) * 1000000
+    };
+    
+    while( logger->running ){
+        nanosleep( &ts, NULL );
+        _afd_log_flush( logger );
+    }
+    // write remaining records
+    _afd_log_flush( logger );
+    
+    return NULL;
+}
+
+
+// do not fork while other thread holds the lock
+static void _afd_log_atfork_prepare( void )
+{
+    pthread_mutex_lock( &_afd_log_mutex );
+}
+
+static void _afd_log_atfork_parent( void )
+{
+    pthread_mutex_unlock( &_afd_log_mutex );
+}
+
+// close logger of parent process; only the forking thread exists in child
+static void _afd_log_atfork_child( void )
+{
+    afd_logring_t *ring = _afd_log_rings;
+    afd_logring_t *next = NULL;
+    
+    // records of inherited rings will be written by parent
+    for(; ring; ring = next ){
+        next = ring->next;
+        _afd_log_ring_dealloc( ring );
+    }
+    _afd_log_rings = NULL;
+    if( _afd_log_ring ){
+        pthread_setspecific( _afd_log_key, NULL );
+        _afd_log_ring = NULL;
+    }
+    if( _afd_logger ){
+        pdealloc( _afd_log_forked );
+        _afd_log_forked = _afd_logger;
+        _afd_logger = NULL;
+    }
+    pthread_mutex_unlock( &_afd_log_mutex );
+}
+
+static void _afd_log_atfork_init( void )
+{
+    pthread_atfork( _afd_log_atfork_prepare, _afd_log_atfork_parent,
+                    _afd_log_atfork_child );
+}
+
+int _afd_log_reopen( void )
+{
+    afd_logger_t *logger = _afd_log_forked;
+    int rc = 0;
+    
+    if( logger ){
+        _afd_log_forked = NULL;
+        rc = afd_log_open( logger->fd, _afd_log_curlv, logger->nrec,
+                           logger->interval );
+        pdealloc( logger );
+    }
+    
+    return rc;
+}
+
+
+int afd_log_open( int fd, int level, size_t nrec, int interval )
+{
+    afd_logger_t *logger = NULL;
+    size_t n = 1;
+    
+    if( fd < 0 || level < AFD_LOG_ERR || level > AFD_LOG_DEBUG || !nrec ||
+        interval < 1 ){
+        errno = EINVAL;
+        return -1;
+    }
+    else if( _afd_logger ){
+        errno = EALREADY;
+        return -1;
+    }
+    else if( ( errno = pthread_once( &_afd_log_atfork_once, 
+                                     _afd_log_atfork_init ) ) || 
+             !( logger = palloc( afd_logger_t ) ) ){
+        return -1;
+    }
+    
+    // round up to power of 2
+    for(; n < nrec; n <<= 1 ){}
+    logger->fd = fd;
+    logger->interval = interval;
+    logger->nrec = n;
+    logger->running = 1;
+    _afd_log_nrec = n;
+    if( ( errno = pthread_create( &logger->th, NULL, _afd_log_flusher,
+                                  (void*)logger ) ) ){
+        pdealloc( logger );
+        return -1;
+    }
+    _afd_log_curlv = level;
+    _afd_logger = logger;
+    
+    return 0;
+}
+
+void afd_log_close( void )
+{
+    afd_logger_t *logger = _afd_logger;
+    
+    if( logger )
+    {
+        afd_logring_t *ring = NULL;
+        
+        // NOTE: rings of live threads will be used by next logger
+        _afd_logger = NULL;
+        __sync_synchronize();
+        // wait for producers that saw the logger to publish their records.
+        // new producers will not use the ring after seeing NULL.
+        pthread_mutex_lock( &_afd_log_mutex );
+        for( ring = _afd_log_rings; ring; ring = ring->next )
+        {
+            while( __atomic_load_n( &ring->busy, __ATOMIC_ACQUIRE ) ){
+                sched_yield();
+            }
+        }
+        pthread_mutex_unlock( &_afd_log_mutex );
+        logger->running = 0;
+        pthread_join( logger->th, NULL );
+        // write records that published while stopping, and remove rings 
+        // of exited threads
+        _afd_log_flush( logger );
+        pdealloc( logger );
+    }
+}
+
+void afd_log_level( int level )
+{
+    if( level >= AFD_LOG_ERR && level <= AFD_LOG_DEBUG ){
+        _afd_log_curlv = level;
+    }
+}
+
+uint64_t afd_log_dropped( void )
+{
+    return __sync_add_and_fetch( &_afd_log_drops, 0 );
+}
+
@@ -0,0 +1,345 @@
+/*
+ *  asyncfd_metrics.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+#include "libasyncfd_metrics.h"
+#include "asyncfd_private.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#if HAVE_LINUX_NET_TSTAMP_H
+#include <linux/net_tstamp.h>
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS   MAP_ANON
+#endif
+
+// "AFDM"
+#define AFD_METRICS_MAGIC   0x4d444641
+
+// header of shared segment
+typedef struct {
+    uint32_t magic;
+    // size of afd_metrics_slot_t for compatibility check
+    uint32_t slotlen;
+    int32_t nslot;
+} __attribute__((aligned(64))) afd_metrics_hdr_t;
+
+struct _afd_metrics_t {
+    size_t len;
+    afd_metrics_hdr_t *hdr;
+    afd_metrics_slot_t *slots;
+};
+
+
+uint64_t afd_hist_percentile( const afd_hist_t *h, double p )
+{
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    int i = 0;
+    
+    for(; i < AFD_HIST_NBUCKET; i++ ){
+        total += h->count[i];
+    }
+    if( total )
+    {
+        // rank of percentile
+        total = (uint64_t)( (double)total * p / 100 + 0.5 );
+        for( i = 0; i < AFD_HIST_NBUCKET - 1; i++ )
+        {
+            if( ( sum += h->count[i] ) >= total ){
+                break;
+            }
+        }
+        return ( 2ULL << i ) - 1;
+    }
+    
+    return 0;
+}
+
+
+static afd_metrics_t *_afd_metrics_map( int fd, size_t len, int prot, int flags )
+{
+    afd_metrics_t *m = palloc( afd_metrics_t );
+    
+    if( m )
+    {
+        void *ptr = mmap( NULL, len, prot, flags, fd, 0 );
+        
+        if( ptr != MAP_FAILED ){
+            m->len = len;
+            m->hdr = (afd_metrics_hdr_t*)ptr;
+            m->slots = (afd_metrics_slot_t*)( m->hdr + 1 );
+            return m;
+        }
+        pdealloc( m );
+    }
+    
+    return NULL;
+}
+
+afd_metrics_t *afd_metrics_create( const char *path, int nslot )
+{
+    size_t len = sizeof( afd_metrics_hdr_t ) +
+                 sizeof( afd_metrics_slot_t ) * nslot;
+    afd_metrics_t *m = NULL;
+    
+    if( nslot < 1 ){
+        errno = EINVAL;
+        return NULL;
+    }
+    // anonymous memory that will be shared with forked processes
+    else if( !path ){
+        m = _afd_metrics_map( -1, len, PROT_READ|PROT_WRITE,
+                              MAP_SHARED|MAP_ANONYMOUS );
+    }
+    else
+    {
+        int fd = open( path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644 );
+        
+        if( fd == -1 ){
+            return NULL;
+        }
+        else if( ftruncate( fd, (off_t)len ) == 0 ){
+            m = _afd_metrics_map( fd, len, PROT_READ|PROT_WRITE, MAP_SHARED );
+        }
+        close( fd );
+    }
+    
+    if( m ){
+        memset( (void*)m->hdr, 0, len );
+        m->hdr->slotlen = sizeof( afd_metrics_slot_t );
+        m->hdr->nslot = nslot;
+        // NOTE: set magic at last for the reader
+        __sync_synchronize();
+        m->hdr->magic = AFD_METRICS_MAGIC;
+    }
+    
+    return m;
+}
+
+afd_metrics_t *afd_metrics_open( const char *path )
+{
+    afd_metrics_t *m = NULL;
+    int fd = open( path, O_RDONLY|O_CLOEXEC );
+    struct stat st;
+    
+    if( fd == -1 ){
+        return NULL;
+    }
+    else if( fstat( fd, &st ) == 0 )
+    {
+        // invalid file
+        if( (size_t)st.st_size < sizeof( afd_metrics_hdr_t ) ){
+            errno = EINVAL;
+        }
+        else if( ( m = _afd_metrics_map( fd, (size_t)st.st_size, PROT_READ,
+                                         MAP_SHARED ) ) &&
+                 ( m->hdr->magic != AFD_METRICS_MAGIC ||
+                   m->hdr->slotlen != sizeof( afd_metrics_slot_t ) ||
+                   m->len < sizeof( afd_metrics_hdr_t ) +
+                            sizeof( afd_metrics_slot_t ) * m->hdr->nslot ) ){
+            afd_metrics_dealloc( m );
+            m = NULL;
+            errno = EINVAL;
+        }
+    }
+    close( fd );
+    
+    return m;
+}
+
+void afd_metrics_dealloc( afd_metrics_t *m )
+{
+    munmap( (void*)m->hdr, m->len );
+    pdealloc( m );
+}
+
+int afd_loop_metrics( afd_loop_t *loop, afd_metrics_t *m, int slot )
+{
+    if( !m ){
+        loop->state->metrics = NULL;
+        return 0;
+    }
+    else if( slot >= 0 && slot < m->hdr->nslot ){
+        afd_metrics_slot_t *metrics = &m->slots[slot];
+        
+        memset( (void*)metrics, 0, sizeof( afd_metrics_slot_t ) );
+        metrics->pid = getpid();
+        loop->state->metrics = metrics;
+        return 0;
+    }
+    
+    errno = EINVAL;
+    return -1;
+}
+
+int afd_metrics_nslot( afd_metrics_t *m )
+{
+    return m->hdr->nslot;
+}
+
+int afd_metrics_read( afd_metrics_t *m, int slot, afd_metrics_slot_t *snap )
+{
+    if( slot >= 0 && slot < m->hdr->nslot )
+    {
+        // NOTE: counters are not consistent with each other, but each
+        //       counter will not be torn on 64bit architecture.
+        const volatile uint64_t *src = (uint64_t*)&m->slots[slot];
+        uint64_t *dst = (uint64_t*)snap;
+        size_t i = 0;
+        
+        for(; i < sizeof( afd_metrics_slot_t ) / sizeof( uint64_t ); i++ ){
+            dst[i] = src[i];
+        }
+        return 0;
+    }
+    
+    errno = EINVAL;
+    return -1;
+}
+
+void afd_metrics_sum( afd_metrics_t *m, afd_metrics_slot_t *sum )
+{
+    afd_metrics_slot_t snap;
+    int slot = 0;
+    int i = 0;
+    
+    memset( (void*)sum, 0, sizeof( afd_metrics_slot_t ) );
+    for(; slot < m->hdr->nslot; slot++ )
+    {
+        afd_metrics_read( m, slot, &snap );
+        sum->nreg += snap.nreg;
+        sum->niter += snap.niter;
+        sum->nevt += snap.nevt;
+        sum->busy += snap.busy;
+        sum->idle += snap.idle;
+        for( i = 0; i < AFD_HIST_NBUCKET; i++ ){
+            sum->cblat.count[i] += snap.cblat.count[i];
+            sum->iterlat.count[i] += snap.iterlat.count[i];
+            sum->rxlat.count[i] += snap.rxlat.count[i];
+        }
+    }
+}
+
+
+int afd_loop_rxstamp( afd_loop_t *loop, int flags )
+{
+    if( flags & ~(AFD_RXSTAMP_SOFTWARE|AFD_RXSTAMP_HARDWARE) ){
+        errno = EINVAL;
+        return -1;
+    }
+    // NIC timestamping is not configured(SIOCSHWTSTAMP), and its clock is 
+    // not comparable with system clock
+    else if( flags & AFD_RXSTAMP_HARDWARE ){
+        errno = ENOTSUP;
+        return -1;
+    }
+    loop->state->rxstamp = flags;
+    
+    return 0;
+}
+
+int afd_rxstamp_enable( int fd, int flags )
+{
+#if HAVE_LINUX_NET_TSTAMP_H
+    int opt = SOF_TIMESTAMPING_RX_SOFTWARE|SOF_TIMESTAMPING_SOFTWARE;
+#else
+    int opt = 1;
+#endif
+    
+    if( flags & AFD_RXSTAMP_HARDWARE ){
+        errno = ENOTSUP;
+        return -1;
+    }
+    else if( !( flags & AFD_RXSTAMP_SOFTWARE ) ){
+        errno = EINVAL;
+        return -1;
+    }
+    
+#if HAVE_LINUX_NET_TSTAMP_H
+    return setsockopt( fd, SOL_SOCKET, SO_TIMESTAMPING, (void*)&opt, 
+                       (socklen_t)sizeof( opt ) );
+#else
+    return setsockopt( fd, SOL_SOCKET, SO_TIMESTAMP, (void*)&opt, 
+                       (socklen_t)sizeof( opt ) );
+#endif
+}
+
+ssize_t afd_rxstamp_recv( afd_loop_t *loop, int fd, void *buf, size_t len, 
+                          int flags )
+{
+    afd_metrics_slot_t *metrics = loop->state->metrics;
+    // large enough for scm_timestamping(3 timespec) and timeval
+    char ctrl[CMSG_SPACE( sizeof( struct timespec ) * 3 )];
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_name = NULL,
+        .msg_namelen = 0,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = metrics ? ctrl : NULL,
+        .msg_controllen = metrics ? sizeof( ctrl ) : 0,
+        .msg_flags = 0
+    };
+    struct cmsghdr *cmsg = NULL;
+    struct timespec now;
+    uint64_t ts = 0;
+    uint64_t rt = 0;
+    uint64_t disp = 0;
+    ssize_t rv = recvmsg( fd, &msg, flags );
+    
+    if( rv < 1 || !metrics ){
+        return rv;
+    }
+    
+    for( cmsg = CMSG_FIRSTHDR( &msg ); cmsg; cmsg = CMSG_NXTHDR( &msg, cmsg ) )
+    {
+        if( cmsg->cmsg_level != SOL_SOCKET ){
+            continue;
+        }
+#if HAVE_LINUX_NET_TSTAMP_H
+        else if( cmsg->cmsg_type == SCM_TIMESTAMPING )
+        {
+            struct timespec tss[3];
+            
+            // software timestamp is at first
+            memcpy( (void*)tss, CMSG_DATA( cmsg ), sizeof( tss ) );
+            ts = (uint64_t)tss[0].tv_sec * 1000000000ULL + 
+                 (uint64_t)tss[0].tv_nsec;
+            break;
+        }
+#else
+        else if( cmsg->cmsg_type == SCM_TIMESTAMP )
+        {
+            struct timeval tv;
+            
+            memcpy( (void*)&tv, CMSG_DATA( cmsg ), sizeof( tv ) );
+            ts = (uint64_t)tv.tv_sec * 1000000000ULL + 
+                 (uint64_t)tv.tv_usec * 1000;
+            break;
+        }
+#endif
+    }
+    
+    // delay until the dispatch of callback, that excludes the time spent 
+    // in callback before reading(included in cblat).
+    // NOTE: timestamps are wall-clock time, and dispatch time is monotonic
+    if( ts ){
+        disp = loop->state->tdisp ? loop->state->tdisp : loop->now;
+        clock_gettime( CLOCK_REALTIME, &now );
+        rt = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+        rt -= _afd_hrtime() - disp;
+        afd_hist_add( &metrics->rxlat, rt > ts ? rt - ts : 0 );
+    }
+    
+    return rv;
+}
@@ -0,0 +1,324 @@
+/*
+ *  asyncfd_numa.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+// sched_setaffinity
+#define _GNU_SOURCE
+#include "asyncfd_private.h"
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if HAVE_SCHED_H
+#include <sched.h>
+#endif
+#if HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+#if HAVE_LINUX_MEMPOLICY_H
+#include <linux/mempolicy.h>
+#else
+#define MPOL_PREFERRED  1
+#define MPOL_MF_MOVE    (1 << 1)
+#endif
+
+// header of allocated memory that holds a mapped length.
+// NOTE: keep cache line alignment of returned pointer
+#define AFD_NODE_HDRLEN     64
+// default hugepage size
+#define AFD_HUGEPAGE_SIZE   (2 * 1024 * 1024)
+
+#define _afd_roundup(n,size)    ((((n) + (size) - 1) / (size)) * (size))
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS   MAP_ANON
+#endif
+
+// header of slab, or mapped region of chunk or large block.
+// NOTE: placed at the head of AFD_SLAB_SIZE aligned address, and blocks 
+//       follow after AFD_NODE_HDRLEN.
+struct _afd_slab_t {
+    afd_arena_t *arena;
+    // block size(0 if large block)
+    size_t size;
+    // mapped length and list of mapped regions(0 and NULL if slab is carved 
+    // from chunk)
+    size_t len;
+    afd_slab_t *prev;
+    afd_slab_t *next;
+};
+
+// largest block size of slab
+#define AFD_SLAB_MAXBLK     (AFD_SLAB_MINBLK << ( AFD_SLAB_NCLASS - 1 ))
+
+// set memory policy of pages.
+// NOTE: ignore an error on the system that does not support NUMA
+static void _afd_node_bind( void *ptr, size_t len, int node, unsigned int flags )
+{
+#ifdef SYS_mbind
+    unsigned long mask[node / ( sizeof( unsigned long ) * 8 ) + 1];
+    
+    memset( mask, 0, sizeof( mask ) );
+    mask[node / ( sizeof( unsigned long ) * 8 )] =
+        1UL << ( node % ( sizeof( unsigned long ) * 8 ) );
+    syscall( SYS_mbind, ptr, len, MPOL_PREFERRED, mask,
+             (unsigned long)node + 2, flags );
+#endif
+}
+
+// map len bytes that aligned to align(0 or power of 2 that is not greater 
+// than AFD_HUGEPAGE_SIZE) on NUMA node, and update len to mapped length.
+static char *_afd_node_map( int node, int flags, size_t *len, size_t align )
+{
+    size_t mlen = _afd_roundup( *len, (size_t)sysconf( _SC_PAGESIZE ) );
+    char *ptr = MAP_FAILED;
+    
+#ifdef MAP_HUGETLB
+    // use hugetlb pages if reserved(mapped address is aligned to its size)
+    if( flags & AS_NUMA_HUGEPAGE &&
+        ( ptr = mmap( NULL, _afd_roundup( *len, AFD_HUGEPAGE_SIZE ),
+                      PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0 ) ) != MAP_FAILED ){
+        mlen = _afd_roundup( *len, AFD_HUGEPAGE_SIZE );
+    }
+#endif
+    if( ptr == MAP_FAILED )
+    {
+        char *base = mmap( NULL, mlen + align, PROT_READ|PROT_WRITE,
+                           MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+        
+        if( base == MAP_FAILED ){
+            return NULL;
+        }
+        // trim unaligned head and tail
+        ptr = (char*)_afd_roundup( (uintptr_t)base, align ? align : 1 );
+        if( ptr != base ){
+            munmap( base, (size_t)( ptr - base ) );
+        }
+        if( align - (size_t)( ptr - base ) ){
+            munmap( ptr + mlen, align - (size_t)( ptr - base ) );
+        }
+#if HAVE_MADVISE && defined(MADV_HUGEPAGE)
+        // use transparent hugepage
+        if( flags & AS_NUMA_HUGEPAGE ){
+            madvise( ptr, mlen, MADV_HUGEPAGE );
+        }
+#endif
+    }
+    
+    // set memory policy before touching pages.
+    if( node != -1 ){
+        _afd_node_bind( ptr, mlen, node, 0 );
+    }
+    *len = mlen;
+    
+    return ptr;
+}
+
+void *_afd_node_alloc( int node, int flags, size_t size )
+{
+    size_t len = size + AFD_NODE_HDRLEN;
+    char *ptr = _afd_node_map( node, flags, &len, 0 );
+    
+    if( !ptr ){
+        return NULL;
+    }
+    *(size_t*)ptr = len;
+    
+    return ptr + AFD_NODE_HDRLEN;
+}
+
+void _afd_node_dealloc( void *ptr )
+{
+    char *hdr = (char*)ptr - AFD_NODE_HDRLEN;
+    
+    munmap( hdr, *(size_t*)hdr );
+}
+
+
+// map chunk or large block, and add it to the region list of arena
+static afd_slab_t *_afd_arena_map( afd_state_t *state, size_t len )
+{
+    afd_arena_t *arena = &state->arena;
+    afd_slab_t *slab = (afd_slab_t*)_afd_node_map( state->node, state->mflags,
+                                                   &len, AFD_SLAB_SIZE );
+    
+    if( slab )
+    {
+        slab->arena = arena;
+        slab->size = 0;
+        slab->len = len;
+        slab->prev = NULL;
+        if( ( slab->next = arena->regions ) ){
+            slab->next->prev = slab;
+        }
+        arena->regions = slab;
+    }
+    
+    return slab;
+}
+
+void _afd_arena_release( afd_arena_t *arena )
+{
+    afd_slab_t *slab = arena->regions;
+    afd_slab_t *next = NULL;
+    
+    for(; slab; slab = next ){
+        next = slab->next;
+        munmap( (void*)slab, slab->len );
+    }
+    memset( (void*)arena, 0, sizeof( afd_arena_t ) );
+}
+
+
+int afd_loop_bind_cpu( afd_loop_t *loop, int cpu, int flags )
+{
+#if HAVE_SCHED_SETAFFINITY && defined(SYS_getcpu)
+    afd_state_t *state = loop->state;
+    afd_slab_t *slab = state->arena.regions;
+    char *hdr = (char*)state - AFD_NODE_HDRLEN;
+    void *evs = NULL;
+    unsigned int node = 0;
+    cpu_set_t set;
+    
+    if( state->running ){
+        errno = EBUSY;
+        return -1;
+    }
+    else if( cpu < 0 || cpu >= CPU_SETSIZE ){
+        errno = EINVAL;
+        return -1;
+    }
+    
+    CPU_ZERO( &set );
+    CPU_SET( cpu, &set );
+    // calling thread will be migrated to cpu
+    if( sched_setaffinity( 0, sizeof( set ), &set ) == -1 ||
+        syscall( SYS_getcpu, NULL, &node, NULL ) == -1 ){
+        return -1;
+    }
+    // allocate receive events container on local node
+    else if( !( evs = _afd_node_alloc( (int)node, flags,
+                                       state->nrcv * sizeof( *state->rcv_evs ) ) ) ){
+        return -1;
+    }
+    
+    // received events container is used only by running loop
+    if( state->node != -1 ){
+        _afd_node_dealloc( state->rcv_evs );
+    }
+    else {
+        pdealloc( state->rcv_evs );
+    }
+    state->rcv_evs = evs;
+    // migrate pages of state and local memory in place, because the other 
+    // threads(e.g. watchdog or balancer) refer to them.
+    _afd_node_bind( hdr, *(size_t*)hdr, (int)node, MPOL_MF_MOVE );
+    for(; slab; slab = slab->next ){
+        _afd_node_bind( slab, slab->len, (int)node, MPOL_MF_MOVE );
+    }
+    state->node = (int)node;
+    state->mflags = flags;
+    
+    return 0;
+
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+void *afd_loop_local_alloc( afd_loop_t *loop, size_t size )
+{
+    afd_arena_t *arena = &loop->state->arena;
+    afd_slab_t *slab = NULL;
+    size_t bsize = AFD_SLAB_MINBLK;
+    char *blk = NULL;
+    int c = 0;
+    
+    // map large block
+    if( size > AFD_SLAB_MAXBLK )
+    {
+        if( size > SIZE_MAX - AFD_SLAB_SIZE - AFD_NODE_HDRLEN ){
+            errno = ENOMEM;
+            return NULL;
+        }
+        else if( !( slab = _afd_arena_map( loop->state, 
+                                           size + AFD_NODE_HDRLEN ) ) ){
+            return NULL;
+        }
+        return (char*)slab + AFD_NODE_HDRLEN;
+    }
+    
+    for(; bsize < size; bsize <<= 1 ){
+        c++;
+    }
+    // carve new slab from chunk
+    if( !arena->free[c] )
+    {
+        if( arena->cur == arena->end )
+        {
+            if( !( slab = _afd_arena_map( loop->state, AFD_ARENA_SIZE ) ) ){
+                return NULL;
+            }
+            arena->cur = (char*)slab;
+            arena->end = arena->cur + slab->len;
+        }
+        else {
+            slab = (afd_slab_t*)arena->cur;
+            slab->arena = arena;
+            slab->len = 0;
+            slab->prev = slab->next = NULL;
+        }
+        slab->size = bsize;
+        arena->cur += AFD_SLAB_SIZE;
+        // push blocks in reverse order to pop them in address order
+        blk = (char*)slab + AFD_NODE_HDRLEN + 
+              ( ( AFD_SLAB_SIZE - AFD_NODE_HDRLEN ) / bsize - 1 ) * bsize;
+        for(; blk > (char*)slab; blk -= bsize ){
+            *(void**)blk = arena->free[c];
+            arena->free[c] = blk;
+        }
+    }
+    
+    blk = arena->free[c];
+    arena->free[c] = *(void**)blk;
+    
+    return blk;
+}
+
+void afd_loop_local_dealloc( void *ptr )
+{
+    afd_slab_t *slab = (afd_slab_t*)( (uintptr_t)ptr & 
+                                      ~( (uintptr_t)AFD_SLAB_SIZE - 1 ) );
+    afd_arena_t *arena = slab->arena;
+    size_t bsize = AFD_SLAB_MINBLK;
+    int c = 0;
+    
+    // unmap large block
+    if( !slab->size )
+    {
+        if( slab->prev ){
+            slab->prev->next = slab->next;
+        }
+        else {
+            arena->regions = slab->next;
+        }
+        if( slab->next ){
+            slab->next->prev = slab->prev;
+        }
+        munmap( (void*)slab, slab->len );
+        return;
+    }
+    
+    for(; bsize < slab->size; bsize <<= 1 ){
+        c++;
+    }
+    *(void**)ptr = arena->free[c];
+    arena->free[c] = ptr;
+}
@@ -0,0 +1,252 @@
+/*
+ *  asyncfd_outq.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include "libasyncfd_outq.h"
+#include "libasyncfd_admit.h"
+#include "asyncfd_private.h"
+
+// initial size of ring of queued buffers
+#define AFD_OUTQ_NBUF   8
+
+afd_buf_t *afd_buf_alloc( const void *data, size_t len )
+{
+    afd_buf_t *buf = (afd_buf_t*)malloc( sizeof( afd_buf_t ) + len );
+    
+    if( buf )
+    {
+        buf->ref = 1;
+        buf->len = len;
+        if( data ){
+            memcpy( buf->data, data, len );
+        }
+    }
+    
+    return buf;
+}
+
+void afd_buf_retain( afd_buf_t *buf )
+{
+    __sync_add_and_fetch( &buf->ref, 1 );
+}
+
+void afd_buf_release( afd_buf_t *buf )
+{
+    if( __sync_sub_and_fetch( &buf->ref, 1 ) == 0 ){
+        pdealloc( buf );
+    }
+}
+
+
+int afd_outq_init( afd_outq_t *q, afd_watch_t *w )
+{
+    if( !w || w->flg != AS_EV_WRITE ){
+        errno = EINVAL;
+        return -1;
+    }
+    
+    // write watch stays registered, and notifies only when descriptor 
+    // becomes writable again
+#if USE_KQUEUE
+    w->fflg |= EV_CLEAR;
+#elif USE_EPOLL
+    w->filter |= EPOLLET;
+#endif
+    q->w = w;
+    q->bufs = NULL;
+    q->head = 0;
+    q->nbuf = 0;
+    q->maxbuf = 0;
+    q->off = 0;
+    q->len = 0;
+    q->watching = 0;
+    
+    return 0;
+}
+
+void afd_outq_dispose( afd_loop_t *loop, afd_outq_t *q )
+{
+    for(; q->nbuf; q->nbuf-- )
+    {
+        afd_buf_release( q->bufs[q->head] );
+        if( ++q->head == q->maxbuf ){
+            q->head = 0;
+        }
+    }
+    if( q->len ){
+        afd_admit_outq( loop, -(int64_t)q->len );
+        q->len = 0;
+    }
+    if( q->watching ){
+        afd_unwatch( loop, 0, q->w );
+        q->watching = 0;
+    }
+    pdealloc( q->bufs );
+    q->bufs = NULL;
+    q->maxbuf = 0;
+}
+
+
+int afd_outq_push( afd_loop_t *loop, afd_outq_t *q, afd_buf_t *buf )
+{
+    if( !buf->len ){
+        return 0;
+    }
+    // expand ring
+    else if( q->nbuf == q->maxbuf )
+    {
+        int max = q->maxbuf ? q->maxbuf * 2 : AFD_OUTQ_NBUF;
+        afd_buf_t **bufs = pnalloc( max, afd_buf_t* );
+        int i = 0;
+        
+        if( !bufs ){
+            return -1;
+        }
+        // arrange buffers from the head
+        for(; i < q->nbuf; i++ ){
+            bufs[i] = q->bufs[( q->head + i ) % q->maxbuf];
+        }
+        pdealloc( q->bufs );
+        q->bufs = bufs;
+        q->head = 0;
+        q->maxbuf = max;
+    }
+    
+    afd_buf_retain( buf );
+    q->bufs[( q->head + q->nbuf++ ) % q->maxbuf] = buf;
+    q->len += buf->len;
+    afd_admit_outq( loop, (int64_t)buf->len );
+    
+    return 0;
+}
+
+
+// vectored write that does not raise SIGPIPE on socket
+static ssize_t _afd_outq_writev( int fd, struct iovec *iov, int niov )
+{
+#ifdef MSG_NOSIGNAL
+    struct msghdr msg = {
+        .msg_name = NULL,
+        .msg_namelen = 0,
+        .msg_iov = iov,
+        .msg_iovlen = niov,
+        .msg_control = NULL,
+        .msg_controllen = 0,
+        .msg_flags = 0
+    };
+    ssize_t len = sendmsg( fd, &msg, MSG_NOSIGNAL );
+    
+    // not a socket(e.g. pipe)
+    if( len != -1 || errno != ENOTSOCK ){
+        return len;
+    }
+#endif
+    return writev( fd, iov, niov );
+}
+
+ssize_t afd_outq_flush( afd_loop_t *loop, afd_outq_t *q )
+{
+    struct iovec iov[AFD_OUTQ_MAX_IOV];
+    int niov = 0;
+    int idx = 0;
+    ssize_t len = 0;
+    ssize_t total = 0;
+    size_t want = 0;
+    size_t rest = 0;
+    int err = 0;
+    
+    // write until all data is written or descriptor is not writable, 
+    // because edge-triggered watch will not notify while writable
+    while( q->nbuf )
+    {
+        for( idx = q->head, want = 0, niov = 0; 
+             niov < q->nbuf && niov < AFD_OUTQ_MAX_IOV; niov++ )
+        {
+            iov[niov].iov_base = q->bufs[idx]->data;
+            iov[niov].iov_len = q->bufs[idx]->len;
+            want += q->bufs[idx]->len;
+            if( ++idx == q->maxbuf ){
+                idx = 0;
+            }
+        }
+        iov[0].iov_base = (char*)iov[0].iov_base + q->off;
+        iov[0].iov_len -= q->off;
+        want -= q->off;
+        if( ( len = _afd_outq_writev( q->w->fd, iov, niov ) ) < 1 ){
+            err = errno;
+            break;
+        }
+        
+        // release written buffers
+        rest = (size_t)len + q->off;
+        while( q->nbuf && rest >= q->bufs[q->head]->len )
+        {
+            rest -= q->bufs[q->head]->len;
+            afd_buf_release( q->bufs[q->head] );
+            q->nbuf--;
+            if( ++q->head == q->maxbuf ){
+                q->head = 0;
+            }
+        }
+        q->off = rest;
+        q->len -= (size_t)len;
+        total += len;
+        afd_admit_outq( loop, -(int64_t)len );
+        // partially written
+        if( (size_t)len < want ){
+            break;
+        }
+    }
+    
+    // wait for writable, or deliver error to callback of write watch
+    if( q->nbuf && !q->watching )
+    {
+        if( afd_watch( loop, q->w ) == -1 ){
+            return -1;
+        }
+        q->watching = 1;
+    }
+    
+    if( total || len != -1 ){
+        return total;
+    }
+    errno = err;
+    
+    return -1;
+}
+
+
+int afd_broadcast( afd_loop_t *loop, afd_outq_t **qs, int n, afd_buf_t *buf )
+{
+    int nq = 0;
+    int i = 0;
+    
+    for(; i < n; i++ )
+    {
+        afd_outq_t *q = qs[i];
+        int empty = !q->nbuf;
+        
+        if( afd_outq_push( loop, q, buf ) == -1 ){
+            continue;
+        }
+        // write immediately if nothing waits for writable
+        // NOTE: write errors are delivered to the callback of write watch,
+        //       but the queue stalls if write watch is not registered.
+        else if( empty && afd_outq_flush( loop, q ) == -1 && !q->watching ){
+            continue;
+        }
+        nq++;
+    }
+    
+    return nq;
+}
+
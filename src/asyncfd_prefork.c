@@ -0,0 +1,746 @@
+/*
+ *  asyncfd_prefork.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+// sched_setaffinity
+#define _GNU_SOURCE
+#include "libasyncfd_prefork.h"
+#include "asyncfd_private.h"
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#if HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+// minimum lifetime(msec) of worker to restart immediately after crashed
+#define AFD_PREFORK_RESPAWN_MSEC    1000
+
+// worker process slot
+typedef struct {
+    // 0 if waiting to restart
+    pid_t pid;
+    int id;
+    // generation of workers(incremented by reload)
+    int gen;
+    int ready;
+    int drain;
+    // fork time or restart time(msec)
+    uint64_t at;
+} afd_prefork_slot_t;
+
+struct _afd_prefork_t {
+    afd_sock_t **socks;
+    int nsock;
+    int nworker;
+    int flags;
+    afd_worker_cb cb;
+    void *udata;
+    // current generation and its start time(msec)
+    int gen;
+    uint64_t genat;
+    afd_prefork_slot_t *slots;
+    int nslot;
+    int maxslot;
+    // self-pipe of signals and readiness notification from workers
+    int sigpipe[2];
+    int readypipe[2];
+    // new master of binary upgrade, and old master to be drained
+    pid_t upgrade;
+    pid_t notify;
+    int stopping;
+};
+
+static const int AFD_PREFORK_SIGS[] = {
+    SIGCHLD, SIGHUP, SIGUSR2, SIGTERM, SIGINT, SIGQUIT, 0
+};
+
+// write end of self-pipe of master
+static int _afd_prefork_sigfd = -1;
+// write end of drain pipe of worker
+static int _afd_worker_drainfd = -1;
+
+static inline uint64_t _afd_prefork_msec( void )
+{
+    return _afd_hrtime() / 1000000;
+}
+
+static void _afd_prefork_sighandler( int signo )
+{
+    int err = errno;
+    uint8_t c = (uint8_t)signo;
+    
+    if( write( _afd_prefork_sigfd, &c, 1 ) == -1 ){
+        // pipe is full: signals are already pending
+    }
+    errno = err;
+}
+
+static void _afd_worker_sighandler( int signo )
+{
+    int err = errno;
+    uint8_t c = (uint8_t)signo;
+    
+    if( write( _afd_worker_drainfd, &c, 1 ) == -1 ){
+        // already notified
+    }
+    errno = err;
+}
+
+static int _afd_prefork_sigset( void (*handler)( int ) )
+{
+    struct sigaction sa;
+    const int *sig = AFD_PREFORK_SIGS;
+    
+    memset( (void*)&sa, 0, sizeof( sa ) );
+    sa.sa_handler = handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset( &sa.sa_mask );
+    for(; *sig; sig++ )
+    {
+        if( sigaction( *sig, &sa, NULL ) == -1 ){
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static int _afd_prefork_pipe( int fds[2] )
+{
+    if( pipe( fds ) == 0 )
+    {
+        if( afd_filefd_init( fds[0] ) && afd_filefd_init( fds[1] ) ){
+            return 0;
+        }
+        close( fds[0] );
+        close( fds[1] );
+    }
+    
+    return -1;
+}
+
+static void _afd_prefork_closepipe( int fds[2] )
+{
+    if( fds[0] != -1 ){
+        close( fds[0] );
+        close( fds[1] );
+        fds[0] = fds[1] = -1;
+    }
+}
+
+// NOTE: never returns
+static void _afd_worker_run( afd_prefork_t *pf, int id )
+{
+    afd_worker_t w = {
+        .id = id,
+        .cpu = -1,
+        .drainfd = -1,
+        .socks = pf->socks,
+        .nsock = pf->nsock,
+        .udata = pf->udata,
+        .readyfd = pf->readypipe[1]
+    };
+    int drain[2];
+    
+    // restart flusher thread if master opened logger
+    if( _afd_log_reopen() == -1 ){
+        pfelog( afd_log_open, "worker %d", id );
+    }
+    // restore signal handlers of master
+    _afd_prefork_sigset( SIG_DFL );
+    close( pf->sigpipe[0] );
+    close( pf->sigpipe[1] );
+    close( pf->readypipe[0] );
+    _afd_prefork_sigfd = -1;
+    
+    // SIGQUIT to drain
+    if( _afd_prefork_pipe( drain ) == -1 ){
+        pfelog( pipe, "worker %d", id );
+        exit( EXIT_FAILURE );
+    }
+    else
+    {
+        struct sigaction sa;
+        
+        memset( (void*)&sa, 0, sizeof( sa ) );
+        sa.sa_handler = _afd_worker_sighandler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset( &sa.sa_mask );
+        _afd_worker_drainfd = drain[1];
+        if( sigaction( SIGQUIT, &sa, NULL ) == -1 ){
+            pfelog( sigaction, "worker %d", id );
+            exit( EXIT_FAILURE );
+        }
+        w.drainfd = drain[0];
+    }
+    
+#if HAVE_SCHED_SETAFFINITY
+    if( pf->flags & AFD_PREFORK_PIN )
+    {
+        cpu_set_t set;
+        int cpu = 0;
+        int n = 0;
+        
+        // pick id-th cpu of allowed cpus that is inherited from master
+        if( sched_getaffinity( 0, sizeof( set ), &set ) == -1 ){
+            pfelog( sched_getaffinity, "worker %d", id );
+        }
+        else
+        {
+            n = id % CPU_COUNT( &set );
+            for(; cpu < CPU_SETSIZE; cpu++ )
+            {
+                if( CPU_ISSET( cpu, &set ) && !n-- ){
+                    break;
+                }
+            }
+            CPU_ZERO( &set );
+            CPU_SET( cpu, &set );
+            if( sched_setaffinity( 0, sizeof( set ), &set ) == 0 ){
+                w.cpu = cpu;
+            }
+            else {
+                pfelog( sched_setaffinity, "worker %d", id );
+            }
+        }
+    }
+#endif
+    
+    exit( pf->cb( &w ) );
+}
+
+static int _afd_prefork_spawn( afd_prefork_t *pf, afd_prefork_slot_t *slot )
+{
+    pid_t pid = 0;
+    
+    // do not duplicate buffered output
+    fflush( NULL );
+    if( ( pid = fork() ) == -1 ){
+        pfelog( fork, "worker %d", slot->id );
+        return -1;
+    }
+    else if( pid == 0 ){
+        _afd_worker_run( pf, slot->id );
+    }
+    
+    slot->pid = pid;
+    slot->ready = 0;
+    slot->drain = 0;
+    slot->at = _afd_prefork_msec();
+    
+    return 0;
+}
+
+static afd_prefork_slot_t *_afd_prefork_slot_add( afd_prefork_t *pf, int id )
+{
+    afd_prefork_slot_t *slot = NULL;
+    
+    if( pf->nslot == pf->maxslot )
+    {
+        int maxslot = pf->maxslot * 2;
+        
+        if( !( slot = prealloc( maxslot, afd_prefork_slot_t, pf->slots ) ) ){
+            return NULL;
+        }
+        pf->slots = slot;
+        pf->maxslot = maxslot;
+    }
+    
+    slot = &pf->slots[pf->nslot++];
+    slot->pid = 0;
+    slot->id = id;
+    slot->gen = pf->gen;
+    slot->ready = 0;
+    slot->drain = 0;
+    slot->at = 0;
+    
+    return slot;
+}
+
+static void _afd_prefork_slot_del( afd_prefork_t *pf, afd_prefork_slot_t *slot )
+{
+    *slot = pf->slots[--pf->nslot];
+}
+
+static afd_prefork_slot_t *_afd_prefork_slot_find( afd_prefork_t *pf, pid_t pid )
+{
+    int i = 0;
+    
+    for(; i < pf->nslot; i++ )
+    {
+        if( pf->slots[i].pid == pid ){
+            return &pf->slots[i];
+        }
+    }
+    
+    return NULL;
+}
+
+// start new generation of workers
+static int _afd_prefork_start( afd_prefork_t *pf )
+{
+    afd_prefork_slot_t *slot = NULL;
+    int i = 0;
+    
+    // cancel restart of crashed workers of old generation
+    while( i < pf->nslot )
+    {
+        if( !pf->slots[i].pid ){
+            _afd_prefork_slot_del( pf, &pf->slots[i] );
+            continue;
+        }
+        i++;
+    }
+    
+    pf->gen++;
+    pf->genat = _afd_prefork_msec();
+    for( i = 0; i < pf->nworker; i++ )
+    {
+        if( !( slot = _afd_prefork_slot_add( pf, i ) ) ){
+            return -1;
+        }
+        // retry later
+        else if( _afd_prefork_spawn( pf, slot ) == -1 ){
+            slot->at = pf->genat + AFD_PREFORK_RESPAWN_MSEC;
+        }
+    }
+    afd_log_info( "started workers: generation %d", pf->gen );
+    
+    return 0;
+}
+
+static void _afd_prefork_stop( afd_prefork_t *pf, int sig )
+{
+    int i = 0;
+    
+    pf->stopping = 1;
+    while( i < pf->nslot )
+    {
+        // cancel restart
+        if( !pf->slots[i].pid ){
+            _afd_prefork_slot_del( pf, &pf->slots[i] );
+            continue;
+        }
+        // already draining
+        else if( sig != SIGQUIT || !pf->slots[i].drain ){
+            pf->slots[i].drain = ( sig == SIGQUIT );
+            kill( pf->slots[i].pid, sig );
+        }
+        i++;
+    }
+}
+
+// wait for all workers to exit
+static void _afd_prefork_wait( afd_prefork_t *pf )
+{
+    while( pf->nslot )
+    {
+        if( pf->slots[0].pid && 
+            waitpid( pf->slots[0].pid, NULL, 0 ) == -1 && errno == EINTR ){
+            continue;
+        }
+        _afd_prefork_slot_del( pf, &pf->slots[0] );
+    }
+}
+
+static void _afd_prefork_reap( afd_prefork_t *pf )
+{
+    afd_prefork_slot_t *slot = NULL;
+    uint64_t now = 0;
+    pid_t pid = 0;
+    int status = 0;
+    
+    while( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 )
+    {
+        if( pid == pf->upgrade ){
+            pf->upgrade = 0;
+            afd_log_warn( "binary upgrade failed: pid %d status %d", pid,
+                          status );
+            continue;
+        }
+        else if( !( slot = _afd_prefork_slot_find( pf, pid ) ) ){
+            continue;
+        }
+        // exited normally or old generation
+        else if( pf->stopping || slot->gen != pf->gen ||
+                 ( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 ) ){
+            _afd_prefork_slot_del( pf, slot );
+            continue;
+        }
+        
+        afd_log_warn( "worker %d crashed: pid %d status %d", slot->id, pid,
+                      status );
+        now = _afd_prefork_msec();
+        slot->pid = 0;
+        // avoid fork storm if worker crashes at startup
+        if( now - slot->at < AFD_PREFORK_RESPAWN_MSEC ){
+            slot->at = slot->at + AFD_PREFORK_RESPAWN_MSEC;
+        }
+        else if( _afd_prefork_spawn( pf, slot ) == -1 ){
+            slot->at = now + AFD_PREFORK_RESPAWN_MSEC;
+        }
+    }
+}
+
+// execute new binary that inherits listening sockets
+static void _afd_prefork_upgrade( afd_prefork_t *pf, char *const argv[] )
+{
+    pid_t pid = 0;
+    
+    if( !argv ){
+        afd_log_warn( "binary upgrade is disabled" );
+        return;
+    }
+    else if( pf->upgrade ){
+        afd_log_warn( "binary upgrade in progress: pid %d", pf->upgrade );
+        return;
+    }
+    
+    fflush( NULL );
+    if( ( pid = fork() ) == -1 ){
+        pfelog( fork, "binary upgrade" );
+        return;
+    }
+    else if( pid == 0 )
+    {
+        // "fd,fd,...": 11 bytes for each descriptor
+        char env[pf->nsock * 11 + 1];
+        char *ptr = env;
+        int i = 0;
+        
+        _afd_prefork_sigset( SIG_DFL );
+        env[0] = 0;
+        for(; i < pf->nsock; i++ )
+        {
+            int fd = pf->socks[i]->fd;
+            
+            // keep descriptor open across exec
+            if( fcntl( fd, F_SETFD, 0 ) == -1 ){
+                _exit( EXIT_FAILURE );
+            }
+            ptr += sprintf( ptr, i ? ",%d" : "%d", fd );
+        }
+        if( setenv( AFD_PREFORK_ENV, env, 1 ) == 0 ){
+            execv( argv[0], argv );
+        }
+        _exit( 127 );
+    }
+    
+    pf->upgrade = pid;
+    afd_log_info( "binary upgrade: pid %d", pid );
+}
+
+// drain old generations after current workers are ready
+static void _afd_prefork_check_ready( afd_prefork_t *pf, uint64_t now )
+{
+    afd_prefork_slot_t *slot = NULL;
+    int ready = 1;
+    int i = 0;
+    
+    if( now - pf->genat < AFD_PREFORK_READY_SEC * 1000 )
+    {
+        for(; i < pf->nslot; i++ )
+        {
+            slot = &pf->slots[i];
+            if( slot->gen == pf->gen && ( !slot->pid || !slot->ready ) ){
+                ready = 0;
+                break;
+            }
+        }
+        if( !ready ){
+            return;
+        }
+    }
+    
+    for( i = 0; i < pf->nslot; i++ )
+    {
+        slot = &pf->slots[i];
+        // NOTE: kill(0) signals own process group
+        if( slot->gen != pf->gen && !slot->drain && slot->pid ){
+            slot->drain = 1;
+            kill( slot->pid, SIGQUIT );
+        }
+    }
+    // drain old master of binary upgrade
+    if( pf->notify ){
+        afd_log_info( "drain old master: pid %d", pf->notify );
+        kill( pf->notify, SIGQUIT );
+        pf->notify = 0;
+    }
+}
+
+// milliseconds until next restart or ready timeout, or -1 if none
+static int _afd_prefork_timeout( afd_prefork_t *pf, uint64_t now )
+{
+    uint64_t deadline = UINT64_MAX;
+    int i = 0;
+    
+    for(; i < pf->nslot; i++ )
+    {
+        if( !pf->slots[i].pid && pf->slots[i].at < deadline ){
+            deadline = pf->slots[i].at;
+        }
+        else if( pf->slots[i].gen != pf->gen && !pf->slots[i].drain &&
+                 pf->genat + AFD_PREFORK_READY_SEC * 1000 < deadline ){
+            deadline = pf->genat + AFD_PREFORK_READY_SEC * 1000;
+        }
+    }
+    if( pf->notify && pf->genat + AFD_PREFORK_READY_SEC * 1000 < deadline ){
+        deadline = pf->genat + AFD_PREFORK_READY_SEC * 1000;
+    }
+    
+    if( deadline == UINT64_MAX ){
+        return -1;
+    }
+    
+    return ( deadline > now ) ? (int)( deadline - now ) : 0;
+}
+
+
+afd_prefork_t *afd_prefork_alloc( afd_sock_t **socks, int nsock, int nworker,
+                                  int flags, afd_worker_cb cb, void *udata )
+{
+    afd_prefork_t *pf = NULL;
+    
+    if( nsock < 0 || ( nsock && !socks ) || nworker < 1 || !cb ){
+        errno = EINVAL;
+        return NULL;
+    }
+    else if( ( pf = palloc( afd_prefork_t ) ) )
+    {
+        if( ( pf->slots = pnalloc( nworker * 2, afd_prefork_slot_t ) ) )
+        {
+            pf->socks = socks;
+            pf->nsock = nsock;
+            pf->nworker = nworker;
+            pf->flags = flags;
+            pf->cb = cb;
+            pf->udata = udata;
+            pf->gen = 0;
+            pf->genat = 0;
+            pf->nslot = 0;
+            pf->maxslot = nworker * 2;
+            pf->sigpipe[0] = pf->sigpipe[1] = -1;
+            pf->readypipe[0] = pf->readypipe[1] = -1;
+            pf->upgrade = 0;
+            pf->notify = 0;
+            pf->stopping = 0;
+            // started by binary upgrade
+            if( getenv( AFD_PREFORK_ENV ) ){
+                pf->notify = getppid();
+                unsetenv( AFD_PREFORK_ENV );
+            }
+            return pf;
+        }
+        pdealloc( pf );
+    }
+    
+    return NULL;
+}
+
+void afd_prefork_dealloc( afd_prefork_t *pf )
+{
+    _afd_prefork_closepipe( pf->sigpipe );
+    _afd_prefork_closepipe( pf->readypipe );
+    pdealloc( pf->slots );
+    pdealloc( pf );
+}
+
+int afd_prefork_run( afd_prefork_t *pf, char *const argv[] )
+{
+    struct pollfd fds[2];
+    uint8_t sigs[64];
+    pid_t pids[64];
+    afd_prefork_slot_t *slot = NULL;
+    ssize_t len = 0;
+    ssize_t i = 0;
+    
+    if( pf->sigpipe[0] != -1 ){
+        errno = EALREADY;
+        return -1;
+    }
+    else if( _afd_prefork_pipe( pf->sigpipe ) == -1 ){
+        return -1;
+    }
+    else if( _afd_prefork_pipe( pf->readypipe ) == -1 ){
+        _afd_prefork_closepipe( pf->sigpipe );
+        return -1;
+    }
+    
+    _afd_prefork_sigfd = pf->sigpipe[1];
+    pf->stopping = 0;
+    if( _afd_prefork_sigset( _afd_prefork_sighandler ) == -1 ||
+        _afd_prefork_start( pf ) == -1 ){
+        int err = errno;
+        
+        // reap workers that have been forked before failure
+        _afd_prefork_stop( pf, SIGTERM );
+        _afd_prefork_wait( pf );
+        _afd_prefork_sigset( SIG_DFL );
+        _afd_prefork_closepipe( pf->sigpipe );
+        _afd_prefork_closepipe( pf->readypipe );
+        errno = err;
+        return -1;
+    }
+    
+    fds[0] = (struct pollfd){ .fd = pf->sigpipe[0], .events = POLLIN };
+    fds[1] = (struct pollfd){ .fd = pf->readypipe[0], .events = POLLIN };
+    while( !pf->stopping || pf->nslot )
+    {
+        uint64_t now = _afd_prefork_msec();
+        
+        if( poll( fds, 2, _afd_prefork_timeout( pf, now ) ) == -1 &&
+            errno != EINTR ){
+            pfelog( poll, "supervisor" );
+            break;
+        }
+        
+        // signals
+        while( ( len = read( pf->sigpipe[0], sigs, sizeof( sigs ) ) ) > 0 )
+        {
+            for( i = 0; i < len; i++ )
+            {
+                switch( sigs[i] ){
+                    case SIGCHLD:
+                        _afd_prefork_reap( pf );
+                    break;
+                    case SIGHUP:
+                        if( !pf->stopping && _afd_prefork_start( pf ) == -1 ){
+                            pfelog( _afd_prefork_start, "reload" );
+                        }
+                    break;
+                    case SIGUSR2:
+                        if( !pf->stopping ){
+                            _afd_prefork_upgrade( pf, argv );
+                        }
+                    break;
+                    case SIGQUIT:
+                        afd_log_info( "drain workers" );
+                        _afd_prefork_stop( pf, SIGQUIT );
+                    break;
+                    default:
+                        afd_log_info( "stop workers" );
+                        _afd_prefork_stop( pf, SIGTERM );
+                }
+            }
+        }
+        // readiness notification
+        while( ( len = read( pf->readypipe[0], pids, sizeof( pids ) ) ) > 0 )
+        {
+            for( i = 0; i < len / (ssize_t)sizeof( pid_t ); i++ )
+            {
+                if( ( slot = _afd_prefork_slot_find( pf, pids[i] ) ) ){
+                    slot->ready = 1;
+                }
+            }
+        }
+        
+        if( !pf->stopping )
+        {
+            now = _afd_prefork_msec();
+            // restart crashed workers of current generation
+            for( i = 0; i < pf->nslot; i++ )
+            {
+                slot = &pf->slots[i];
+                if( !slot->pid && slot->gen == pf->gen && slot->at <= now &&
+                    _afd_prefork_spawn( pf, slot ) == -1 ){
+                    slot->at = now + AFD_PREFORK_RESPAWN_MSEC;
+                }
+            }
+            _afd_prefork_check_ready( pf, now );
+        }
+    }
+    
+    _afd_prefork_sigset( SIG_DFL );
+    _afd_prefork_sigfd = -1;
+    _afd_prefork_closepipe( pf->sigpipe );
+    _afd_prefork_closepipe( pf->readypipe );
+    
+    return 0;
+}
+
+int afd_worker_ready( afd_worker_t *w )
+{
+    pid_t pid = getpid();
+    
+    if( w->readyfd == -1 ){
+        errno = EALREADY;
+        return -1;
+    }
+    else if( write( w->readyfd, &pid, sizeof( pid ) ) == -1 ){
+        return -1;
+    }
+    close( w->readyfd );
+    w->readyfd = -1;
+    
+    return 0;
+}
+
+int afd_prefork_inherit( afd_sock_t **socks, int nsock )
+{
+    const char *env = getenv( AFD_PREFORK_ENV );
+    struct sockaddr_storage addr;
+    socklen_t addrlen = 0;
+    socklen_t len = 0;
+    afd_sock_t *as = NULL;
+    char *end = NULL;
+    int n = 0;
+    int fd = 0;
+    int type = 0;
+    
+    if( !env ){
+        return 0;
+    }
+    
+    while( *env )
+    {
+        fd = (int)strtol( env, &end, 10 );
+        if( end == env || ( *end && *end != ',' ) || n == nsock ){
+            errno = EINVAL;
+            goto FAILED;
+        }
+        env = *end ? end + 1 : end;
+        
+        addrlen = (socklen_t)sizeof( addr );
+        len = (socklen_t)sizeof( type );
+        if( getsockname( fd, (struct sockaddr*)&addr, &addrlen ) == -1 ||
+            getsockopt( fd, SOL_SOCKET, SO_TYPE, &type, &len ) == -1 ||
+            !afd_filefd_init( fd ) ){
+            goto FAILED;
+        }
+        else if( !( as = palloc( afd_sock_t ) ) ){
+            goto FAILED;
+        }
+        else if( !( as->addr = malloc( addrlen ) ) ){
+            pdealloc( as );
+            goto FAILED;
+        }
+        memcpy( as->addr, (void*)&addr, addrlen );
+        as->fd = fd;
+        as->family = addr.ss_family;
+        as->type = type;
+        as->proto = 0;
+        as->addrlen = addrlen;
+        socks[n++] = as;
+    }
+    
+    return n;
+
+FAILED:
+    while( n ){
+        as = socks[--n];
+        pdealloc( as->addr );
+        pdealloc( as );
+    }
+    return -1;
+}
+
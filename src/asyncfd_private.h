@@ -13,18 +13,206 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
-#include "libasyncfd_config.h"
+#include <time.h>
+#include <pthread.h>
+#include "libasyncfd.h"
+#include "libasyncfd_metrics.h"
+#include "libasyncfd_log.h"
 
 #if USE_KQUEUE
 #include <sys/event.h>
 
 #elif USE_EPOLL
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #else
 #error("unsupported system")
 #endif
 
+typedef struct _afd_trace_t afd_trace_t;
+typedef struct _afd_admit_t afd_admit_t;
+
+// deferred deallocation of watch
+typedef struct {
+    afd_watch_t *w;
+    afd_watch_free_cb cb;
+    // epoch of shared loop when released
+    uint64_t epoch;
+} afd_defer_t;
+
+// node-local memory of event loop(see asyncfd_numa.c).
+// blocks of power of 2 size classes are carved from slabs of AFD_SLAB_SIZE 
+// that are carved from chunks of AFD_ARENA_SIZE.
+#define AFD_SLAB_SIZE       (64 * 1024)
+#define AFD_SLAB_MINBLK     64
+#define AFD_SLAB_NCLASS     9
+#define AFD_ARENA_SIZE      (2 * 1024 * 1024)
+
+typedef struct _afd_slab_t afd_slab_t;
+
+typedef struct {
+    // free blocks of each size class
+    void *free[AFD_SLAB_NCLASS];
+    // unused area of current chunk
+    char *cur;
+    char *end;
+    // mapped chunks and large blocks
+    afd_slab_t *regions;
+} afd_arena_t;
+
+// thread that runs shared loop
+typedef struct _afd_mtslot_t afd_mtslot_t;
+struct _afd_mtslot_t {
+    afd_mtslot_t *next;
+    // odd while waiting for events, even while dispatching received events
+    volatile uint64_t seq;
+    // seq at the start of grace period
+    uint64_t snap;
+};
+
+// event loop state
+struct _afd_state_t {
+#if USE_KQUEUE
+    struct kevent *rcv_evs;
+
+#elif USE_EPOLL
+    struct epoll_event *rcv_evs;
+#endif
+    int32_t nrcv;
+    // NOTE: nreg will be updated from other thread by afd_watch_move
+    volatile int32_t nreg;
+    int32_t fd;
+#if USE_EPOLL
+    // eventfd to wake up loop
+    int wakefd;
+#endif
+    volatile int running;
+    // 1 if dispatched by multiple threads(see afd_loop_share)
+    int shared;
+    // NUMA node of memory(-1 if not bound) and allocation flags
+    int node;
+    int mflags;
+    // memory of afd_loop_local_alloc
+    afd_arena_t arena;
+    // number of received events of current iteration(0 if not dispatching)
+    int nevt;
+    // 1 if watches of control or bulk priority class has been registered
+    int prio;
+    // bulk events that are carried over to next iteration, and time budget 
+    // of bulk events per iteration(0 to unlimited)
+#if USE_KQUEUE
+    struct kevent *bulk_evs;
+#elif USE_EPOLL
+    struct epoll_event *bulk_evs;
+#endif
+    int nbulk;
+    int maxbulk;
+    uint64_t bulk_budget;
+    // deferred deallocation of watches
+    afd_defer_t *defer;
+    int ndefer;
+    int maxdefer;
+    // threads of shared loop, and the epoch and current grace period(0 if 
+    // not started) of deferred deallocation. (protected by mtlock)
+    volatile int mtlock;
+    afd_mtslot_t *mtslots;
+    uint64_t epoch;
+    uint64_t gp;
+    // load balancing
+    int balanced;
+    uint64_t busy;
+    afd_loop_t *volatile shed_to;
+    volatile int shed;
+    // shared metrics slot
+    afd_metrics_slot_t *metrics;
+    // slow callback threshold(nsec)
+    uint64_t slowcb;
+    // RX timestamp flags of the sockets to be registered, and the start 
+    // time of current callback(set if metrics is attached)
+    int rxstamp;
+    uint64_t tdisp;
+    // number of attached watchdogs, thread of loop, start time of busy 
+    // period(0 if waiting) and current watch
+    volatile int watchdog;
+    pthread_t thread;
+    volatile uint64_t since;
+    afd_watch_t *volatile curw;
+    // trace recorder
+    afd_trace_t *trace;
+    // admission control
+    afd_admit_t *admit;
+    // hook lists
+    afd_hook_t *prepare;
+    afd_hook_t *check;
+    afd_loop_cleanup_cb cleanup;
+    void *udata;
+};
+
+/*
+    allocate memory by mmap(2) on NUMA node.(node -1 to default policy)
+    flags: AS_NUMA_HUGEPAGE to use hugepage if possible
+*/
+void *_afd_node_alloc( int node, int flags, size_t size );
+void _afd_node_dealloc( void *ptr );
+// unmap all memory of arena
+void _afd_arena_release( afd_arena_t *arena );
+
+// dispatch event to callback of watch
+void _afd_loop_dispatch( afd_loop_t *loop, afd_watch_t *w, int hup );
+// expire registered timer as soon as possible only once(fire = 1), or 
+// disarm it(fire = 0)
+int _afd_timer_arm( afd_state_t *state, afd_watch_t *w, int fire );
+
+// trace recorder(asyncfd_trace.c)
+void _afd_trace_dealloc( afd_trace_t *trace );
+void _afd_trace_wait( afd_trace_t *trace, int nevt, uint64_t ts );
+size_t _afd_trace_event( afd_trace_t *trace, int fd, uint8_t flg, uint8_t evt );
+void _afd_trace_done( afd_trace_t *trace, size_t rec, uint64_t ns );
+void _afd_trace_unwatch( afd_trace_t *trace, int fd );
+
+// admission control(asyncfd_admit.c)
+void _afd_admit_update( afd_loop_t *loop, uint64_t busy );
+// maximum waiting time of paused loop to recheck watermarks without events
+#define AFD_ADMIT_RECHECK_MSEC  100
+void _afd_admit_dealloc( afd_admit_t *admit );
+
+// internal attribute flag of watch that has an event in bulk_evs
+#define AFD_WATCH_CARRIED   (1 << 7)
+
+#if UINTPTR_MAX > 0xffffffffUL
+// generation tag of watch in the upper 16 bits of user space address that is 
+// passed to kernel as event udata, so the events that were received before 
+// the watch deregistered(or moved) will be detected.
+#define AFD_WATCH_TAGBITS   48
+#define _afd_watch_tag(w) \
+    ((void*)((uintptr_t)(w) | (uintptr_t)(w)->gen << AFD_WATCH_TAGBITS))
+#define _afd_watch_untag(p) \
+    ((afd_watch_t*)((uintptr_t)(p) & (((uintptr_t)1 << AFD_WATCH_TAGBITS) - 1)))
+#define _afd_watch_stale(w,p) \
+    ((w)->gen != (uint16_t)((uintptr_t)(p) >> AFD_WATCH_TAGBITS))
+// upper bits of address are used(e.g. tagged pointer or 57bit address)
+#define _afd_watch_untaggable(w) \
+    ((uintptr_t)(w) >> AFD_WATCH_TAGBITS)
+#else
+// no spare bits for tag on 32bit architecture
+// NOTE: remaining events will be removed from received events instead
+#define AFD_WATCH_UNTAGGED      1
+#define _afd_watch_tag(w)       ((void*)(w))
+#define _afd_watch_untag(p)     ((afd_watch_t*)(p))
+#define _afd_watch_stale(w,p)   0
+#define _afd_watch_untaggable(w)    0
+#endif
+
+// monotonic clock in nanoseconds
+static inline uint64_t _afd_hrtime( void )
+{
+    struct timespec ts;
+    
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
 // memory alloc/dealloc
 #define palloc(t)       (t*)malloc( sizeof(t) )
 #define pnalloc(n,t)    (t*)malloc( n * sizeof(t) )
@@ -32,14 +220,15 @@
 #define prealloc(n,t,p) (t*)realloc( p, n * sizeof(t) )
 #define pdealloc(p)     free((void*)p)
 
-// print function error log
+// reopen logger of parent process in forked child(asyncfd_log.c)
+int _afd_log_reopen( void );
+
+// log macros that write to asynchronous logger
 #define _pfelog(f,fmt,...) \
-    printf( "failed to " #f "(): %s - " fmt "\n", \
-            ( errno ) ? strerror(errno) : "", ##__VA_ARGS__ )
+    afd_log( AFD_LOG_ERR, #f, 1, "" fmt, ##__VA_ARGS__ )
 #define pfelog(f,...) _pfelog(f,__VA_ARGS__)
 
-#define plog(fmt,...) printf( fmt "\n", ##__VA_ARGS__ )
-#define pelog(fmt,...) \
-    printf( fmt " : %s\n", ##__VA_ARGS__, ( errno ) ? strerror(errno) : "" )
+#define plog(fmt,...) afd_log( AFD_LOG_INFO, NULL, 0, "" fmt, ##__VA_ARGS__ )
+#define pelog(fmt,...) afd_log( AFD_LOG_ERR, NULL, 1, "" fmt, ##__VA_ARGS__ )
 
 #endif
@@ -0,0 +1,70 @@
+/*
+ *  asyncfd_probes.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+#ifndef ___ASYNCFD_PROBES___
+#define ___ASYNCFD_PROBES___
+
+#include "libasyncfd_config.h"
+
+/*
+    static tracepoints(USDT) of provider "libasyncfd"
+
+    wait__entry     : (int32_t fd, int32_t nevts)
+                      before waiting for events
+    wait__return    : (int nevt, int errno)
+                      after waiting for events
+    dispatch        : (int fd, uint8_t flg, void *udata, uint64_t nsec)
+                      after callback returned with its duration
+    watch           : (int fd, uint8_t flg, int rc)
+                      after registering watch
+    unwatch         : (int fd, uint8_t flg, int closefd)
+                      before deregistering watch
+    timer__update   : (afd_watch_t *w, time_t sec, long nsec)
+                      after updating timer interval
+
+    e.g. bpftrace -e 'usdt:./libasyncfd.so:libasyncfd:dispatch
+                      /arg3 > 1000000/ { printf("%d %d\n", arg0, arg3); }'
+
+    probes are compiled as a nop instruction, and the arguments that need
+    extra work are only computed when a tracer attached to the semaphore.
+*/
+#if USE_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define AFD_PROBE_SEMAPHORE(name) \
+    __extension__ unsigned short libasyncfd_##name##_semaphore \
+    __attribute__((unused)) __attribute__((section(".probes")))
+
+extern unsigned short libasyncfd_wait__entry_semaphore;
+extern unsigned short libasyncfd_wait__return_semaphore;
+extern unsigned short libasyncfd_dispatch_semaphore;
+extern unsigned short libasyncfd_watch_semaphore;
+extern unsigned short libasyncfd_unwatch_semaphore;
+extern unsigned short libasyncfd_timer__update_semaphore;
+
+#define AFD_PROBE_ENABLED(name) \
+    __builtin_expect( libasyncfd_##name##_semaphore, 0 )
+#define AFD_PROBE2(name,a,b) \
+    STAP_PROBE2( libasyncfd, name, a, b )
+#define AFD_PROBE3(name,a,b,c) \
+    STAP_PROBE3( libasyncfd, name, a, b, c )
+#define AFD_PROBE4(name,a,b,c,d) \
+    STAP_PROBE4( libasyncfd, name, a, b, c, d )
+
+#else
+
+#define AFD_PROBE_ENABLED(name)     0
+#define AFD_PROBE2(name,a,b)
+#define AFD_PROBE3(name,a,b,c)
+#define AFD_PROBE4(name,a,b,c,d)
+
+#endif
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ *  asyncfd_ring.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+// memfd_create
+#define _GNU_SOURCE
+#include "libasyncfd_ring.h"
+#include "asyncfd_private.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS   MAP_ANON
+#endif
+
+// anonymous shared memory file to map twice
+static int _afd_ring_shm( void )
+{
+#if HAVE_MEMFD_CREATE
+    return memfd_create( "afd_ring", MFD_CLOEXEC );
+#else
+    static volatile uint32_t seq = 0;
+    char name[64];
+    int fd = -1;
+    
+    snprintf( name, sizeof( name ), "/afd_ring.%d.%u", (int)getpid(), 
+              __sync_add_and_fetch( &seq, 1 ) );
+    if( ( fd = shm_open( name, O_RDWR|O_CREAT|O_EXCL, 0600 ) ) != -1 ){
+        shm_unlink( name );
+    }
+    
+    return fd;
+#endif
+}
+
+int afd_ring_init( afd_ring_t *r, size_t size )
+{
+    size_t pgsize = (size_t)sysconf( _SC_PAGESIZE );
+    char *buf = MAP_FAILED;
+    int fd = -1;
+    
+    if( !size ){
+        errno = EINVAL;
+        return -1;
+    }
+    // round up to page size
+    size = ( size + pgsize - 1 ) / pgsize * pgsize;
+    if( ( fd = _afd_ring_shm() ) == -1 ){
+        return -1;
+    }
+    else if( ftruncate( fd, (off_t)size ) == 0 &&
+             // reserve address space of twice the size, then map the file 
+             // to both halves
+             ( buf = mmap( NULL, size * 2, PROT_NONE, 
+                           MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 ) ) != MAP_FAILED )
+    {
+        if( mmap( buf, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, 
+                  fd, 0 ) == MAP_FAILED ||
+            mmap( buf + size, size, PROT_READ|PROT_WRITE, 
+                  MAP_SHARED|MAP_FIXED, fd, 0 ) == MAP_FAILED ){
+            int err = errno;
+            munmap( buf, size * 2 );
+            errno = err;
+            buf = MAP_FAILED;
+        }
+    }
+    // mapping holds the memory
+    close( fd );
+    if( buf == MAP_FAILED ){
+        return -1;
+    }
+    
+    r->buf = buf;
+    r->size = size;
+    r->head = 0;
+    r->len = 0;
+    
+    return 0;
+}
+
+void afd_ring_dispose( afd_ring_t *r )
+{
+    if( r->buf ){
+        munmap( r->buf, r->size * 2 );
+        r->buf = NULL;
+    }
+}
+
+
+void afd_ring_produce( afd_ring_t *r, size_t len )
+{
+    r->len += len;
+}
+
+void afd_ring_consume( afd_ring_t *r, size_t len )
+{
+    // keep head in the first mapping
+    if( ( r->head += len ) >= r->size ){
+        r->head -= r->size;
+    }
+    r->len -= len;
+}
+
+
+ssize_t afd_ring_read( afd_ring_t *r, int fd )
+{
+    ssize_t len = 0;
+    
+    if( r->len == r->size ){
+        errno = ENOBUFS;
+        return -1;
+    }
+    else if( ( len = read( fd, afd_ring_tail( r ), 
+                           afd_ring_space( r ) ) ) > 0 ){
+        r->len += (size_t)len;
+    }
+    
+    return len;
+}
+
+ssize_t afd_ring_write( afd_ring_t *r, int fd )
+{
+    ssize_t len = write( fd, afd_ring_data( r ), r->len );
+    
+    if( len > 0 ){
+        afd_ring_consume( r, (size_t)len );
+    }
+    
+    return len;
+}
+
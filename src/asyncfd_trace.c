@@ -0,0 +1,652 @@
+/*
+ *  asyncfd_trace.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+#include "libasyncfd_trace.h"
+#include "asyncfd_private.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+// "AFDT"
+#define AFD_TRACE_MAGIC     0x54444641
+#define AFD_TRACE_VERSION   2
+// number of records to write at once
+#define AFD_TRACE_NFLUSH    4096
+// number of additional iterations of replay to wait for recorded events, 
+// and its timeout(nsec)
+#define AFD_TRACE_NRETRY    10
+#define AFD_TRACE_RETRYNS   1000000
+
+// file header
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    // size of afd_trace_rec_t for compatibility check
+    uint16_t reclen;
+    uint64_t reserved;
+} afd_trace_hdr_t;
+
+struct _afd_trace_t {
+    int fd;
+    // 1 if records are kept in memory to be matched by replay
+    int mem;
+    uint64_t start;
+    size_t len;
+    size_t cap;
+    afd_trace_rec_t *recs;
+};
+
+// descriptor mapping of replay
+typedef struct {
+    afd_watch_t *w;
+    int peer;
+    int shut;
+} afd_trace_ent_t;
+
+// recorded event or unwatch of a wait to be replayed
+typedef struct {
+    afd_trace_rec_t rec;
+    // descriptor of replay watch(-1 if ignored), and 1 if dispatched
+    int fd;
+    int done;
+} afd_trace_exp_t;
+
+// replay driver
+typedef struct {
+    afd_loop_t *loop;
+    afd_trace_map_cb map;
+    afd_trace_feed_cb feed;
+    void *udata;
+    // in-memory recorder of dispatched events
+    afd_trace_t rt;
+    afd_trace_ent_t *ents;
+    int nent;
+    afd_trace_exp_t *exps;
+    int nexp;
+    int maxexp;
+    afd_trace_stat_t st;
+} afd_trace_replay_t;
+
+
+static int _afd_trace_write( int fd, const void *buf, size_t len )
+{
+    const char *ptr = (const char*)buf;
+    ssize_t rv = 0;
+    
+    while( len )
+    {
+        if( ( rv = write( fd, ptr, len ) ) > 0 ){
+            ptr += rv;
+            len -= (size_t)rv;
+        }
+        else if( rv == -1 && errno != EINTR ){
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+static int _afd_trace_flush( afd_trace_t *trace )
+{
+    int rc = 0;
+    
+    if( trace->len && trace->fd != -1 &&
+        ( rc = _afd_trace_write( trace->fd, trace->recs,
+                                 trace->len * sizeof( afd_trace_rec_t ) ) ) == -1 ){
+        // stop recording
+        pfelog( write, "stop recording trace" );
+        trace->fd = -1;
+    }
+    trace->len = 0;
+    
+    return rc;
+}
+
+static afd_trace_rec_t *_afd_trace_append( afd_trace_t *trace )
+{
+    if( trace->fd == -1 && !trace->mem ){
+        return NULL;
+    }
+    // expand buffer
+    // NOTE: callbacks may append unwatch records without limit
+    else if( trace->len == trace->cap )
+    {
+        afd_trace_rec_t *recs = prealloc( trace->cap * 2, afd_trace_rec_t,
+                                          trace->recs );
+        
+        if( !recs ){
+            return NULL;
+        }
+        trace->recs = recs;
+        trace->cap *= 2;
+    }
+    
+    return &trace->recs[trace->len++];
+}
+
+void _afd_trace_dealloc( afd_trace_t *trace )
+{
+    _afd_trace_flush( trace );
+    pdealloc( trace->recs );
+    pdealloc( trace );
+}
+
+void _afd_trace_wait( afd_trace_t *trace, int nevt, uint64_t ts )
+{
+    afd_trace_rec_t *rec = NULL;
+    
+    if( trace->len >= AFD_TRACE_NFLUSH && !trace->mem ){
+        _afd_trace_flush( trace );
+    }
+    if( ( rec = _afd_trace_append( trace ) ) ){
+        *rec = (afd_trace_rec_t){
+            .type = AFD_TRACE_WAIT,
+            .val = nevt,
+            .ns = ts - trace->start
+        };
+    }
+}
+
+size_t _afd_trace_event( afd_trace_t *trace, int fd, uint8_t flg, uint8_t evt )
+{
+    afd_trace_rec_t *rec = _afd_trace_append( trace );
+    
+    if( rec ){
+        *rec = (afd_trace_rec_t){
+            .type = AFD_TRACE_EVENT,
+            .flg = flg,
+            .hup = ( evt & (AFD_TRACE_EV_HUP|AFD_TRACE_EV_ERR) ) ? 1 : 0,
+            .evt = evt,
+            .val = fd
+        };
+        return trace->len - 1;
+    }
+    
+    return SIZE_MAX;
+}
+
+void _afd_trace_done( afd_trace_t *trace, size_t rec, uint64_t ns )
+{
+    if( rec < trace->len ){
+        trace->recs[rec].ns = ns;
+    }
+}
+
+void _afd_trace_unwatch( afd_trace_t *trace, int fd )
+{
+    afd_trace_rec_t *rec = _afd_trace_append( trace );
+    
+    if( rec ){
+        *rec = (afd_trace_rec_t){
+            .type = AFD_TRACE_UNWATCH,
+            .val = fd,
+            .ns = _afd_hrtime() - trace->start
+        };
+    }
+}
+
+
+int afd_trace_open( afd_loop_t *loop, int fd )
+{
+    afd_trace_hdr_t hdr = {
+        .magic = AFD_TRACE_MAGIC,
+        .version = AFD_TRACE_VERSION,
+        .reclen = sizeof( afd_trace_rec_t ),
+        .reserved = 0
+    };
+    afd_trace_t *trace = NULL;
+    
+    if( fd < 0 ){
+        errno = EINVAL;
+        return -1;
+    }
+    else if( loop->state->trace ){
+        errno = EALREADY;
+        return -1;
+    }
+    else if( !( trace = palloc( afd_trace_t ) ) ){
+        return -1;
+    }
+    else if( !( trace->recs = pnalloc( AFD_TRACE_NFLUSH, afd_trace_rec_t ) ) ){
+        pdealloc( trace );
+        return -1;
+    }
+    else if( _afd_trace_write( fd, &hdr, sizeof( hdr ) ) == -1 ){
+        pdealloc( trace->recs );
+        pdealloc( trace );
+        return -1;
+    }
+    
+    trace->fd = fd;
+    trace->mem = 0;
+    trace->start = _afd_hrtime();
+    trace->len = 0;
+    trace->cap = AFD_TRACE_NFLUSH;
+    loop->state->trace = trace;
+    
+    return 0;
+}
+
+int afd_trace_close( afd_loop_t *loop )
+{
+    afd_trace_t *trace = loop->state->trace;
+    int rc = 0;
+    
+    if( !trace ){
+        errno = EINVAL;
+        return -1;
+    }
+    
+    loop->state->trace = NULL;
+    rc = _afd_trace_flush( trace );
+    pdealloc( trace->recs );
+    pdealloc( trace );
+    
+    return rc;
+}
+
+
+// read exact length; return 0 on eof
+static ssize_t _afd_trace_read( int fd, void *buf, size_t len )
+{
+    char *ptr = (char*)buf;
+    size_t total = 0;
+    ssize_t rv = 0;
+    
+    while( total < len )
+    {
+        if( ( rv = read( fd, ptr + total, len - total ) ) > 0 ){
+            total += (size_t)rv;
+        }
+        else if( rv == 0 ){
+            break;
+        }
+        else if( errno != EINTR ){
+            return -1;
+        }
+    }
+    
+    return (ssize_t)total;
+}
+
+static afd_trace_ent_t *_afd_trace_lookup( afd_trace_ent_t **ents, int *nent,
+                                           int rfd )
+{
+    if( rfd < 0 ){
+        errno = EINVAL;
+        return NULL;
+    }
+    // expand mapping table
+    else if( rfd >= *nent )
+    {
+        int n = *nent ? *nent : 64;
+        afd_trace_ent_t *ptr = NULL;
+        
+        for(; n <= rfd; n *= 2 ){}
+        if( !( ptr = prealloc( n, afd_trace_ent_t, *ents ) ) ){
+            return NULL;
+        }
+        memset( (void*)( ptr + *nent ), 0, sizeof( afd_trace_ent_t ) *
+                                           ( n - *nent ) );
+        *ents = ptr;
+        *nent = n;
+    }
+    
+    return &(*ents)[rfd];
+}
+
+static int _afd_trace_map( afd_trace_replay_t *rp, afd_trace_ent_t *ent,
+                           afd_trace_rec_t *rec )
+{
+    int sv[2] = { -1, -1 };
+    
+    // timer has no descriptor
+    if( rec->flg != AS_EV_TIMER &&
+        ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) == -1 ||
+          fcntl( sv[0], F_SETFL, O_NONBLOCK ) == -1 ||
+          fcntl( sv[1], F_SETFL, O_NONBLOCK ) == -1 ) ){
+        goto FAILED;
+    }
+    else if( !( ent->w = rp->map( rp->loop, rec->val, rec->flg, sv[0], 
+                                  rp->udata ) ) ){
+        goto FAILED;
+    }
+    else if( afd_watch( rp->loop, ent->w ) == -1 ){
+        pfelog( afd_watch );
+        ent->w = NULL;
+        goto FAILED;
+    }
+    // timer expires only at recorded events
+    else if( ent->w->flg == AS_EV_TIMER ){
+        _afd_timer_arm( rp->loop->state, ent->w, 0 );
+    }
+    ent->peer = sv[1];
+    ent->shut = 0;
+    
+    return 0;
+
+FAILED:
+    if( sv[0] != -1 ){
+        close( sv[0] );
+        close( sv[1] );
+    }
+    return -1;
+}
+
+static void _afd_trace_unmap( afd_trace_ent_t *ent )
+{
+    if( ent->w ){
+        if( ent->peer != -1 ){
+            close( ent->peer );
+        }
+        ent->w = NULL;
+    }
+}
+
+static void _afd_trace_pace( uint64_t at )
+{
+    uint64_t now = _afd_hrtime();
+    
+    if( at > now ){
+        struct timespec ts = {
+            .tv_sec = (time_t)( ( at - now ) / 1000000000ULL ),
+            .tv_nsec = (long)( ( at - now ) % 1000000000ULL )
+        };
+        nanosleep( &ts, NULL );
+    }
+}
+
+static int _afd_trace_push( afd_trace_replay_t *rp, afd_trace_rec_t *rec )
+{
+    if( rp->nexp == rp->maxexp )
+    {
+        int n = rp->maxexp ? rp->maxexp * 2 : 64;
+        afd_trace_exp_t *exps = prealloc( n, afd_trace_exp_t, rp->exps );
+        
+        if( !exps ){
+            return -1;
+        }
+        rp->exps = exps;
+        rp->maxexp = n;
+    }
+    rp->exps[rp->nexp++] = (afd_trace_exp_t){
+        .rec = *rec,
+        .fd = -1,
+        .done = 0
+    };
+    
+    return 0;
+}
+
+// make recorded event occur at next iteration
+static int _afd_trace_prepare( afd_trace_replay_t *rp, afd_trace_exp_t *exp )
+{
+    afd_trace_rec_t *rec = &exp->rec;
+    afd_trace_ent_t *ent = _afd_trace_lookup( &rp->ents, &rp->nent, rec->val );
+    char buf[4096];
+    
+    if( !ent ){
+        return -1;
+    }
+    // ignore event if descriptor could not be mapped
+    else if( !ent->w && _afd_trace_map( rp, ent, rec ) == -1 ){
+        return 0;
+    }
+    
+    if( ent->w->flg == AS_EV_TIMER ){
+        _afd_timer_arm( rp->loop->state, ent->w, 1 );
+    }
+    else if( ent->peer != -1 )
+    {
+        // discard output to keep descriptor writable
+        while( read( ent->peer, buf, sizeof( buf ) ) > 0 ){}
+        // write input data
+        if( ( rec->evt & AFD_TRACE_EV_IN ) && rec->flg == AS_EV_READ &&
+            !ent->shut ){
+            if( rp->feed ){
+                rp->feed( ent->w, ent->peer, rp->udata );
+            }
+            // peer buffer may be full if callback does not read input
+            else if( write( ent->peer, "", 1 ) == -1 ){
+                pelog( "failed to feed input to replay descriptor %d", 
+                       rec->val );
+            }
+        }
+        if( ( rec->evt & (AFD_TRACE_EV_HUP|AFD_TRACE_EV_ERR) ) && 
+            !ent->shut ){
+            shutdown( ent->peer, ( rec->evt & AFD_TRACE_EV_ERR ) ? 
+                                 SHUT_RDWR : SHUT_WR );
+            ent->shut = 1;
+        }
+    }
+    exp->fd = ent->w->fd;
+    
+    return 0;
+}
+
+// match dispatched events of an iteration against recorded events
+static void _afd_trace_match( afd_trace_replay_t *rp )
+{
+    afd_trace_rec_t *rec = rp->rt.recs;
+    afd_trace_rec_t *last = rec + rp->rt.len;
+    int i = 0;
+    
+    for(; rec < last; rec++ )
+    {
+        if( rec->type != AFD_TRACE_EVENT ){
+            continue;
+        }
+        rp->st.nevt++;
+        afd_hist_add( &rp->st.cblat, rec->ns );
+        for( i = 0; i < rp->nexp; i++ )
+        {
+            if( rp->exps[i].rec.type == AFD_TRACE_EVENT && 
+                !rp->exps[i].done && rp->exps[i].fd == rec->val && 
+                rp->exps[i].rec.flg == rec->flg ){
+                rp->exps[i].done = 1;
+                afd_hist_add( &rp->st.rcblat, rp->exps[i].rec.ns );
+                break;
+            }
+        }
+        if( i == rp->nexp ){
+            rp->st.nextra++;
+        }
+    }
+    rp->rt.len = 0;
+}
+
+// replay recorded events of a wait by iterations of loop
+static int _afd_trace_run( afd_trace_replay_t *rp )
+{
+    struct timespec tmo = { 0, 0 };
+    int npend = 0;
+    int retry = 0;
+    int i = 0;
+    
+    for( i = 0; i < rp->nexp; i++ )
+    {
+        if( rp->exps[i].rec.type == AFD_TRACE_EVENT ){
+            if( _afd_trace_prepare( rp, &rp->exps[i] ) == -1 ){
+                return -1;
+            }
+            npend += rp->exps[i].fd != -1;
+        }
+    }
+    
+    for(; npend && retry <= AFD_TRACE_NRETRY; retry++ )
+    {
+        if( afd_loop_once( rp->loop, &tmo ) == -1 && errno != EINTR ){
+            return -1;
+        }
+        _afd_trace_match( rp );
+        for( npend = 0, i = 0; i < rp->nexp; i++ ){
+            npend += rp->exps[i].fd != -1 && !rp->exps[i].done;
+        }
+        // wait for timers and events that were not ready yet
+        tmo.tv_nsec = AFD_TRACE_RETRYNS;
+    }
+    rp->st.nmiss += (uint64_t)npend;
+    
+    // close peers of unwatched descriptors
+    for( i = 0; i < rp->nexp; i++ )
+    {
+        if( rp->exps[i].rec.type == AFD_TRACE_UNWATCH && 
+            rp->exps[i].rec.val >= 0 && rp->exps[i].rec.val < rp->nent ){
+            _afd_trace_unmap( &rp->ents[rp->exps[i].rec.val] );
+        }
+    }
+    rp->nexp = 0;
+    
+    return 0;
+}
+
+// return 1 if exps has unwatch record of rfd
+static int _afd_trace_unwatched( afd_trace_replay_t *rp, int rfd )
+{
+    int i = 0;
+    
+    for(; i < rp->nexp; i++ )
+    {
+        if( rp->exps[i].rec.type == AFD_TRACE_UNWATCH && 
+            rp->exps[i].rec.val == rfd ){
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+int afd_trace_replay( afd_loop_t *loop, int fd, int flags,
+                      afd_trace_map_cb map, afd_trace_feed_cb feed,
+                      void *udata, afd_trace_stat_t *stat )
+{
+    afd_trace_replay_t rp;
+    afd_trace_hdr_t hdr;
+    afd_trace_rec_t recs[256];
+    afd_trace_t *trace = loop->state->trace;
+    afd_trace_rec_t *rec = NULL;
+    int64_t first = -1;
+    uint64_t start = 0;
+    ssize_t len = 0;
+    int rc = 0;
+    int err = 0;
+    int i = 0;
+    
+    if( !map || loop->state->running || loop->state->shared ){
+        errno = EINVAL;
+        return -1;
+    }
+    else if( ( len = _afd_trace_read( fd, &hdr, sizeof( hdr ) ) ) == -1 ){
+        return -1;
+    }
+    else if( len != sizeof( hdr ) || hdr.magic != AFD_TRACE_MAGIC ||
+             hdr.version != AFD_TRACE_VERSION ||
+             hdr.reclen != sizeof( afd_trace_rec_t ) ){
+        errno = EINVAL;
+        return -1;
+    }
+    
+    memset( (void*)&rp, 0, sizeof( rp ) );
+    if( !( rp.rt.recs = pnalloc( AFD_TRACE_NFLUSH, afd_trace_rec_t ) ) ){
+        return -1;
+    }
+    rp.loop = loop;
+    rp.map = map;
+    rp.feed = feed;
+    rp.udata = udata;
+    rp.rt.fd = -1;
+    rp.rt.mem = 1;
+    rp.rt.cap = AFD_TRACE_NFLUSH;
+    // record dispatched events of replay instead
+    loop->state->trace = &rp.rt;
+    start = rp.rt.start = _afd_hrtime();
+    while( ( len = _afd_trace_read( fd, recs, sizeof( recs ) ) ) > 0 )
+    {
+        for( i = 0; i < len / (ssize_t)sizeof( afd_trace_rec_t ); i++ )
+        {
+            rec = &recs[i];
+            switch( rec->type )
+            {
+                case AFD_TRACE_WAIT:
+                    // replay events of previous wait
+                    if( _afd_trace_run( &rp ) == -1 ){
+                        rc = -1;
+                        goto DONE;
+                    }
+                    rp.st.nwait++;
+                    if( first == -1 ){
+                        first = (int64_t)rec->ns;
+                    }
+                    // sleep until relative time of recorded wait
+                    else if( flags & AFD_TRACE_PACED ){
+                        _afd_trace_pace( start + rec->ns - (uint64_t)first );
+                    }
+                break;
+                
+                case AFD_TRACE_EVENT:
+                case AFD_TRACE_UNWATCH:
+                    // replay events before the descriptor that is reused 
+                    // after unwatched in this wait
+                    if( ( rec->type == AFD_TRACE_EVENT &&
+                          _afd_trace_unwatched( &rp, rec->val ) &&
+                          _afd_trace_run( &rp ) == -1 ) ||
+                        _afd_trace_push( &rp, rec ) == -1 ){
+                        rc = -1;
+                        goto DONE;
+                    }
+                break;
+                
+                // invalid record
+                default:
+                    errno = EINVAL;
+                    rc = -1;
+                    goto LAST;
+            }
+        }
+        // last record is truncated
+        if( len % (ssize_t)sizeof( afd_trace_rec_t ) ){
+            errno = EINVAL;
+            rc = -1;
+            goto LAST;
+        }
+    }
+    if( len == -1 ){
+        rc = -1;
+        goto DONE;
+    }
+
+LAST:
+    // replay events of last wait(or before invalid record)
+    err = errno;
+    if( _afd_trace_run( &rp ) == -1 ){
+        rc = -1;
+    }
+    else {
+        errno = err;
+    }
+
+DONE:
+    err = errno;
+    loop->state->trace = trace;
+    rp.st.elapsed = _afd_hrtime() - start;
+    for( i = 0; i < rp.nent; i++ ){
+        _afd_trace_unmap( &rp.ents[i] );
+    }
+    pdealloc( rp.ents );
+    pdealloc( rp.exps );
+    pdealloc( rp.rt.recs );
+    if( stat ){
+        *stat = rp.st;
+    }
+    errno = err;
+    
+    return rc;
+}
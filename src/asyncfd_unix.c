@@ -0,0 +1,264 @@
+/*
+ *  asyncfd_unix.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+// sendmmsg, recvmmsg and struct ucred
+#define _GNU_SOURCE
+#include "libasyncfd_unix.h"
+#include "asyncfd_private.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL    0
+#endif
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC    0
+#endif
+
+// control message buffer
+typedef union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE( sizeof( int ) * AFD_UNIX_MAXFDS )
+#ifdef SCM_CREDENTIALS
+             + CMSG_SPACE( sizeof( struct ucred ) )
+#endif
+            ];
+} afd_unix_ctl_t;
+
+#if !HAVE_SENDMMSG || !HAVE_RECVMMSG
+struct afd_mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#define mmsghdr afd_mmsghdr
+#endif
+
+#if !HAVE_SENDMMSG
+// send messages one by one
+static int _afd_sendmmsg( int fd, struct mmsghdr *hdrs, unsigned int n,
+                          int flags )
+{
+    unsigned int i = 0;
+    ssize_t rv = 0;
+    
+    for(; i < n; i++ )
+    {
+        if( ( rv = sendmsg( fd, &hdrs[i].msg_hdr, flags ) ) == -1 ){
+            return i ? (int)i : -1;
+        }
+        hdrs[i].msg_len = (unsigned int)rv;
+    }
+    
+    return (int)n;
+}
+#define sendmmsg(fd,hdrs,n,flags)   _afd_sendmmsg(fd,hdrs,n,flags)
+#endif
+
+#if !HAVE_RECVMMSG
+// receive messages one by one
+static int _afd_recvmmsg( int fd, struct mmsghdr *hdrs, unsigned int n,
+                          int flags )
+{
+    unsigned int i = 0;
+    ssize_t rv = 0;
+    
+    for(; i < n; i++ )
+    {
+        // do not wait after first message
+        if( ( rv = recvmsg( fd, &hdrs[i].msg_hdr,
+                            i ? flags|MSG_DONTWAIT : flags ) ) == -1 ){
+            return i ? (int)i : -1;
+        }
+        hdrs[i].msg_len = (unsigned int)rv;
+        // end of stream
+        if( rv == 0 ){
+            return (int)i + 1;
+        }
+    }
+    
+    return (int)n;
+}
+#define recvmmsg(fd,hdrs,n,flags,timeout)   _afd_recvmmsg(fd,hdrs,n,flags)
+#endif
+
+#ifndef MSG_WAITFORONE
+#define MSG_WAITFORONE  0
+#endif
+
+
+int afd_unix_sendmsg( int fd, afd_unix_msg_t *msgs, int nmsg )
+{
+    struct mmsghdr hdrs[AFD_UNIX_BATCH];
+    struct iovec iovs[AFD_UNIX_BATCH];
+    afd_unix_ctl_t ctls[AFD_UNIX_BATCH];
+    struct cmsghdr *cmsg = NULL;
+    afd_unix_msg_t *msg = NULL;
+    int total = 0;
+    int n = 0;
+    int i = 0;
+    int rv = 0;
+    
+    while( total < nmsg )
+    {
+        n = nmsg - total < AFD_UNIX_BATCH ? nmsg - total : AFD_UNIX_BATCH;
+        for( i = 0; i < n; i++ )
+        {
+            msg = &msgs[total + i];
+            if( msg->nfds < 0 || msg->nfds > AFD_UNIX_MAXFDS ){
+                errno = EINVAL;
+                return total ? total : -1;
+            }
+            iovs[i] = (struct iovec){
+                .iov_base = msg->buf,
+                .iov_len = msg->len
+            };
+            memset( (void*)&hdrs[i], 0, sizeof( struct mmsghdr ) );
+            hdrs[i].msg_hdr.msg_iov = &iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+            // attach descriptors
+            if( msg->nfds )
+            {
+                hdrs[i].msg_hdr.msg_control = ctls[i].buf;
+                hdrs[i].msg_hdr.msg_controllen = CMSG_SPACE( sizeof( int ) *
+                                                             msg->nfds );
+                cmsg = CMSG_FIRSTHDR( &hdrs[i].msg_hdr );
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN( sizeof( int ) * msg->nfds );
+                memcpy( CMSG_DATA( cmsg ), (void*)msg->fds,
+                        sizeof( int ) * msg->nfds );
+            }
+        }
+        
+        if( ( rv = sendmmsg( fd, hdrs, (unsigned int)n, MSG_NOSIGNAL ) ) == -1 ){
+            return total ? total : -1;
+        }
+        total += rv;
+        // socket buffer is full
+        if( rv < n ){
+            break;
+        }
+    }
+    
+    return total;
+}
+
+
+static void _afd_unix_parse( struct msghdr *hdr, afd_unix_msg_t *msg )
+{
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR( hdr );
+    int cap = msg->nfds;
+    int nfds = 0;
+    int i = 0;
+    
+    msg->nfds = 0;
+    msg->pid = -1;
+    msg->flags = hdr->msg_flags & (MSG_TRUNC|MSG_CTRUNC);
+    for(; cmsg; cmsg = CMSG_NXTHDR( hdr, cmsg ) )
+    {
+        if( cmsg->cmsg_level != SOL_SOCKET ){
+            continue;
+        }
+        else if( cmsg->cmsg_type == SCM_RIGHTS )
+        {
+            int *fds = (int*)CMSG_DATA( cmsg );
+            
+            nfds = (int)( ( cmsg->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int ) );
+            for( i = 0; i < nfds; i++ )
+            {
+                // close descriptors that cannot be stored
+                if( msg->nfds == cap ){
+                    close( fds[i] );
+                    msg->flags |= MSG_CTRUNC;
+                }
+                else {
+                    (void)afd_filefd_init( fds[i] );
+                    msg->fds[msg->nfds++] = fds[i];
+                }
+            }
+        }
+#ifdef SCM_CREDENTIALS
+        else if( cmsg->cmsg_type == SCM_CREDENTIALS )
+        {
+            struct ucred cred;
+            
+            memcpy( (void*)&cred, CMSG_DATA( cmsg ), sizeof( cred ) );
+            msg->pid = cred.pid;
+            msg->uid = cred.uid;
+            msg->gid = cred.gid;
+        }
+#endif
+    }
+}
+
+int afd_unix_recvmsg( int fd, afd_unix_msg_t *msgs, int nmsg )
+{
+    struct mmsghdr hdrs[AFD_UNIX_BATCH];
+    struct iovec iovs[AFD_UNIX_BATCH];
+    afd_unix_ctl_t ctls[AFD_UNIX_BATCH];
+    afd_unix_msg_t *msg = NULL;
+    int n = nmsg < AFD_UNIX_BATCH ? nmsg : AFD_UNIX_BATCH;
+    int type = 0;
+    socklen_t tlen = (socklen_t)sizeof( type );
+    int rv = 0;
+    int i = 0;
+    
+    for(; i < n; i++ )
+    {
+        msg = &msgs[i];
+        iovs[i] = (struct iovec){
+            .iov_base = msg->buf,
+            .iov_len = msg->len
+        };
+        memset( (void*)&hdrs[i], 0, sizeof( struct mmsghdr ) );
+        hdrs[i].msg_hdr.msg_iov = &iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+        hdrs[i].msg_hdr.msg_control = ctls[i].buf;
+        hdrs[i].msg_hdr.msg_controllen = sizeof( ctls[i].buf );
+    }
+    
+    if( ( rv = recvmmsg( fd, hdrs, (unsigned int)n,
+                         MSG_CMSG_CLOEXEC|MSG_WAITFORONE, NULL ) ) > 0 )
+    {
+        for( i = 0; i < rv; i++ )
+        {
+            // zero-length message is end of stream only on stream socket,
+            // and an empty message on datagram socket
+            if( !hdrs[i].msg_len && !hdrs[i].msg_hdr.msg_controllen )
+            {
+                if( !type && getsockopt( fd, SOL_SOCKET, SO_TYPE, &type, 
+                                         &tlen ) == -1 ){
+                    type = SOCK_STREAM;
+                }
+                if( type == SOCK_STREAM ){
+                    return i;
+                }
+            }
+            msgs[i].len = hdrs[i].msg_len;
+            _afd_unix_parse( &hdrs[i].msg_hdr, &msgs[i] );
+        }
+    }
+    
+    return rv;
+}
+
+int afd_unix_passcred( int fd, int enable )
+{
+#ifdef SO_PASSCRED
+    return setsockopt( fd, SOL_SOCKET, SO_PASSCRED, &enable,
+                       (socklen_t)sizeof( enable ) );
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
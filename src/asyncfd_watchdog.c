@@ -0,0 +1,232 @@
+/*
+ *  asyncfd_watchdog.c
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+
+#include "libasyncfd_watchdog.h"
+#include "asyncfd_private.h"
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#if HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+
+// maximum depth of backtrace
+#define AFD_WATCHDOG_BTDEPTH    64
+
+struct _afd_watchdog_t {
+    uint64_t stall;
+    int sig;
+    volatile int running;
+    pthread_t th;
+    pthread_mutex_t mutex;
+    int nloop;
+    int maxloop;
+    afd_loop_t **loops;
+    // start time of last reported stall of each loop
+    uint64_t *reported;
+};
+
+// output descriptor of signal handler
+static volatile int _afd_watchdog_btfd = -1;
+
+
+static void _afd_watchdog_backtrace( int sig )
+{
+    (void)sig;
+#if HAVE_BACKTRACE
+    int err = errno;
+    void *bt[AFD_WATCHDOG_BTDEPTH];
+    int n = backtrace( bt, AFD_WATCHDOG_BTDEPTH );
+    
+    // NOTE: backtrace_symbols_fd does not call malloc
+    backtrace_symbols_fd( bt, n, _afd_watchdog_btfd );
+    errno = err;
+#endif
+}
+
+static void _afd_watchdog_check( afd_watchdog_t *wd, uint64_t now )
+{
+    afd_state_t *state = NULL;
+    uint64_t since = 0;
+    int i = 0;
+    
+    for(; i < wd->nloop; i++ )
+    {
+        state = wd->loops[i]->state;
+        since = state->since;
+        // report once for each stall
+        if( since && now - since >= wd->stall && wd->reported[i] != since )
+        {
+            wd->reported[i] = since;
+            afd_log_warn( "loop %p stalled for %llu ms in watch %p",
+                          wd->loops[i], ( now - since ) / 1000000,
+                          state->curw );
+            if( wd->sig ){
+                pthread_kill( state->thread, wd->sig );
+            }
+        }
+    }
+}
+
+static void *_afd_watchdog_monitor( void *arg )
+{
+    afd_watchdog_t *wd = (afd_watchdog_t*)arg;
+    // check twice in threshold
+    uint64_t interval = wd->stall / 2;
+    struct timespec ts = {
+        .tv_sec = (time_t)( interval / 1000000000ULL ),
+        .tv_nsec = (long)( interval % 1000000000ULL )
+    };
+    
+    while( wd->running ){
+        nanosleep( &ts, NULL );
+        pthread_mutex_lock( &wd->mutex );
+        _afd_watchdog_check( wd, _afd_hrtime() );
+        pthread_mutex_unlock( &wd->mutex );
+    }
+    
+    return NULL;
+}
+
+
+void afd_loop_slowcb( afd_loop_t *loop, uint64_t nsec )
+{
+    loop->state->slowcb = nsec;
+}
+
+
+afd_watchdog_t *afd_watchdog_alloc( int msec, int sig, int fd )
+{
+    afd_watchdog_t *wd = NULL;
+    
+    if( msec < 1 || sig < 0 || ( sig && fd < 0 ) ){
+        errno = EINVAL;
+        return NULL;
+    }
+#if !HAVE_BACKTRACE
+    else if( sig ){
+        errno = ENOTSUP;
+        return NULL;
+    }
+#endif
+    else if( !( wd = palloc( afd_watchdog_t ) ) ){
+        return NULL;
+    }
+    
+    wd->stall = (uint64_t)msec * 1000000ULL;
+    wd->sig = sig;
+    wd->running = 1;
+    wd->nloop = 0;
+    wd->maxloop = 0;
+    wd->loops = NULL;
+    wd->reported = NULL;
+    pthread_mutex_init( &wd->mutex, NULL );
+    if( sig )
+    {
+        struct sigaction sa;
+#if HAVE_BACKTRACE
+        void *bt[1];
+        
+        // NOTE: first call of backtrace may allocate memory to load
+        //       libgcc, so call it here instead of signal handler
+        backtrace( bt, 1 );
+#endif
+        memset( (void*)&sa, 0, sizeof( sa ) );
+        sa.sa_handler = _afd_watchdog_backtrace;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset( &sa.sa_mask );
+        _afd_watchdog_btfd = fd;
+        if( sigaction( sig, &sa, NULL ) == -1 ){
+            goto FAILED;
+        }
+    }
+    
+    if( ( errno = pthread_create( &wd->th, NULL, _afd_watchdog_monitor,
+                                  (void*)wd ) ) == 0 ){
+        return wd;
+    }
+
+FAILED:
+    pthread_mutex_destroy( &wd->mutex );
+    pdealloc( wd );
+    return NULL;
+}
+
+void afd_watchdog_dealloc( afd_watchdog_t *wd )
+{
+    int i = 0;
+    
+    wd->running = 0;
+    pthread_join( wd->th, NULL );
+    for(; i < wd->nloop; i++ ){
+        __sync_sub_and_fetch( &wd->loops[i]->state->watchdog, 1 );
+    }
+    pthread_mutex_destroy( &wd->mutex );
+    if( wd->loops ){
+        pdealloc( wd->loops );
+        pdealloc( wd->reported );
+    }
+    pdealloc( wd );
+}
+
+int afd_watchdog_add( afd_watchdog_t *wd, afd_loop_t *loop )
+{
+    int rc = 0;
+    
+    pthread_mutex_lock( &wd->mutex );
+    // expand containers
+    if( wd->nloop == wd->maxloop )
+    {
+        int n = wd->maxloop ? wd->maxloop * 2 : 4;
+        afd_loop_t **loops = prealloc( n, afd_loop_t*, wd->loops );
+        uint64_t *reported = NULL;
+        
+        if( loops ){
+            wd->loops = loops;
+            if( ( reported = prealloc( n, uint64_t, wd->reported ) ) ){
+                wd->reported = reported;
+                wd->maxloop = n;
+            }
+        }
+        if( !reported ){
+            rc = -1;
+        }
+    }
+    if( rc == 0 ){
+        wd->loops[wd->nloop] = loop;
+        wd->reported[wd->nloop++] = 0;
+        __sync_add_and_fetch( &loop->state->watchdog, 1 );
+    }
+    pthread_mutex_unlock( &wd->mutex );
+    
+    return rc;
+}
+
+int afd_watchdog_del( afd_watchdog_t *wd, afd_loop_t *loop )
+{
+    int i = 0;
+    
+    pthread_mutex_lock( &wd->mutex );
+    for(; i < wd->nloop; i++ )
+    {
+        if( wd->loops[i] == loop ){
+            wd->nloop--;
+            wd->loops[i] = wd->loops[wd->nloop];
+            wd->reported[i] = wd->reported[wd->nloop];
+            __sync_sub_and_fetch( &loop->state->watchdog, 1 );
+            pthread_mutex_unlock( &wd->mutex );
+            return 0;
+        }
+    }
+    pthread_mutex_unlock( &wd->mutex );
+    
+    errno = ENOENT;
+    return -1;
+}
+
@@ -70,6 +70,18 @@ void afd_sock_dealloc( afd_sock_t *as );
     return: 0 on success, or -1 on failure.(check errno)
 */
 int afd_listen( afd_sock_t *as, int backlog );
+/*
+    get byte counts of send queue of TCP socket by SIOCOUTQ and
+    SIOCOUTQNSD ioctl.
+    
+    fd      : descriptor of connected TCP socket
+    unsent  : to set number of bytes that have not been sent yet
+    inflight: to set number of bytes that have been sent but not acked
+    
+    return: 0 on success, or -1 on failure.(check errno)
+            ENOTSUP will be set if platform does not support it.
+*/
+int afd_sock_outq( int fd, size_t *unsent, size_t *inflight );
 
 
 /*
@@ -78,10 +90,15 @@ int afd_listen( afd_sock_t *as, int backlog );
 typedef struct _afd_state_t afd_state_t;
 /*
     event loop data structure
+    
+    as      : afd_sock_t
+    state   : event loop state (internal use)
+    now     : cached monotonic clock in nanoseconds (see afd_loop_now)
 */
 typedef struct {
     afd_sock_t *as;
     afd_state_t *state;
+    uint64_t now;
 } afd_loop_t;
 
 /*
@@ -108,7 +125,8 @@ afd_loop_t *afd_loop_alloc( afd_sock_t *as, int32_t nevts,
 void afd_loop_dealloc( afd_loop_t *loop );
 
 /*
-    run event loop forever
+    run event loop forever.
+    the loop sleeps until events arrive without periodic wake-up.
     
     loop    : target event loop
 */
@@ -118,17 +136,206 @@ int afd_loop( afd_loop_t *loop );
     run event loop a once
     
     loop    : target event loop
-    timeout : if set to NULL wait forever
+    timeout : nanosecond precision timeout. if set to NULL wait forever
 */
 int afd_loop_once( afd_loop_t *loop, struct timespec *timeout );
 
 /*
-    stop running loop
+    return descriptor of event loop(epoll or kqueue) to embed the loop in 
+    other event loop.
+    the descriptor becomes readable when the loop has events to dispatch, 
+    including expired timers. register it to other event loop for read 
+    event and call afd_loop_step when it is readable.
+    
+    loop    : target event loop
+*/
+int afd_loop_fd( afd_loop_t *loop );
+
+/*
+    dispatch ready events without blocking.
+    
+    loop        : target event loop
+    deadline    : time(afd_loop_now clock) by which afd_loop_step must be 
+                  called again even if the loop descriptor is not readable, 
+                  or UINT64_MAX if not needed. it will be current time if 
+                  bulk events are carried over(see afd_loop_bulk_budget), 
+                  or soon if accepting is paused by admission control.
+                  NOTE: expiration of timer makes the loop descriptor 
+                        readable, so it does not affect deadline.
+    
+    return: number of received events, or -1 on failure.(check errno)
+*/
+int afd_loop_step( afd_loop_t *loop, uint64_t *deadline );
+
+/*
+    set time budget for the watches of bulk priority class.
+    
+    the events of each iteration are dispatched in the order of priority 
+    class; AS_EV_CONTROL, normal, then AS_EV_BULK. bulk events are 
+    dispatched until their callbacks spent the budget, and the rest are 
+    carried over to next iteration that will not wait for new events.
+    at least one bulk event is dispatched in each iteration.
+    
+    NOTE: shared loop(afd_loop_mt) dispatches events in received order.
+    
+    loop    : target event loop
+    nsec    : budget in nanoseconds per iteration, or 0 to unlimited
+*/
+void afd_loop_bulk_budget( afd_loop_t *loop, uint64_t nsec );
+
+/*
+    stop running loop.
+    the loop will be woken up if called from other thread.
     
     loop    : target event loop
 */
 void afd_unloop( afd_loop_t *loop );
 
+/*
+    enable shared mode of event loop.
+    multiple threads can dispatch events of shared loop at the same time by 
+    afd_loop_mt. each watch will be registered in oneshot mode(EPOLLONESHOT 
+    or EV_DISPATCH), and re-armed after the callback returns, so the events 
+    of a watch are never dispatched by two threads at once, and the loads 
+    of threads are balanced by each request.
+    
+    NOTE: this function must be called before registering watches.
+          afd_loop and afd_loop_once cannot run shared loop.
+    
+    loop    : target event loop
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_loop_share( afd_loop_t *loop );
+
+/*
+    run shared event loop on calling thread until afd_unloop is called.
+    call this function from each thread of thread pool.
+    
+    NOTE: a watch must be deregistered by its own callback(or after all 
+          threads returned) because other threads may dispatch it.
+          prepare/check hooks, trace recorder, metrics, watchdog, load 
+          balancer and admission control are not run by shared loop.
+    
+    loop    : shared event loop
+    nevts   : number of events received at once by calling thread.
+              small number balances loads better.
+    
+    return: 0 on stopped by afd_unloop, or -1 on failure.(check errno)
+*/
+int afd_loop_mt( afd_loop_t *loop, int32_t nevts );
+
+/*
+    return monotonic clock in nanoseconds that is cached when the loop
+    returned from waiting for events.
+    callbacks can read it instead of calling clock_gettime.
+    
+    loop    : target event loop
+*/
+#define afd_loop_now(loop)  ((loop)->now)
+
+
+/*
+    loop hook data structure
+    
+    prepare hooks will be called right before waiting for events, and check 
+    hooks will be called right after dispatching received events of each 
+    iteration. it can be used to flush the data that has been collected by 
+    the callbacks of that iteration at once.
+    
+    next    : next hook (internal use)
+    cb      : callback-function pointer (internal use)
+    udata   : user data pointer
+*/
+typedef struct _afd_hook_t afd_hook_t;
+/* callback-function prototype of loop hook */
+typedef void (*afd_hook_cb)( afd_loop_t *loop, afd_hook_t *h );
+struct _afd_hook_t {
+    afd_hook_t *next;
+    afd_hook_cb cb;
+    void *udata;
+};
+
+/*
+    initialize afd_hook_t
+    
+    h       : empty hook data structure(mean not NULL)
+    cb      : callback function
+    udata   : to set a udata of h(afd_hook_t)
+    
+    return: 0 on success, -1 on failure.(check errno)
+*/
+int afd_hook_init( afd_hook_t *h, afd_hook_cb cb, void *udata );
+
+/*
+    register afd_hook_t to the prepare/check hook list of event loop.
+    hooks are called in the order of registration.
+    
+    loop: target event loop(non NULL)
+    h   : initialized afd_hook_t pointer
+    
+    return: 0 on success, -1 on failure.(check errno)
+*/
+int afd_loop_on_prepare( afd_loop_t *loop, afd_hook_t *h );
+int afd_loop_on_check( afd_loop_t *loop, afd_hook_t *h );
+
+/*
+    deregister afd_hook_t from event loop.
+    it is safe to call in the hook callback.
+    
+    loop: target event loop
+    h   : registered afd_hook_t pointer
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_loop_off_hook( afd_loop_t *loop, afd_hook_t *h );
+
+
+/*
+    NUMA memory allocation flags
+*/
+// use hugepage if possible
+#define AS_NUMA_HUGEPAGE    1
+
+/*
+    bind calling thread to cpu, and move the memory of event loop to the 
+    local NUMA node of cpu.
+    the pages of loop state and local memory are migrated in place, so that 
+    the pointers to them remain valid.
+    
+    NOTE: this function must be called on the thread that will run the loop 
+          before running it.(e.g. after fork)
+    
+    loop    : target event loop
+    cpu     : cpu number
+    flags   : AS_NUMA_HUGEPAGE or 0
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_loop_bind_cpu( afd_loop_t *loop, int cpu, int flags );
+
+/*
+    allocate memory on the NUMA node of event loop for watch pools or I/O 
+    buffers.
+    memory up to 16KB is carved from the node-local slabs of loop and is 
+    aligned to cache line, and larger memory is mapped by page granularity.
+    
+    NOTE: this function is not thread-safe. call it on the thread that runs 
+          the loop. all memory is released by afd_loop_dealloc.
+    
+    loop    : target event loop
+    size    : byte length
+    
+    return: pointer to allocated memory, or NULL on failure.(check errno)
+*/
+void *afd_loop_local_alloc( afd_loop_t *loop, size_t size );
+/*
+    deallocate memory that allocated by afd_loop_local_alloc.
+    
+    NOTE: call it on the thread that runs the loop.
+*/
+void afd_loop_local_dealloc( void *ptr );
+
 
 /*
     event watch flags
@@ -145,8 +352,19 @@ typedef enum {
     AS_EV_WRITE = 1 << 2,
     // watch timer event
     AS_EV_TIMER = 1 << 3,
+    // watch attribute flags that will use with read or write event types.
+    // allow afd_balancer_t to move watch to other event loop
+    AS_EV_MOVABLE = 1 << 4,
+    // priority class of watch(default: normal)
+    // dispatch before other events of same iteration(e.g. control-plane 
+    // connections and health checks)
+    AS_EV_CONTROL = 1 << 5,
+    // dispatch after other events of same iteration within the bulk budget
+    // (see afd_loop_bulk_budget)
+    AS_EV_BULK = 1 << 6,
     // valid event watch flag
-    AS_EV_ISVALID = ~(AS_EV_EDGE|AS_EV_READ|AS_EV_WRITE)
+    AS_EV_ISVALID = ~(AS_EV_EDGE|AS_EV_READ|AS_EV_WRITE|AS_EV_MOVABLE|
+                      AS_EV_CONTROL|AS_EV_BULK)
 } afd_evflag_e;
 
 typedef struct _afd_watch_t afd_watch_t;
@@ -156,29 +374,55 @@ typedef void (*afd_watch_cb)( afd_loop_t *loop, afd_watch_t *w,
 /*
     event watch data structure
     
+    NOTE: keep it in half of cache line(32 bytes on 64bit architecture).
+          timer state is held by afd_timer_t.
+    
     fd      : descrictor
     flg     : event flag(AS_EV_READ or AS_EV_WRITE or AS_EV_TIMER)
+    attr    : attribute flag (internal use)
     fflg    : event filter flag (internal use)
     filter  : event filter (internal use)
-    tspec   : timeout interval for timer event (internal use)
+    gen     : generation that is incremented by deregistration (internal use)
+              NOTE: afd_watch_init keeps it, so do not clear it when reusing
+                    a watch from a pool.
+    lock    : spin lock for shared loop (internal use)
     cb      : callback-function pointer (internal use)
     udata   : user data pointer
 */
 struct _afd_watch_t {
     int fd;
     uint8_t flg;
-    uint32_t fflg;
+    uint8_t attr;
+    uint16_t fflg;
 #if USE_KQUEUE
     int16_t filter;
-    struct timespec tspec;
 #elif USE_EPOLL
     uint32_t filter;
-    struct itimerspec tspec;
 #endif
+    uint16_t gen;
+    volatile uint8_t lock;
     afd_watch_cb cb;
     void *udata;
 };
 
+/*
+    timer watch data structure
+    
+    the callback of timer receives the address of w member, so it can be 
+    casted to afd_timer_t.
+    
+    w       : event watch
+    tspec   : timeout interval (internal use)
+*/
+typedef struct {
+    afd_watch_t w;
+#if USE_KQUEUE
+    struct timespec tspec;
+#elif USE_EPOLL
+    struct itimerspec tspec;
+#endif
+} afd_timer_t;
+
 /*
     initialize afd_watch_t for read/write event
     
@@ -187,6 +431,8 @@ struct _afd_watch_t {
     flg     : event type flag.(default level trigger)
                 eg: if you want to watch read event with edge trigger;
                     AS_EV_READ|AS_EV_EDGE
+                add AS_EV_MOVABLE if afd_balancer_t can move this watch.
+                add AS_EV_CONTROL or AS_EV_BULK to change priority class.
     cb      : callback function on this event
     udata   : to set a udata of w(afd_watch_t)
     
@@ -195,29 +441,54 @@ struct _afd_watch_t {
 int afd_watch_init( afd_watch_t *w, int fd, afd_evflag_e flg, afd_watch_cb cb, 
                     void *udata );
 /*
-    initialize afd_watch_t for timer event
+    set TCP_NOTSENT_LOWAT to descriptor of write watch, so the write 
+    event will be triggered only when bytes not sent yet become less than 
+    lowat, instead of when send buffer has free space.
+    it keeps unsent data in kernel small, and producer can generate data
+    just in time.(see afd_sock_outq)
     
-    w       : empty watch data structure(mean not NULL)
-    tspec   : timeout interval
+    w       : initialized afd_watch_t with AS_EV_WRITE for TCP socket
+    lowat   : threshold bytes of unsent data
+    
+    return: 0 on success, -1 on failure.(check errno)
+            ENOTSUP will be set if platform does not support it.
+*/
+int afd_watch_lowat( afd_watch_t *w, int lowat );
+/*
+    initialize afd_timer_t for timer event.
+    register &t->w to event loop by afd_watch.
+    
+    t       : empty timer data structure(mean not NULL)
+    tspec   : timeout interval(must be greater than zero)
     cb      : callback function on this event
-    udata   : to set a udata of w(afd_watch_t)
+    udata   : to set a udata of t->w(afd_watch_t)
     
     return: 0 on success, -1 on failure.(check errno)
+            EINVAL will be set if tspec is zero or invalid.
 */
-int afd_timer_init( afd_watch_t *w, struct timespec *tspec, afd_watch_cb cb, 
+int afd_timer_init( afd_timer_t *t, struct timespec *tspec, afd_watch_cb cb, 
                     void *udata );
 
 /*
     update time interval for timer event
     
-    w       : afd_watch_t for timer
-    tspec   : timeout interval
+    t       : afd_timer_t
+    tspec   : timeout interval(must be greater than zero)
+    
+    return: 0 on success, -1 on failure.(check errno)
+            EINVAL will be set if tspec is zero or invalid, and the 
+            interval is not changed.
 */
-void afd_timer_update( afd_watch_t *w, struct timespec *tspec );
+int afd_timer_update( afd_timer_t *t, struct timespec *tspec );
 
 /*
     register afd_watch_t to event loop.
     
+    NOTE: on 64bit architecture, the upper 16 bits of address of w must be
+          0, because they are used for generation tag of events. EINVAL 
+          will be set for tagged pointer(e.g. aarch64 TBI/MTE) or address 
+          above 48 bits.
+    
     loop: target event loop(non NULL)
     w   : initialized afd_watch_t pointer
     
@@ -233,9 +504,34 @@ int afd_watch( afd_loop_t *loop, afd_watch_t *w );
     return: 0 on success, -1 on failure.(check errno)
 */
 int afd_nwatch( afd_loop_t *loop, ... );
+/*
+    dispatch read watch immediately if data has already arrived, or 
+    register it to event loop if the descriptor is not readable.
+    (e.g. for the socket accepted with TCP_DEFER_ACCEPT)
+    it saves the wait of an iteration of event loop before the first read 
+    at the cost of a recv(MSG_PEEK) probe. the watch will be registered 
+    after the callback unless the callback deregistered it, so it does 
+    not save a registration of the connection that is kept alive.
+    
+    NOTE: do not move w to other loop in the callback.
+    
+    loop: target event loop(non NULL)
+    w   : initialized afd_watch_t pointer with AS_EV_READ
+    
+    return: 0 on success, -1 on failure.(check errno)
+            w is not registered on failure, but the callback may have 
+            been called.
+*/
+int afd_watch_eager( afd_loop_t *loop, afd_watch_t *w );
 
 /*
     deregister afd_watch_t from event loop.
+    the remaining events of w in current iteration will be skipped, so the 
+    memory of w can be reused for other watch(e.g. returned to a pool) in 
+    the callback. use afd_watch_release to free it.
+    NOTE: on 32bit architecture, the events that other threads of shared 
+          loop received cannot be skipped. use afd_watch_release instead 
+          of reusing w.
     
     loop    : target event loop
     closefd : 1 on close descriptor and deregistered w from event loop
@@ -254,6 +550,79 @@ int afd_unwatch( afd_loop_t *loop, int closefd, afd_watch_t *w );
 */
 int afd_unnwatch( afd_loop_t *loop, int closefd, ... );
 
+/* deallocation callback-function prototype of afd_watch_release */
+typedef void (*afd_watch_free_cb)( afd_watch_t *w );
+/*
+    free deregistered afd_watch_t after current iteration.
+    the received events that refer to w may remain in current iteration, 
+    so w will be passed to cb at the end of iteration(or immediately if the 
+    loop is not dispatching). shared loop(see afd_loop_share) calls cb 
+    after all threads finished the events that received before.
+    
+    loop    : event loop that w was registered
+    w       : deregistered afd_watch_t pointer
+    cb      : deallocation function(e.g. free for malloc'ed watch)
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_watch_release( afd_loop_t *loop, afd_watch_t *w, afd_watch_free_cb cb );
+
+/*
+    move registered afd_watch_t to another event loop.
+    w will be registered to "to" before deregistered from "from", so w is 
+    still registered to "from" on failure.
+    
+    NOTE: this function must be called on the thread that running "from" 
+          (e.g. in callback) or while "from" is not running. after moving, 
+          callback of w will be called on the thread that running "to", 
+          so udata of w must not be shared with the watches of "from".
+    
+    from    : event loop that w registered
+    to      : destination event loop
+    w       : registered afd_watch_t pointer
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_watch_move( afd_loop_t *from, afd_loop_t *to, afd_watch_t *w );
+
+
+/*
+    load balancer data structure(opaque)
+    
+    balancer measures the busy time of each event loop, and moves the 
+    watches that initialized with AS_EV_MOVABLE flag away from the loops 
+    whose busy ratio exceeds the threshold to the least busy loop.
+    the watches will be moved by the loop itself at the time they are 
+    dispatched, and their events will be delivered to the destination loop.
+*/
+typedef struct _afd_balancer_t afd_balancer_t;
+
+/*
+    create and return afd_balancer_t
+    
+    loops       : array of event loops
+    nloop       : number of loops(greater than 1)
+    threshold   : busy ratio(0 < threshold < 1) of overloaded loop
+    nmove       : maximum number of watches to move from overloaded loop at 
+                  each afd_balance
+    
+    return: new afd_balancer_t on success, or NULL on failure.(check errno)
+*/
+afd_balancer_t *afd_balancer_alloc( afd_loop_t **loops, int nloop, 
+                                    double threshold, int nmove );
+/*
+    deallocate afd_balancer_t
+*/
+void afd_balancer_dealloc( afd_balancer_t *b );
+
+/*
+    measure busy ratio of each loop since last call and mark overloaded 
+    loops. call this function periodically from any thread.(e.g. timer)
+    
+    return: number of overloaded loops.
+*/
+int afd_balance( afd_balancer_t *b );
+
 
 /* helper functions */
 #define afd_filefd_init(fd) \
@@ -0,0 +1,84 @@
+/*
+ *  libasyncfd_admit.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+#ifndef ___ASYNCFD_ADMIT___
+#define ___ASYNCFD_ADMIT___
+
+#include "libasyncfd.h"
+
+/*
+    admission control limits
+    
+    each limit has a high watermark that pauses accepting and a low
+    watermark that resumes it. accepting will be resumed when all values
+    fall to or below the low watermarks.
+    a limit of 0 disables the check.
+    
+    maxconn : number of connections to pause
+    lowconn : number of connections to resume
+    maxoutq : bytes of queued output to pause
+    lowoutq : bytes of queued output to resume
+    maxlag  : loop lag(moving average of busy time of iteration) in
+              nanoseconds to pause
+    lowlag  : loop lag in nanoseconds to resume
+*/
+typedef struct {
+    uint32_t maxconn;
+    uint32_t lowconn;
+    uint64_t maxoutq;
+    uint64_t lowoutq;
+    uint64_t maxlag;
+    uint64_t lowlag;
+} afd_admit_conf_t;
+
+/*
+    enable admission control of event loop.
+    
+    when a limit is crossed, the loop unregisters listen watch to stop
+    accepting(other processes that bound to the same address by
+    SO_REUSEPORT will take over new connections), and registers it again
+    when load drops. the values will be evaluated at the end of iteration.
+    
+    loop    : target event loop
+    listen  : registered watch of listening socket
+    conf    : admission control limits(will be copied)
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_admit_init( afd_loop_t *loop, afd_watch_t *listen,
+                    const afd_admit_conf_t *conf );
+
+/*
+    disable admission control.
+    listen watch will be registered again if paused.
+*/
+void afd_admit_dispose( afd_loop_t *loop );
+
+/*
+    report change of number of connections
+    
+    loop    : target event loop
+    delta   : +1 on accept, -1 on close
+*/
+void afd_admit_conn( afd_loop_t *loop, int delta );
+
+/*
+    report change of bytes of queued output
+    
+    loop    : target event loop
+    delta   : positive on enqueue, negative on dequeue
+*/
+void afd_admit_outq( afd_loop_t *loop, int64_t delta );
+
+/*
+    return 1 if accepting is paused, 0 if not, or -1 if admission control
+    is disabled.
+*/
+int afd_admit_paused( afd_loop_t *loop );
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ *  libasyncfd_frame.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+#ifndef ___ASYNCFD_FRAME___
+#define ___ASYNCFD_FRAME___
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "libasyncfd.h"
+
+// maximum length of delimiter
+#define AFD_FRAME_MAX_DELIM     8
+// maximum number of frames per callback
+#define AFD_FRAME_BATCH         64
+// minimum size of read buffer
+#define AFD_FRAME_BUFSIZE       16384
+
+/*
+    framing configuration
+    
+    prefix      : byte length of length prefix(1, 2, 4 or 8), or 0 to use
+                  delimiter framing
+    le          : 1 if length prefix is little-endian(default big-endian)
+    inclusive   : 1 if length prefix counts the prefix itself
+    dlen        : length of delimiter(1 to AFD_FRAME_MAX_DELIM)
+    delim       : delimiter that terminates each frame
+    maxlen      : maximum length of a frame including prefix or delimiter.
+                  read buffer will be allocated by the larger of maxlen and
+                  AFD_FRAME_BUFSIZE.
+*/
+typedef struct {
+    uint8_t prefix;
+    uint8_t le;
+    uint8_t inclusive;
+    uint8_t dlen;
+    char delim[AFD_FRAME_MAX_DELIM];
+    size_t maxlen;
+} afd_frame_conf_t;
+
+/*
+    message framing data structure
+    
+    frames are parsed in place in the read buffer, and passed to callback
+    without copying. the buffer is reused for next reads; only the bytes
+    of an incomplete frame are moved to the head of buffer when the rest
+    of the frame does not fit in.
+    
+    conf    : framing configuration (internal use)
+    buf     : read buffer (internal use)
+    size    : size of buf (internal use)
+    head    : offset of unparsed data (internal use)
+    tail    : offset of end of received data (internal use)
+    scan    : length of unparsed data that has no delimiter (internal use)
+    cb      : callback-function pointer (internal use)
+    udata   : user data pointer
+*/
+typedef struct _afd_frame_t afd_frame_t;
+/*
+    callback-function prototype of received frames
+    
+    msgs    : payloads of frames(without length prefix or delimiter) that
+              refer to the read buffer. they are valid until the callback
+              returns.
+    nmsg    : number of msgs(up to AFD_FRAME_BATCH)
+    
+    return: 0 to continue, or -1 to stop parsing.
+            NOTE: must return -1 if f was disposed in the callback.
+*/
+typedef int (*afd_frame_cb)( afd_frame_t *f, struct iovec *msgs, int nmsg );
+struct _afd_frame_t {
+    afd_frame_conf_t conf;
+    char *buf;
+    size_t size;
+    size_t head;
+    size_t tail;
+    size_t scan;
+    afd_frame_cb cb;
+    void *udata;
+};
+
+/*
+    initialize afd_frame_t
+    
+    f       : empty frame data structure(mean not NULL)
+    conf    : framing configuration(will be copied)
+    cb      : callback function on received frames
+    udata   : to set a udata of f(afd_frame_t)
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_frame_init( afd_frame_t *f, const afd_frame_conf_t *conf,
+                    afd_frame_cb cb, void *udata );
+
+/*
+    deallocate read buffer of afd_frame_t
+*/
+void afd_frame_dispose( afd_frame_t *f );
+
+/*
+    read data from descriptor by a read(2) call, and pass all complete
+    frames to callback in batches. frames that cross reads are reassembled
+    in the read buffer.
+    call it from the callback of read watch(repeatedly until EAGAIN with
+    edge trigger).
+    
+    f       : initialized afd_frame_t
+    fd      : descriptor
+    
+    return: number of bytes read, 0 on end of stream, or -1 on failure.
+            (check errno)
+                EMSGSIZE    : frame is longer than maxlen
+                EBADMSG     : length prefix is less than its own length
+                ECANCELED   : callback stopped parsing
+*/
+ssize_t afd_frame_read( afd_frame_t *f, int fd );
+
+/*
+    pass complete frames that remain in read buffer to callback.
+    (e.g. after callback stopped parsing)
+    
+    f       : initialized afd_frame_t
+    
+    return: 0 on success, or -1 on failure.(same errno as afd_frame_read)
+*/
+int afd_frame_parse( afd_frame_t *f );
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ *  libasyncfd_http.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+#ifndef ___ASYNCFD_HTTP___
+#define ___ASYNCFD_HTTP___
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "libasyncfd.h"
+
+// maximum number of headers per request
+#define AFD_HTTP_MAX_HEADERS    64
+// maximum number of buffers per response batch
+#define AFD_HTTP_MAX_IOV        64
+
+// return value of afd_http_parse_req if request is incomplete
+#define AFD_HTTP_EAGAIN         -2
+
+/*
+    http header data structure
+    
+    name    : pointer to header name in the read buffer
+    nlen    : length of name
+    val     : pointer to header value in the read buffer
+    vlen    : length of val
+*/
+typedef struct {
+    const char *name;
+    size_t nlen;
+    const char *val;
+    size_t vlen;
+} afd_http_hdr_t;
+
+/*
+    http request data structure
+    
+    NOTE: all pointers refer to the read buffer that passed to
+          afd_http_parse_req, the buffer must not be modified while using
+          this structure.
+    
+    method      : pointer to request method
+    mlen        : length of method
+    uri         : pointer to request uri
+    ulen        : length of uri
+    minor       : minor version of HTTP/1.x
+    keepalive   : 1 if connection is persistent
+    body        : pointer to request body(NULL if no body)
+    clen        : length of body(value of content-length)
+    nhdr        : number of headers
+    hdr         : headers
+    prev        : length of the buffer that checked last time (internal use)
+    hlen        : length of headers if parsed already (internal use)
+*/
+typedef struct {
+    const char *method;
+    size_t mlen;
+    const char *uri;
+    size_t ulen;
+    int minor;
+    int keepalive;
+    const char *body;
+    size_t clen;
+    int nhdr;
+    afd_http_hdr_t hdr[AFD_HTTP_MAX_HEADERS];
+    size_t prev;
+    size_t hlen;
+} afd_http_req_t;
+
+/*
+    initialize afd_http_req_t for new read buffer.
+    
+    req : empty request data structure(mean not NULL)
+*/
+void afd_http_req_init( afd_http_req_t *req );
+
+/*
+    parse http/1.x request from the read buffer without copying.
+    
+    the parser is incremental; if request is incomplete, append received
+    data to the same buffer and call again with the same req. it will not
+    re-parse the buffer until the end of headers has arrived, and headers
+    will not be re-parsed while waiting for the body.
+    pipelined requests can be parsed by calling repeatedly with the buffer
+    that advanced by the returned length.
+    
+    NOTE: chunked request body is not supported.
+    
+    req : initialized afd_http_req_t
+    buf : read buffer
+    len : length of buf
+    
+    return: length of the request(headers and body) on success,
+            AFD_HTTP_EAGAIN if request is incomplete,
+            or -1 on failure.(check errno)
+                EINVAL      : malformed request
+                ENOBUFS     : too many headers
+                ENOTSUP     : unsupported transfer-encoding
+*/
+ssize_t afd_http_parse_req( afd_http_req_t *req, const char *buf, size_t len );
+
+/*
+    find header of request by name.(case insensitive)
+    
+    return: pointer to afd_http_hdr_t, or NULL if not found.
+*/
+const afd_http_hdr_t *afd_http_req_header( afd_http_req_t *req,
+                                           const char *name, size_t len );
+
+
+/*
+    http response batch data structure
+    
+    response buffers will be written by a writev(2) call at once.
+    
+    NOTE: queued buffers will not be copied, they must be valid until
+          flushed.
+    
+    niov    : number of queued buffers (internal use)
+    cur     : index of the first unwritten buffer (internal use)
+    len     : total length of unwritten data
+    iov     : queued buffers (internal use)
+*/
+typedef struct {
+    int niov;
+    int cur;
+    size_t len;
+    struct iovec iov[AFD_HTTP_MAX_IOV];
+} afd_http_res_t;
+
+/*
+    initialize afd_http_res_t
+    
+    res : empty response data structure(mean not NULL)
+*/
+void afd_http_res_init( afd_http_res_t *res );
+
+/*
+    queue response buffer
+    
+    res : initialized afd_http_res_t
+    buf : response buffer
+    len : length of buf
+    
+    return: 0 on success, or -1 on failure.(check errno)
+                ENOBUFS : batch is full, flush it before queueing
+*/
+int afd_http_res_add( afd_http_res_t *res, const void *buf, size_t len );
+
+/*
+    write queued buffers to fd by writev(2).
+    if written partially, unwritten data remains in res.
+    
+    res : initialized afd_http_res_t
+    fd  : descriptor
+    
+    return: number of bytes written, or -1 on failure.(check errno)
+*/
+ssize_t afd_http_res_flush( afd_http_res_t *res, int fd );
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ *  libasyncfd_log.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+#ifndef ___ASYNCFD_LOG___
+#define ___ASYNCFD_LOG___
+
+#include <stdint.h>
+#include <stddef.h>
+#include "libasyncfd_config.h"
+
+/*
+    log levels
+*/
+#define AFD_LOG_ERR     0
+#define AFD_LOG_WARN    1
+#define AFD_LOG_INFO    2
+#define AFD_LOG_DEBUG   3
+
+/*
+    compile time log level.
+    the log calls of greater level than AFD_LOG_LEVEL will be removed.
+    (configure --with-log-level=N)
+*/
+#ifndef AFD_LOG_LEVEL
+#define AFD_LOG_LEVEL   AFD_LOG_DEBUG
+#endif
+
+// maximum number of arguments of a log record
+#define AFD_LOG_MAXARGS 6
+
+/*
+    open asynchronous logger.
+
+    each thread that writes log has own lock-free ring buffer, and the
+    flusher thread formats the records and writes them to fd in batches.
+    when a ring is full, the record will be dropped and counted; logging
+    never blocks the caller.
+    if logger is not opened, log will be written to stdout synchronously.
+    
+    NOTE: logger is closed in the child process of fork(2), because the
+          flusher thread does not exist in it. call afd_log_open again in
+          the child process to use logger. workers of afd_prefork_t
+          reopen it with the same configuration automatically.
+
+    fd          : output descriptor
+    level       : runtime log level(AFD_LOG_ERR - AFD_LOG_DEBUG)
+    nrec        : number of records of each ring(rounded up to power of 2)
+    interval    : flush interval in milliseconds
+
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_log_open( int fd, int level, size_t nrec, int interval );
+
+/*
+    stop flusher thread after writing all records, and close logger.
+    it waits for the threads that are writing a record to the ring, so the 
+    records logged before it returns are written or go to stdout.
+*/
+void afd_log_close( void );
+
+/*
+    change runtime log level
+*/
+void afd_log_level( int level );
+
+/*
+    return total number of dropped records
+*/
+uint64_t afd_log_dropped( void );
+
+
+/*
+    log macros
+
+    NOTE: formatting will be deferred to the flusher thread. arguments must
+          be integer or pointer, and a string argument must be a string
+          literal that will be valid until flushed.
+
+    afd_log_err(fmt,...)        : error level
+    afd_log_warn(fmt,...)       : warning level
+    afd_log_info(fmt,...)       : info level
+    afd_log_debug(fmt,...)      : debug level
+    afd_log_errno(fn,fmt,...)   : error level with function name and errno
+*/
+#define afd_log_err(fmt,...) \
+    afd_log( AFD_LOG_ERR, NULL, 0, fmt, ##__VA_ARGS__ )
+#define afd_log_warn(fmt,...) \
+    afd_log( AFD_LOG_WARN, NULL, 0, fmt, ##__VA_ARGS__ )
+#define afd_log_info(fmt,...) \
+    afd_log( AFD_LOG_INFO, NULL, 0, fmt, ##__VA_ARGS__ )
+#define afd_log_debug(fmt,...) \
+    afd_log( AFD_LOG_DEBUG, NULL, 0, fmt, ##__VA_ARGS__ )
+#define afd_log_errno(fn,fmt,...) \
+    afd_log( AFD_LOG_ERR, fn, 1, fmt, ##__VA_ARGS__ )
+
+/*
+    afd_log(lv,fn,witherr,fmt,...)
+
+    lv      : log level
+    fn      : function name string literal or NULL
+    witherr : 1 to append strerror(errno)
+*/
+#define afd_log(lv,fn,witherr,fmt,...) do { \
+    if( (lv) <= AFD_LOG_LEVEL && (lv) <= _afd_log_curlv ){ \
+        _afd_log_emit( lv, fn, witherr, fmt, \
+                       _afd_log_nargs(__VA_ARGS__) \
+                       _afd_log_args(__VA_ARGS__) ); \
+    } \
+} while(0)
+
+// internal use
+extern int _afd_log_curlv;
+void _afd_log_emit( int lv, const char *fn, int witherr, const char *fmt,
+                    int nargs, ... );
+
+#define _afd_log_nargs(...) \
+    _afd_log_nargs_( 0, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0 )
+#define _afd_log_nargs_(_0,_1,_2,_3,_4,_5,_6,n,...)   n
+
+#define _afd_log_cast(a)            ((int64_t)(intptr_t)(a))
+#define _afd_log_args0()
+#define _afd_log_args1(a)           , _afd_log_cast(a)
+#define _afd_log_args2(a,...)       , _afd_log_cast(a) _afd_log_args1(__VA_ARGS__)
+#define _afd_log_args3(a,...)       , _afd_log_cast(a) _afd_log_args2(__VA_ARGS__)
+#define _afd_log_args4(a,...)       , _afd_log_cast(a) _afd_log_args3(__VA_ARGS__)
+#define _afd_log_args5(a,...)       , _afd_log_cast(a) _afd_log_args4(__VA_ARGS__)
+#define _afd_log_args6(a,...)       , _afd_log_cast(a) _afd_log_args5(__VA_ARGS__)
+#define _afd_log_argsn_(n,...)      _afd_log_args##n(__VA_ARGS__)
+#define _afd_log_argsn(n,...)       _afd_log_argsn_(n,##__VA_ARGS__)
+#define _afd_log_args(...) \
+    _afd_log_argsn( _afd_log_nargs(__VA_ARGS__), ##__VA_ARGS__ )
+
+#endif
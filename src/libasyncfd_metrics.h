@@ -0,0 +1,203 @@
+/*
+ *  libasyncfd_metrics.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+#ifndef ___ASYNCFD_METRICS___
+#define ___ASYNCFD_METRICS___
+
+#include <sys/types.h>
+#include "libasyncfd.h"
+
+// number of histogram buckets
+#define AFD_HIST_NBUCKET    32
+
+/*
+    log2 histogram of nanoseconds
+    
+    bucket i counts the values in range of [2^i, 2^(i+1)) nanoseconds,
+    and the last bucket counts the values greater than or equal to
+    2^(AFD_HIST_NBUCKET-1) nanoseconds.
+*/
+typedef struct {
+    uint64_t count[AFD_HIST_NBUCKET];
+} afd_hist_t;
+
+/*
+    add value to histogram
+    
+    h   : target histogram
+    ns  : nanoseconds
+*/
+#define afd_hist_add(h,ns) do { \
+    uint64_t _ns = (ns); \
+    int _i = _ns ? 63 - __builtin_clzll( _ns ) : 0; \
+    (h)->count[_i < AFD_HIST_NBUCKET ? _i : AFD_HIST_NBUCKET - 1]++; \
+} while(0)
+
+/*
+    calculate percentile of histogram
+    
+    h   : target histogram
+    p   : percentile(0 < p <= 100)
+    
+    return: upper bound nanoseconds of the bucket that contains percentile,
+            or 0 if histogram is empty.
+*/
+uint64_t afd_hist_percentile( const afd_hist_t *h, double p );
+
+
+/*
+    metrics of event loop
+    
+    each slot is written by an event loop without lock, and aligned to
+    cache line to avoid false sharing between workers.
+    
+    pid     : process id of the worker that attached to slot
+    nreg    : number of registered watches
+    niter   : number of iterations(wait calls)
+    nevt    : number of dispatched events
+    busy    : nanoseconds spent in dispatch and check hooks
+    idle    : nanoseconds spent in waiting for events
+    cblat   : histogram of callback durations
+    iterlat : histogram of busy time of each iteration
+    rxlat   : histogram of delays from receiving packets by kernel to 
+              dispatching the callbacks that read them(see afd_loop_rxstamp)
+*/
+typedef struct {
+    pid_t pid;
+    int32_t nreg;
+    uint64_t niter;
+    uint64_t nevt;
+    uint64_t busy;
+    uint64_t idle;
+    afd_hist_t cblat;
+    afd_hist_t iterlat;
+    afd_hist_t rxlat;
+} __attribute__((aligned(64))) afd_metrics_slot_t;
+
+/*
+    shared metrics data structure(opaque)
+*/
+typedef struct _afd_metrics_t afd_metrics_t;
+
+/*
+    create and return shared metrics segment.
+    create it before fork workers, and then each worker attaches own slot.
+    
+    path    : path of the file to map(e.g. /dev/shm/myapp.metrics) that can
+              be read by other processes, or NULL to anonymous memory that
+              can be read by forked processes only.
+    nslot   : number of slots(number of workers)
+    
+    return: new afd_metrics_t on success, or NULL on failure.(check errno)
+*/
+afd_metrics_t *afd_metrics_create( const char *path, int nslot );
+
+/*
+    open existing shared metrics segment for reading.
+    
+    path    : path of the file that created by afd_metrics_create
+    
+    return: new afd_metrics_t on success, or NULL on failure.(check errno)
+*/
+afd_metrics_t *afd_metrics_open( const char *path );
+
+/*
+    unmap and deallocate afd_metrics_t.(file will not be removed)
+*/
+void afd_metrics_dealloc( afd_metrics_t *m );
+
+/*
+    attach slot of metrics to event loop.
+    event loop writes its metrics to the slot at each iteration.
+    
+    loop    : target event loop
+    m       : afd_metrics_t that created by afd_metrics_create, or NULL to
+              detach.
+    slot    : slot index
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_loop_metrics( afd_loop_t *loop, afd_metrics_t *m, int slot );
+
+/*
+    return number of slots
+*/
+int afd_metrics_nslot( afd_metrics_t *m );
+
+/*
+    copy snapshot of slot
+    
+    m       : afd_metrics_t
+    slot    : slot index
+    snap    : snapshot
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_metrics_read( afd_metrics_t *m, int slot, afd_metrics_slot_t *snap );
+
+/*
+    aggregate all slots
+    
+    m       : afd_metrics_t
+    sum     : sum of all slots(pid will be set to 0)
+*/
+void afd_metrics_sum( afd_metrics_t *m, afd_metrics_slot_t *sum );
+
+
+/*
+    RX timestamp flags
+*/
+// software timestamp when kernel received packet
+#define AFD_RXSTAMP_SOFTWARE    1
+// hardware timestamp of NIC.
+// NOTE: not supported, because NIC clock is not synchronized to system 
+//       clock. ENOTSUP will be set.
+#define AFD_RXSTAMP_HARDWARE    2
+
+/*
+    enable RX timestamps on the sockets that will be registered to event 
+    loop by afd_watch with AS_EV_READ.
+    the data read by afd_rxstamp_recv records its delay from kernel to the 
+    dispatch of callback into rxlat histogram of metrics slot, so the delay 
+    of dispatch can be distinguished from the duration of callback(cblat).
+    
+    loop    : target event loop
+    flags   : AFD_RXSTAMP_SOFTWARE, or 0 to disable
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_loop_rxstamp( afd_loop_t *loop, int flags );
+
+/*
+    enable RX timestamps on socket
+    
+    fd      : socket descriptor
+    flags   : AFD_RXSTAMP_SOFTWARE
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_rxstamp_enable( int fd, int flags );
+
+/*
+    receive data by recvmsg(2), and add the delay from RX timestamp of 
+    received data to the dispatch of current callback into rxlat histogram 
+    of metrics slot that attached to loop.
+    
+    loop    : event loop that dispatched the callback
+    fd      : socket descriptor
+    buf     : buffer
+    len     : size of buf
+    flags   : flags of recvmsg(2)
+    
+    return: number of bytes received, 0 on end of stream, or -1 on failure.
+            (check errno)
+*/
+ssize_t afd_rxstamp_recv( afd_loop_t *loop, int fd, void *buf, size_t len, 
+                          int flags );
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ *  libasyncfd_outq.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+#ifndef ___ASYNCFD_OUTQ___
+#define ___ASYNCFD_OUTQ___
+
+#include <sys/types.h>
+#include "libasyncfd.h"
+
+// maximum number of buffers per writev(2)
+#define AFD_OUTQ_MAX_IOV    64
+
+/*
+    reference counted buffer data structure
+    
+    a buffer can be queued to many output queues without copying, and it
+    will be deallocated when the last reference is released.
+    
+    NOTE: data must not be modified after queued.
+    
+    ref     : reference count (internal use)
+    len     : length of data
+    data    : data
+*/
+typedef struct {
+    volatile uint32_t ref;
+    size_t len;
+    char data[];
+} afd_buf_t;
+
+/*
+    allocate buffer with reference count 1
+    
+    data    : data to copy, or NULL to fill buf->data after allocated
+    len     : length of data
+    
+    return: new afd_buf_t on success, or NULL on failure.(check errno)
+*/
+afd_buf_t *afd_buf_alloc( const void *data, size_t len );
+
+/*
+    increment reference count of buffer
+*/
+void afd_buf_retain( afd_buf_t *buf );
+
+/*
+    decrement reference count of buffer, and deallocate it if count
+    reaches 0.
+*/
+void afd_buf_release( afd_buf_t *buf );
+
+
+/*
+    output queue data structure
+    
+    queued buffers are written by writev(2)(sendmsg(2) with MSG_NOSIGNAL 
+    for socket) from the head, and the written length of the first buffer 
+    is tracked for partial writes.
+    the write watch will be registered as edge-triggered at the first time 
+    unwritten data remains, and stays registered until afd_outq_dispose.
+    its callback should call afd_outq_flush.(the callback also receives
+    errors of descriptor by hup argument)
+    bytes of queued data are reported to admission control by
+    afd_admit_outq.
+    
+    w       : write watch (internal use)
+    bufs    : ring of queued buffers (internal use)
+    head    : index of the first buffer (internal use)
+    nbuf    : number of queued buffers (internal use)
+    maxbuf  : size of bufs (internal use)
+    off     : written length of the first buffer (internal use)
+    len     : length of unwritten data
+    watching: 1 if w is registered (internal use)
+*/
+typedef struct {
+    afd_watch_t *w;
+    afd_buf_t **bufs;
+    int head;
+    int nbuf;
+    int maxbuf;
+    size_t off;
+    size_t len;
+    int watching;
+} afd_outq_t;
+
+/*
+    initialize afd_outq_t
+    
+    q   : empty output queue data structure(mean not NULL)
+    w   : initialized watch with AS_EV_WRITE that is not registered.
+          queued data will be written to its descriptor, and it will be 
+          changed to edge-triggered.
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_outq_init( afd_outq_t *q, afd_watch_t *w );
+
+/*
+    release queued buffers, and deregister write watch if registered
+    (descriptor will not be closed)
+    
+    loop    : event loop of write watch
+    q       : initialized afd_outq_t
+*/
+void afd_outq_dispose( afd_loop_t *loop, afd_outq_t *q );
+
+/*
+    queue buffer without writing.(reference of buf will be retained)
+    
+    loop    : event loop of write watch
+    q       : initialized afd_outq_t
+    buf     : buffer
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_outq_push( afd_loop_t *loop, afd_outq_t *q, afd_buf_t *buf );
+
+/*
+    write queued buffers by writev(2) until all data is written or 
+    descriptor is not writable, and release written buffers.
+    write watch will be registered if unwritten data remains.
+    
+    loop    : event loop of write watch
+    q       : initialized afd_outq_t
+    
+    return: number of bytes written, or -1 on failure.(check errno)
+            EAGAIN will be set if descriptor is not writable.
+            -1 is returned if write watch could not be registered, even if 
+            some data has been written.
+*/
+ssize_t afd_outq_flush( afd_loop_t *loop, afd_outq_t *q );
+
+/*
+    queue a buffer to many output queues without copying, and write it
+    immediately to the queues that had no unwritten data.
+    buf will be deallocated after written to all queues if the caller
+    releases its reference.
+    
+    NOTE: write errors are not returned. write watch of the queue will be
+          registered, and its callback receives the error.
+    
+    loop    : event loop of write watches
+    qs      : output queues
+    n       : number of qs
+    buf     : buffer
+    
+    return: number of queues that buf has been queued to and will be 
+            written. it will be less than n on failure.(check errno)
+*/
+int afd_broadcast( afd_loop_t *loop, afd_outq_t **qs, int n, afd_buf_t *buf );
+
+#endif
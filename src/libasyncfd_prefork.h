@@ -0,0 +1,132 @@
+/*
+ *  libasyncfd_prefork.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+#ifndef ___ASYNCFD_PREFORK___
+#define ___ASYNCFD_PREFORK___
+
+#include <sys/types.h>
+#include "libasyncfd.h"
+
+// pin each worker to cpu(worker id-th of cpus allowed to master, wrapped
+// around by number of them)
+#define AFD_PREFORK_PIN         1
+
+// environment variable that holds inherited listening descriptors
+#define AFD_PREFORK_ENV         "AFD_PREFORK_FDS"
+
+// seconds to wait for new workers to be ready before draining old workers
+#define AFD_PREFORK_READY_SEC   10
+
+/*
+    worker process data structure
+    
+    id      : worker index(0 to nworker - 1)
+    cpu     : pinned cpu number, or -1 if not pinned
+    drainfd : descriptor that becomes readable when the worker should stop
+              accepting and exit after finishing current connections.
+              register it to event loop by afd_watch with AS_EV_READ.
+    socks   : listening sockets
+    nsock   : number of socks
+    udata   : user data pointer that passed to afd_prefork_alloc
+    readyfd : descriptor to notify readiness (internal use)
+*/
+typedef struct {
+    int id;
+    int cpu;
+    int drainfd;
+    afd_sock_t **socks;
+    int nsock;
+    void *udata;
+    int readyfd;
+} afd_worker_t;
+
+/*
+    worker callback-function prototype.
+    it will be called in forked worker process, and its return value will
+    be passed to exit(3).
+*/
+typedef int (*afd_worker_cb)( afd_worker_t *w );
+
+/*
+    prefork supervisor data structure(opaque)
+    
+    supervisor forks workers that share listening sockets, and restarts
+    crashed workers. it is controlled by signals to master process;
+    
+        SIGTERM, SIGINT : stop workers immediately
+        SIGQUIT         : stop workers gracefully(drain)
+        SIGHUP          : start new workers, then drain old workers after
+                          new workers are ready
+        SIGUSR2         : execute new binary that inherits listening
+                          sockets. new master drains old master after its
+                          workers are ready.
+    
+    listening sockets are shared by old and new workers, so connections in
+    accept queue are not dropped while reloading.
+*/
+typedef struct _afd_prefork_t afd_prefork_t;
+
+/*
+    create and return afd_prefork_t
+    
+    socks   : listening sockets(must be listened)
+    nsock   : number of socks
+    nworker : number of worker processes
+    flags   : AFD_PREFORK_PIN or 0
+    cb      : worker function
+    udata   : to set a udata of afd_worker_t
+    
+    NOTE: AFD_PREFORK_ENV is removed from environment to be not inherited 
+          by workers and next upgrade, so call afd_prefork_inherit before 
+          this function.
+    
+    return: new afd_prefork_t on success, or NULL on failure.(check errno)
+*/
+afd_prefork_t *afd_prefork_alloc( afd_sock_t **socks, int nsock, int nworker,
+                                  int flags, afd_worker_cb cb, void *udata );
+/*
+    deallocate afd_prefork_t
+    NOTE: listening sockets will not be deallocated.
+*/
+void afd_prefork_dealloc( afd_prefork_t *pf );
+
+/*
+    fork workers and supervise them until stopped by signal.
+    
+    pf      : afd_prefork_t
+    argv    : command line for binary upgrade by SIGUSR2(argv[0] must be
+              a path of executable), or NULL to disable.
+    
+    return: 0 on stopped by signal, or -1 on failure.(check errno)
+*/
+int afd_prefork_run( afd_prefork_t *pf, char *const argv[] );
+
+/*
+    notify master that worker is ready to accept.
+    call it in worker callback before running event loop. the worker is
+    regarded as ready after AFD_PREFORK_READY_SEC seconds if not called.
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_worker_ready( afd_worker_t *w );
+
+/*
+    restore listening sockets that are passed from old master by binary
+    upgrade.(see AFD_PREFORK_ENV)
+    NOTE: it must be called before afd_prefork_alloc that removes 
+          AFD_PREFORK_ENV.
+    
+    socks   : array to store allocated afd_sock_t
+    nsock   : size of socks
+    
+    return: number of inherited sockets(0 if not upgraded), or -1 on
+            failure.(check errno)
+*/
+int afd_prefork_inherit( afd_sock_t **socks, int nsock );
+
+#endif
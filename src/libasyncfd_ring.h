@@ -0,0 +1,108 @@
+/*
+ *  libasyncfd_ring.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+#ifndef ___ASYNCFD_RING___
+#define ___ASYNCFD_RING___
+
+#include <sys/types.h>
+#include "libasyncfd.h"
+
+/*
+    mirrored ring buffer data structure
+    
+    the same memory is mapped twice back-to-back, so buffered data and free
+    space are always contiguous even if they wrap around the end of buffer.
+    read(2) can fill the free space by a call, and parsers can see the 
+    messages that wrap around without copying.
+    
+    buf     : mapped memory of 2 * size bytes (internal use)
+    size    : size of buffer(multiple of page size)
+    head    : offset of buffered data (internal use)
+    len     : length of buffered data
+*/
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t head;
+    size_t len;
+} afd_ring_t;
+
+/*
+    initialize afd_ring_t
+    
+    r       : empty ring buffer data structure(mean not NULL)
+    size    : size of buffer(will be rounded up to page size)
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_ring_init( afd_ring_t *r, size_t size );
+
+/*
+    unmap memory of afd_ring_t
+*/
+void afd_ring_dispose( afd_ring_t *r );
+
+/*
+    return pointer to buffered data(afd_ring_len bytes are contiguous)
+*/
+#define afd_ring_data(r)    ((r)->buf + (r)->head)
+/*
+    return length of buffered data
+*/
+#define afd_ring_len(r)     ((r)->len)
+/*
+    return pointer to free space(afd_ring_space bytes are contiguous)
+*/
+#define afd_ring_tail(r)    ((r)->buf + (r)->head + (r)->len)
+/*
+    return length of free space
+*/
+#define afd_ring_space(r)   ((r)->size - (r)->len)
+
+/*
+    append data that written to free space(e.g. by recv(2))
+    
+    r       : initialized afd_ring_t
+    len     : length of written data(up to afd_ring_space)
+*/
+void afd_ring_produce( afd_ring_t *r, size_t len );
+
+/*
+    remove data from the head of buffered data
+    
+    r       : initialized afd_ring_t
+    len     : length of consumed data(up to afd_ring_len)
+*/
+void afd_ring_consume( afd_ring_t *r, size_t len );
+
+/*
+    read data from descriptor to free space by a read(2) call.
+    call it from the callback of read watch.
+    
+    r       : initialized afd_ring_t
+    fd      : descriptor
+    
+    return: number of bytes read, 0 on end of stream, or -1 on failure.
+            (check errno)
+                ENOBUFS : buffer is full
+*/
+ssize_t afd_ring_read( afd_ring_t *r, int fd );
+
+/*
+    write buffered data to descriptor by a write(2) call, and consume 
+    written data.
+    call it from the callback of write watch.
+    
+    r       : initialized afd_ring_t
+    fd      : descriptor
+    
+    return: number of bytes written, or -1 on failure.(check errno)
+*/
+ssize_t afd_ring_write( afd_ring_t *r, int fd );
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ *  libasyncfd_trace.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+#ifndef ___ASYNCFD_TRACE___
+#define ___ASYNCFD_TRACE___
+
+#include "libasyncfd.h"
+#include "libasyncfd_metrics.h"
+
+/*
+    trace record types
+*/
+// wait returned with events
+#define AFD_TRACE_WAIT      1
+// event dispatched
+#define AFD_TRACE_EVENT     2
+// watch unregistered by afd_unwatch
+#define AFD_TRACE_UNWATCH   3
+
+/*
+    received event bits of trace record
+*/
+// readable(or timer expired)
+#define AFD_TRACE_EV_IN     1
+// writable
+#define AFD_TRACE_EV_OUT    2
+// hangup of peer
+#define AFD_TRACE_EV_HUP    4
+// error
+#define AFD_TRACE_EV_ERR    8
+
+/*
+    trace record(16 bytes)
+    
+    type    : AFD_TRACE_WAIT, AFD_TRACE_EVENT or AFD_TRACE_UNWATCH
+    flg     : event flag of watch(AFD_TRACE_EVENT)
+    hup     : 1 if hangup or error occurred(AFD_TRACE_EVENT)
+    evt     : received event bits AFD_TRACE_EV_*(AFD_TRACE_EVENT)
+    val     : number of received events(AFD_TRACE_WAIT), or descriptor
+    ns      : nanoseconds from start of recording(AFD_TRACE_WAIT and
+              AFD_TRACE_UNWATCH), or duration of callback(AFD_TRACE_EVENT)
+*/
+typedef struct {
+    uint8_t type;
+    uint8_t flg;
+    uint8_t hup;
+    uint8_t evt;
+    int32_t val;
+    uint64_t ns;
+} afd_trace_rec_t;
+
+/*
+    start recording trace of event loop.
+    
+    records are buffered in memory and written to fd at the beginning of
+    iteration if buffer exceeds a threshold.
+    
+    loop    : target event loop
+    fd      : output descriptor
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_trace_open( afd_loop_t *loop, int fd );
+
+/*
+    write buffered records and stop recording.
+    NOTE: output descriptor will not be closed.
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_trace_close( afd_loop_t *loop );
+
+
+/*
+    map callback of replay
+    
+    called when a descriptor of trace appears first time(or first time after
+    unwatched). replay driver creates a socketpair for each recorded read or
+    write watch, and passes one end of it.
+    the callback should return the watch that initialized with fd and user
+    callback(or the timer that initialized with user callback), or NULL to 
+    ignore the events of rfd. replay driver registers the returned watch to 
+    loop, so it must not be registered yet.
+    
+    loop    : event loop of replay
+    rfd     : recorded descriptor
+    flg     : recorded event flag
+    fd      : descriptor of socketpair(-1 if flg is AS_EV_TIMER)
+    udata   : user data of afd_trace_replay
+    
+    return: afd_watch_t or NULL
+*/
+typedef afd_watch_t *(*afd_trace_map_cb)( afd_loop_t *loop, int rfd,
+                                          uint8_t flg, int fd, void *udata );
+
+/*
+    feed callback of replay
+    
+    called before the iteration that will dispatch read event to write input 
+    data to peer.
+    if NULL, replay driver writes 1 byte to peer.
+    
+    w       : watch that returned by afd_trace_map_cb
+    peer    : the other end of socketpair
+    udata   : user data of afd_trace_replay
+*/
+typedef void (*afd_trace_feed_cb)( afd_watch_t *w, int peer, void *udata );
+
+/*
+    replay flags
+*/
+// reproduce the intervals of recorded waits
+#define AFD_TRACE_PACED     1
+
+/*
+    replay statistics
+    
+    nwait   : number of replayed waits
+    nevt    : number of dispatched events
+    nmiss   : number of recorded events that were not dispatched
+    nextra  : number of dispatched events that were not recorded
+    elapsed : nanoseconds of replay
+    cblat   : histogram of callback durations of replay
+    rcblat  : histogram of recorded callback durations
+*/
+typedef struct {
+    uint64_t nwait;
+    uint64_t nevt;
+    uint64_t nmiss;
+    uint64_t nextra;
+    uint64_t elapsed;
+    afd_hist_t cblat;
+    afd_hist_t rcblat;
+} afd_trace_stat_t;
+
+/*
+    replay recorded trace
+    
+    reproduce recorded events of each wait for the watches that returned by 
+    map callback, and dispatch them by an iteration of loop.
+    the descriptors are connected to socketpairs instead of real network.
+    before the iteration, input is written to the peer of read event, output 
+    of the watch is discarded from the peer, and the peer will be shut down 
+    on hangup(or both directions on error) event. timers are disarmed and 
+    expire only at the recorded events.
+    dispatched events are matched against the recorded events by descriptor 
+    and event flag. if some recorded events are not dispatched, the loop 
+    iterates a few more times before counting them as missed.
+    a peer will be closed at unwatch record.
+    
+    loop    : event loop that dispatches events(must not be running or shared)
+    fd      : input descriptor of trace
+    flags   : 0 or AFD_TRACE_PACED
+    map     : map callback
+    feed    : feed callback or NULL
+    udata   : user data of callbacks
+    stat    : replay statistics or NULL
+    
+    return: 0 on success, or -1 on failure.(check errno)
+            EINVAL will be set if trace is invalid or truncated.(records
+            before the truncated record have been replayed)
+*/
+int afd_trace_replay( afd_loop_t *loop, int fd, int flags,
+                      afd_trace_map_cb map, afd_trace_feed_cb feed,
+                      void *udata, afd_trace_stat_t *stat );
+
+#endif
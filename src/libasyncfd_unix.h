@@ -0,0 +1,91 @@
+/*
+ *  libasyncfd_unix.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+#ifndef ___ASYNCFD_UNIX___
+#define ___ASYNCFD_UNIX___
+
+#include <sys/types.h>
+#include "libasyncfd.h"
+
+// maximum number of descriptors of a message
+#define AFD_UNIX_MAXFDS     16
+// number of messages per system call
+#define AFD_UNIX_BATCH      64
+
+/*
+    message of unix domain socket
+    
+    buf     : data buffer
+    len     : length of data(send), or size of buf(recv) that will be
+              replaced with length of received data
+    fds     : descriptors to pass(send), or array to store received
+              descriptors(recv)
+    nfds    : number of descriptors(send), or size of fds(recv) that will
+              be replaced with number of received descriptors.
+              (up to AFD_UNIX_MAXFDS)
+    flags   : received message flags(MSG_TRUNC, MSG_CTRUNC)
+    pid     : process id of sender(recv), or -1 if credentials not received
+    uid     : user id of sender(recv)
+    gid     : group id of sender(recv)
+*/
+typedef struct {
+    void *buf;
+    size_t len;
+    int *fds;
+    int nfds;
+    int flags;
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+} afd_unix_msg_t;
+
+/*
+    send messages with descriptors(SCM_RIGHTS).
+    sends AFD_UNIX_BATCH messages at most per system call by sendmmsg if
+    available.
+    
+    fd      : unix domain socket(AS_TYPE_SEQPACKET or AS_TYPE_DGRAM to keep
+              message boundaries)
+    msgs    : messages
+    nmsg    : number of messages
+    
+    return: number of sent messages, or -1 on failure.(check errno)
+            EAGAIN will be set if no message could be sent to non-blocking
+            socket.
+*/
+int afd_unix_sendmsg( int fd, afd_unix_msg_t *msgs, int nmsg );
+
+/*
+    receive messages with descriptors and credentials.
+    received descriptors are set non-block and cloexec flags like
+    afd_accept, so they can be passed to afd_watch_init directly.
+    returns without waiting after at least one message received.
+    
+    fd      : unix domain socket
+    msgs    : message buffers
+    nmsg    : number of message buffers
+    
+    return: number of received messages, 0 on end of stream, or -1 on
+            failure.(check errno)
+            NOTE: zero-length message is end of stream only on 
+                  AS_TYPE_STREAM socket. it is returned as an empty message
+                  on other sockets.(peer close of AS_TYPE_SEQPACKET is 
+                  notified by hup of watch)
+*/
+int afd_unix_recvmsg( int fd, afd_unix_msg_t *msgs, int nmsg );
+
+/*
+    enable or disable receiving credentials of sender.(SO_PASSCRED)
+    the kernel attaches credentials to the messages that will be received
+    after enabled.
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_unix_passcred( int fd, int enable );
+
+#endif
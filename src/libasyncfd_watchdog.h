@@ -0,0 +1,72 @@
+/*
+ *  libasyncfd_watchdog.h
+ *  libasyncfd
+ *
+ *  Created by Masatoshi Teruya on 13/02/19.
+ *  Copyright 2013 Masatoshi Teruya. All rights reserved.
+ *
+ */
+#ifndef ___ASYNCFD_WATCHDOG___
+#define ___ASYNCFD_WATCHDOG___
+
+#include "libasyncfd.h"
+
+/*
+    report slow callbacks of event loop.
+    
+    the callback that takes longer than threshold will be reported with its
+    fd, event flag, udata and duration to the logger(see libasyncfd_log.h)
+    at warning level.
+    
+    loop    : target event loop
+    nsec    : threshold in nanoseconds, or 0 to disable
+*/
+void afd_loop_slowcb( afd_loop_t *loop, uint64_t nsec );
+
+
+/*
+    stall detector(opaque)
+*/
+typedef struct _afd_watchdog_t afd_watchdog_t;
+
+/*
+    create stall detector and start monitor thread.
+    
+    the monitor thread reports the loops that have not returned to wait for
+    events within msec milliseconds.
+    if sig is specified, the monitor sends sig to the stuck thread to write
+    its backtrace to fd. (once for each stall)
+    NOTE: the signal may interrupt a blocking system call of the stuck
+          thread with EINTR.
+    
+    msec    : stall threshold in milliseconds
+    sig     : signal number for backtrace capture(e.g. SIGRTMIN+1), or 0 to
+              disable. signal handler of sig will be replaced.
+    fd      : output descriptor of backtrace
+    
+    return: new afd_watchdog_t on success, or NULL on failure.(check errno)
+*/
+afd_watchdog_t *afd_watchdog_alloc( int msec, int sig, int fd );
+
+/*
+    stop monitor thread and deallocate afd_watchdog_t.
+    NOTE: signal handler will not be restored.
+*/
+void afd_watchdog_dealloc( afd_watchdog_t *wd );
+
+/*
+    add event loop to monitoring targets
+    NOTE: call afd_loop_bind_cpu before adding loop.
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_watchdog_add( afd_watchdog_t *wd, afd_loop_t *loop );
+
+/*
+    remove event loop from monitoring targets
+    
+    return: 0 on success, or -1 on failure.(check errno)
+*/
+int afd_watchdog_del( afd_watchdog_t *wd, afd_loop_t *loop );
+
+#endif
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "libasyncfd.h"
+
+/*
+    hot-path microbenchmark with hardware counters
+    
+    measure each operation in ROUNDS rounds of N operations after warm-up,
+    and print median, minimum, maximum and standard deviation of
+    nanoseconds, cycles, instructions, cache misses and branch misses per
+    operation that are read from perf_event_open(2).(counters will be
+    scaled if multiplexed)
+    only nanoseconds are printed if counters are not available.
+    (e.g. perf_event_paranoid or container restriction)
+    
+    NOTE: linux only
+    
+    usage: bench_perf [N [ROUNDS]]
+*/
+
+#define NCOUNTER    4
+#define NMETRIC     ( NCOUNTER + 1 )
+#define BATCH       64
+
+static const char *METRIC_NAME[NMETRIC] = {
+    "ns", "cycles", "instructions", "cache-misses", "branch-misses"
+};
+static const uint64_t COUNTER_CONFIG[NCOUNTER] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+
+typedef struct {
+    const char *name;
+    // run n operations
+    void (*run)( int n );
+} bench_t;
+
+// counter group(fds[0] is leader, -1 if not available)
+static int fds[NCOUNTER] = { -1, -1, -1, -1 };
+
+static afd_loop_t *loop = NULL;
+static int sv[2];
+static afd_watch_t rw;
+static afd_timer_t tw;
+static int bsv[BATCH][2];
+static afd_watch_t batch[BATCH];
+static volatile uint64_t ndispatch = 0;
+
+static void noop_cb( afd_loop_t *loop, afd_watch_t *w, afd_evflag_e flg,
+                     int hup )
+{
+    ndispatch++;
+}
+
+
+static int counter_open( void )
+{
+    struct perf_event_attr attr;
+    int i = 0;
+    
+    for(; i < NCOUNTER; i++ )
+    {
+        memset( &attr, 0, sizeof( attr ) );
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof( attr );
+        attr.config = COUNTER_CONFIG[i];
+        attr.disabled = ( i == 0 );
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP|PERF_FORMAT_TOTAL_TIME_ENABLED|
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = (int)syscall( SYS_perf_event_open, &attr, 0, -1, fds[0], 0 );
+        if( fds[i] == -1 )
+        {
+            fprintf( stderr, "perf_event_open: %s: counters disabled\n",
+                     strerror( errno ) );
+            for( i--; i >= 0; i-- ){
+                close( fds[i] );
+                fds[i] = -1;
+            }
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+// measure n operations, and store per operation values to m
+static void measure( bench_t *b, int n, double *m )
+{
+    struct {
+        uint64_t nr;
+        uint64_t enabled;
+        uint64_t running;
+        uint64_t values[NCOUNTER];
+    } data;
+    struct timespec t0, t1;
+    int i = 0;
+    
+    if( fds[0] != -1 ){
+        ioctl( fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP );
+        ioctl( fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP );
+    }
+    clock_gettime( CLOCK_MONOTONIC, &t0 );
+    b->run( n );
+    clock_gettime( CLOCK_MONOTONIC, &t1 );
+    if( fds[0] != -1 ){
+        ioctl( fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP );
+    }
+    
+    m[0] = ( (double)( t1.tv_sec - t0.tv_sec ) * 1e9 +
+             (double)( t1.tv_nsec - t0.tv_nsec ) ) / n;
+    for(; i < NCOUNTER; i++ ){
+        m[i + 1] = 0;
+    }
+    if( fds[0] != -1 && read( fds[0], &data, sizeof( data ) ) > 0 &&
+        data.running )
+    {
+        // scale multiplexed counters
+        double scale = (double)data.enabled / (double)data.running;
+        
+        for( i = 0; i < NCOUNTER && (uint64_t)i < data.nr; i++ ){
+            m[i + 1] = (double)data.values[i] * scale / n;
+        }
+    }
+}
+
+static int cmp_double( const void *a, const void *b )
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    
+    return ( x > y ) - ( x < y );
+}
+
+static void report( bench_t *b, int n, int rounds )
+{
+    double *samples = calloc( (size_t)rounds * NMETRIC, sizeof( double ) );
+    double *col = calloc( (size_t)rounds, sizeof( double ) );
+    double m[NMETRIC];
+    int nmetric = ( fds[0] != -1 ) ? NMETRIC : 1;
+    int r = 0;
+    int i = 0;
+    
+    if( !samples || !col ){
+        perror( "calloc" );
+        exit( EXIT_FAILURE );
+    }
+    // warm-up caches and branch predictors
+    measure( b, n, m );
+    for(; r < rounds; r++ )
+    {
+        measure( b, n, m );
+        for( i = 0; i < NMETRIC; i++ ){
+            samples[i * rounds + r] = m[i];
+        }
+    }
+    
+    printf( "%s\n", b->name );
+    for( i = 0; i < nmetric; i++ )
+    {
+        double mean = 0;
+        double var = 0;
+        
+        memcpy( col, samples + i * rounds, sizeof( double ) * rounds );
+        qsort( col, (size_t)rounds, sizeof( double ), cmp_double );
+        for( r = 0; r < rounds; r++ ){
+            mean += col[r];
+        }
+        mean /= rounds;
+        for( r = 0; r < rounds; r++ ){
+            var += ( col[r] - mean ) * ( col[r] - mean );
+        }
+        printf( "  %-14s median %10.2f  min %10.2f  max %10.2f  "
+                "stddev %8.2f\n", METRIC_NAME[i], col[rounds / 2], col[0],
+                col[rounds - 1],
+                rounds > 1 ? sqrt( var / ( rounds - 1 ) ) : 0 );
+    }
+    
+    free( samples );
+    free( col );
+}
+
+
+static void run_watch( int n )
+{
+    for(; n > 0; n-- ){
+        afd_watch( loop, &rw );
+        afd_unwatch( loop, 0, &rw );
+    }
+}
+
+static void run_timer_update( int n )
+{
+    struct timespec tspec = { 0, 0 };
+    
+    for(; n > 0; n-- ){
+        tspec.tv_nsec = ( n & 0xffff ) + 1;
+        afd_timer_update( &tw, &tspec );
+    }
+}
+
+// iterations of event loop over a batch of readable descriptors.
+// NOTE: the last iteration may dispatch up to BATCH - 1 extra events
+static void run_dispatch( int n )
+{
+    struct timespec nowait = { 0, 0 };
+    uint64_t end = ndispatch + (uint64_t)n;
+    
+    while( ndispatch < end ){
+        afd_loop_once( loop, &nowait );
+    }
+}
+
+static void run_sock_alloc( int n )
+{
+    const char *addr = "inet://127.0.0.1:8080";
+    size_t len = strlen( addr );
+    afd_sock_t *as = NULL;
+    
+    for(; n > 0; n-- )
+    {
+        if( ( as = afd_sock_alloc( addr, len, AS_TYPE_STREAM ) ) ){
+            afd_sock_dealloc( as );
+        }
+    }
+}
+
+
+int main( int argc, const char *argv[] )
+{
+    int n = ( argc > 1 ) ? atoi( argv[1] ) : 10000;
+    int rounds = ( argc > 2 ) ? atoi( argv[2] ) : 15;
+    struct timespec tspec = { 1, 0 };
+    bench_t benches[] = {
+        { "afd_watch + afd_unwatch", run_watch },
+        { "afd_timer_update", run_timer_update },
+        { "afd_loop_once over readable batch(per event)", run_dispatch },
+        { "afd_sock_alloc + afd_sock_dealloc", run_sock_alloc },
+    };
+    int i = 0;
+    
+    if( n < 1 || rounds < 1 ){
+        fprintf( stderr, "usage: %s [N [ROUNDS]]\n", argv[0] );
+        return EXIT_FAILURE;
+    }
+    else if( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) == -1 ||
+             !( loop = afd_loop_alloc( NULL, BATCH, NULL, NULL ) ) ||
+             afd_watch_init( &rw, sv[0], AS_EV_READ, noop_cb, NULL ) == -1 ||
+             afd_timer_init( &tw, &tspec, noop_cb, NULL ) == -1 ){
+        perror( "setup" );
+        return EXIT_FAILURE;
+    }
+    // level-triggered read watches that are always readable
+    for(; i < BATCH; i++ )
+    {
+        if( socketpair( AF_UNIX, SOCK_STREAM, 0, bsv[i] ) == -1 ||
+            write( bsv[i][1], "", 1 ) != 1 ||
+            afd_watch_init( &batch[i], bsv[i][0], AS_EV_READ, noop_cb, 
+                            NULL ) == -1 ||
+            afd_watch( loop, &batch[i] ) == -1 ){
+            perror( "setup" );
+            return EXIT_FAILURE;
+        }
+    }
+    
+    counter_open();
+    printf( "operations: %d x %d rounds\n", n, rounds );
+    for( i = 0; i < (int)( sizeof( benches ) / sizeof( bench_t ) ); i++ ){
+        report( &benches[i], n, rounds );
+    }
+    
+    for( i = 0; i < NCOUNTER; i++ ){
+        if( fds[i] != -1 ){
+            close( fds[i] );
+        }
+    }
+    afd_loop_dealloc( loop );
+    close( sv[0] );
+    close( sv[1] );
+    for( i = 0; i < BATCH; i++ ){
+        close( bsv[i][0] );
+        close( bsv[i][1] );
+    }
+    
+    return EXIT_SUCCESS;
+}
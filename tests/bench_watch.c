@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "libasyncfd.h"
+
+/*
+    memory-per-connection benchmark
+    
+    register N watches(dup of a socket) to event loop, and print the size
+    of watch structures and the growth of resident memory per connection
+    in user space.(the memory of kernel event queue is not included)
+    
+    usage: bench_watch [N]
+*/
+
+typedef struct {
+    afd_watch_t w;
+    // typical per-connection state of application
+    void *buf;
+} conn_t;
+
+static long rss_bytes( void )
+{
+    long size = 0;
+    long rss = 0;
+    FILE *fp = fopen( "/proc/self/statm", "r" );
+    
+    if( !fp ){
+        return -1;
+    }
+    else if( fscanf( fp, "%ld %ld", &size, &rss ) != 2 ){
+        rss = -1;
+    }
+    fclose( fp );
+    
+    return rss * sysconf( _SC_PAGESIZE );
+}
+
+static void noop_cb( afd_loop_t *loop, afd_watch_t *w, afd_evflag_e flg,
+                     int hup ){}
+
+int main( int argc, const char *argv[] )
+{
+    int n = ( argc > 1 ) ? atoi( argv[1] ) : 100000;
+    struct timespec timeout = { 0, 0 };
+    struct rlimit rl;
+    afd_loop_t *loop = NULL;
+    conn_t **conns = NULL;
+    long before = 0;
+    long after = 0;
+    int sv[2];
+    int i = 0;
+    
+    if( n < 1 ){
+        fprintf( stderr, "usage: %s [N]\n", argv[0] );
+        return EXIT_FAILURE;
+    }
+    printf( "sizeof(afd_watch_t): %zu bytes\n", sizeof( afd_watch_t ) );
+    printf( "sizeof(afd_timer_t): %zu bytes\n", sizeof( afd_timer_t ) );
+    printf( "watches per cache line(64): %zu\n", 64 / sizeof( afd_watch_t ) );
+    
+    // raise descriptor limit
+    if( getrlimit( RLIMIT_NOFILE, &rl ) == 0 && rl.rlim_cur < (rlim_t)n + 64 ){
+        rl.rlim_cur = ( rl.rlim_max < (rlim_t)n + 64 ) ? rl.rlim_max :
+                      (rlim_t)n + 64;
+        setrlimit( RLIMIT_NOFILE, &rl );
+        if( rl.rlim_cur < (rlim_t)n + 64 ){
+            n = (int)rl.rlim_cur - 64;
+            printf( "descriptor limit: N = %d\n", n );
+        }
+    }
+    
+    if( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) == -1 ||
+        !( loop = afd_loop_alloc( NULL, 1, NULL, NULL ) ) ||
+        !( conns = calloc( (size_t)n, sizeof( conn_t* ) ) ) ){
+        perror( "setup" );
+        return EXIT_FAILURE;
+    }
+    
+    before = rss_bytes();
+    for(; i < n; i++ )
+    {
+        int fd = dup( sv[0] );
+        
+        if( fd == -1 || !( conns[i] = malloc( sizeof( conn_t ) ) ) ||
+            afd_watch_init( &conns[i]->w, fd, AS_EV_WRITE, noop_cb,
+                            conns[i] ) == -1 ||
+            afd_watch( loop, &conns[i]->w ) == -1 ){
+            perror( "watch" );
+            return EXIT_FAILURE;
+        }
+        conns[i]->buf = NULL;
+    }
+    // expand receive events container and dispatch all
+    afd_loop_once( loop, &timeout );
+    after = rss_bytes();
+    
+    printf( "connections: %d\n", n );
+    printf( "resident memory per connection: %.1f bytes\n",
+            (double)( after - before ) / n );
+    
+    for( i = 0; i < n; i++ ){
+        afd_unwatch( loop, 1, &conns[i]->w );
+        free( conns[i] );
+    }
+    free( conns );
+    afd_loop_dealloc( loop );
+    close( sv[0] );
+    close( sv[1] );
+    
+    return EXIT_SUCCESS;
+}
+
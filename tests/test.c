@@ -1,11 +1,14 @@
+// accept4
+#define _GNU_SOURCE
 #include <stdio.h>
 #include "libasyncfd.h"
+#include "libasyncfd_prefork.h"
 #include "asyncfd_private.h"
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
 
-static const char SENDTEST[] = 
+static const char SENDTEST[] =
         "HTTP/1.1 200 OK\r\n"
         "Server: libasyncfd\r\n"
         "Content-Length: 5\r\n"
@@ -15,72 +18,41 @@ static const char SENDTEST[] =
 static const size_t SENDTEST_LEN = sizeof( SENDTEST ) - 1;
 
 typedef struct {
-    int write;
     afd_watch_t read_w;
-    afd_watch_t write_w;
 } mydata_t;
 
-static void test_unwatch( afd_loop_t *loop, afd_watch_t *w )
+// state of worker process
+static afd_watch_t listen_w;
+static afd_watch_t drain_w;
+static int nconn = 0;
+static int draining = 0;
+
+static void test_free( afd_watch_t *w )
 {
-    afd_unwatch_close( w, loop );
     pdealloc( w->udata );
 }
 
-static void test_write( afd_loop_t *loop, afd_watch_t *w, afd_evflag_e flg )
+static void test_unwatch( afd_loop_t *loop, afd_watch_t *w )
 {
-    //plog( "test_write: %d", w->fd );
-    mydata_t *data = (mydata_t*)w->udata;
-    // recv-q test
-    //usleep( 100 );
-    if( data->write )
-    {
-        if( send( w->fd, SENDTEST, SENDTEST_LEN, 0 ) != SENDTEST_LEN ){
-            pfelog( send );
-            test_unwatch( loop, w );
-        }
-        else {
-            data->write = 0;
-        }
+    afd_unwatch( loop, 1, w );
+    // remaining events of current iteration may refer to w
+    if( afd_watch_release( loop, w, test_free ) == -1 ){
+        pfelog( afd_watch_release );
     }
-}
-
-static void test_read( afd_loop_t *loop, afd_watch_t *w, afd_evflag_e flg, int hup )
-{
-    char buf[8192];
-    size_t blen = 8192;
-    ssize_t len = read( w->fd, buf, blen );
-    mydata_t *data = (mydata_t*)w->udata;
-    
-    if( len > 0 )
-    {
-        buf[len] = 0;
-        //plog( "test_read: %d", w->fd );
-        data->write = 1;
-        // recv-q test
-        //usleep( 100 );
+    // exit after all connections closed
+    if( --nconn == 0 && draining ){
+        afd_unloop( loop );
     }
-    // close by peer
-    else if( len == 0 ){
-        //plog( "close by peer: %d", w->fd );
-        test_unwatch( loop, w );
-    }
-    else if( errno != EAGAIN || errno != EWOULDBLOCK ){
-        pfelog( read );
-        test_unwatch( loop, w );
-    }
-
 }
 
 static void test_rw( afd_loop_t *loop, afd_watch_t *w, afd_evflag_e flg, int hup )
 {
     // close by peer
     if( hup ){
-        plog( "hup: close by peer: %d", w->fd );
         test_unwatch( loop, w );
     }
     else
     {
-        mydata_t *data = (mydata_t*)w->udata;
         char buf[8192];
         size_t blen = 8192;
         ssize_t len = 0;
@@ -90,11 +62,6 @@ static void test_rw( afd_loop_t *loop, afd_watch_t *w, afd_evflag_e flg, int hup
         
         if( len > 0 )
         {
-            buf[len] = 0;
-            //plog( "test_read: %d", w->fd );
-            data->write = 1;
-            // recv-q test
-            //usleep( 100 );
             if( send( w->fd, SENDTEST, SENDTEST_LEN, 0 ) != SENDTEST_LEN ){
                 pfelog( send );
                 test_unwatch( loop, w );
@@ -102,176 +69,147 @@ static void test_rw( afd_loop_t *loop, afd_watch_t *w, afd_evflag_e flg, int hup
             else {
                 afd_edge_again();
             }
-            /*
-            else if( afd_rewatch( w, loop ) ){
-                pfelog( afd_rewatch );
-                test_unwatch( loop, w );
-            }*/
         }
         // close by peer
         else if( len == 0 ){
-            plog( "read close by peer: %d", w->fd );
             test_unwatch( loop, w );
         }
-        else if( errno != EAGAIN || errno != EWOULDBLOCK ){
+        else if( errno != EAGAIN && errno != EWOULDBLOCK ){
             test_unwatch( loop, w );
         }
-        //else {
-        //    pfelog( read, "back to event" );
-        //}
     }
 }
 
 static void test_accept( afd_loop_t *loop, afd_watch_t *w, afd_evflag_e flg, int hup )
 {
-    int cfd = afd_accept( w->fd, NULL, NULL );
     mydata_t *data = NULL;
+    int cfd = 0;
     
-    switch( afd_accept_chk( cfd, 0 ) )
+    switch( afd_accept( &cfd, w->fd, NULL, NULL, 0 ) )
     {
         case -1:
-            pfelog( accept );
+            if( errno != EAGAIN && errno != EWOULDBLOCK ){
+                pfelog( accept );
+            }
         break;
         case 0:
-            pfelog( afd_accept_check );
+            pfelog( afd_accept );
             close( cfd );
         break;
         default:
-            //plog( "got client: %d", cfd );
-            if( !( data = pcalloc( 1, mydata_t ) ) || 
-                afd_watch( &data->read_w, loop, cfd, AS_EV_READ|AS_EV_EDGE, test_rw, data ) /*||
-                afd_watch( &data->read_w, loop, cfd, AS_EV_READ, test_read, data ) ||
-                afd_watch( &data->write_w, loop, cfd, AS_EV_WRITE, test_write, data )*/ ){
+            if( !( data = pcalloc( 1, mydata_t ) ) ||
+                afd_watch_init( &data->read_w, cfd, AS_EV_READ|AS_EV_EDGE,
+                                test_rw, data ) == -1 ){
                 if( data ){
                     pdealloc( data );
                 }
-                pelog( "failed to palloc/afd_watch" );
+                pelog( "failed to palloc/afd_watch_init" );
                 close( cfd );
             }
+            else
+            {
+                nconn++;
+                // read request that has already arrived before registration
+                // NOTE: test_rw may close the connection in afd_watch_eager
+                if( afd_watch_eager( loop, &data->read_w ) == -1 ){
+                    pfelog( afd_watch_eager );
+                    test_unwatch( loop, &data->read_w );
+                }
+            }
     }
 }
 
-static int child_signal( void )
+// stop accepting and exit after finishing current connections
+static void test_drain( afd_loop_t *loop, afd_watch_t *w, afd_evflag_e flg, int hup )
 {
-    int rc = 0;
-    sigset_t ss;
-    
-    // set all-signal
-    if( ( rc = sigfillset( &ss ) ) != 0 ){
-        pfelog( sigfillset );
-        exit(0);
-    }
-    else if( ( rc = sigprocmask( SIG_UNBLOCK, &ss, NULL ) ) != 0 ){
-        pfelog( sigprocmask );
-        exit(0);
+    plog( "worker %d: drain %d connections", getpid(), nconn );
+    draining = 1;
+    afd_unwatch( loop, 0, &listen_w );
+    afd_unwatch( loop, 0, &drain_w );
+    if( !nconn ){
+        afd_unloop( loop );
     }
-    /*
-    else if( ( rc = sigwait( &ss, &signo ) ) != 0 ){
-        pfelog( sigwait );
-    }
-    else {
-        plog( "catch signal: %d", signo );
-    }
-    */
-    
-    return rc;
 }
 
-static void test_loop( afd_sock_t *as )
+static int test_worker( afd_worker_t *worker )
 {
+    afd_sock_t *as = worker->socks[0];
     afd_loop_t *loop = NULL;
-    afd_watch_t w;
-    
-    child_signal();
     
     if( !( loop = afd_loop_alloc( as, SOMAXCONN, afd_loop_cleanup_null, NULL ) ) ){
         pfelog( afd_loop_alloc );
-        exit(0);
+        return EXIT_FAILURE;
+    }
+    // move loop memory to local node of pinned cpu
+    else if( worker->cpu != -1 &&
+             afd_loop_bind_cpu( loop, worker->cpu, 0 ) == -1 ){
+        pfelog( afd_loop_bind_cpu );
     }
-    else if( afd_watch( &w, loop, as->fd, AS_EV_READ, test_accept, NULL ) == -1 ){
+    
+    if( afd_watch_init( &listen_w, as->fd, AS_EV_READ, test_accept, NULL ) == -1 ||
+        afd_watch_init( &drain_w, worker->drainfd, AS_EV_READ, test_drain,
+                        NULL ) == -1 ||
+        afd_nwatch( loop, &listen_w, &drain_w, NULL ) == -1 ){
         pfelog( afd_watch );
-        exit(0);
+        return EXIT_FAILURE;
     }
-    else
-    {
-        //struct timeval tval = { 1, 0 };
-        int nev;
-        
-        while( ( nev = afd_wait( loop, /*&tval*/NULL ) ) != -1 ){
-            //plog( "proc ev: %d", nev );
-        }
-        pfelog( afd_wait );
-        
-        afd_unwatch( &w, loop );
-        afd_loop_dealloc( loop );
-        
-        exit(0);
+    
+    afd_worker_ready( worker );
+    plog( "worker %d: id %d cpu %d", getpid(), worker->id, worker->cpu );
+    if( afd_loop( loop ) == -1 ){
+        pfelog( afd_loop );
     }
+    afd_loop_dealloc( loop );
+    
+    return EXIT_SUCCESS;
 }
 
-static void test_listen( void )
+
+int main (int argc, const char * argv[])
 {
     const char *addr = "inet://127.0.0.1:8080";
-    afd_sock_t *as = afd_sock_alloc( addr, strlen( addr ), AS_TYPE_STREAM );
-    int8_t nchild = 2;
-    int8_t i = 0;
-    pid_t pid = 0;
+    afd_sock_t *socks[1];
+    afd_prefork_t *pf = NULL;
+    int nsock = 0;
     
-    if( !as ){
-        pfelog( afd_alloc );
-        exit(0);
-    }
-    else if( afd_listen( as, SOMAXCONN ) == -1 ){
-        pfelog( afd_listen );
-        exit(0);
+    // listening socket of old master
+    if( ( nsock = afd_prefork_inherit( socks, 1 ) ) == -1 ){
+        pfelog( afd_prefork_inherit );
+        return EXIT_FAILURE;
     }
-    
-    for(; i < nchild; i++ )
+    else if( !nsock )
     {
-        if( ( pid = fork() ) == -1 ){
-            pfelog( fork );
-            exit(0);
+        if( !( socks[0] = afd_sock_alloc( addr, strlen( addr ), AS_TYPE_STREAM ) ) ){
+            pfelog( afd_sock_alloc );
+            return EXIT_FAILURE;
         }
-        else if( !pid ){
-            test_loop( as );
+        else if( afd_listen( socks[0], SOMAXCONN ) == -1 ){
+            pfelog( afd_listen );
+            return EXIT_FAILURE;
         }
+#ifdef TCP_DEFER_ACCEPT
+        // accept after the request arrived, so afd_watch_eager can read it
+        // without registration
+        setsockopt( socks[0]->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &AS_YES,
+                    (socklen_t)sizeof( AS_YES ) );
+#endif
     }
     
-    plog( "startup" );
-    plog( "try to ab -c 10 -n 100000 -k http://127.0.0.1:8080/" );
-    afd_sock_dealloc( as );
-}
-
-static int wait4signal( void )
-{
-    int rc = 0;
-    int signo = 0;
-    sigset_t ss;
-    
-    // set all-signal
-    if( ( rc = sigfillset( &ss ) ) != 0 ){
-        pfelog( sigfillset );
-    }
-    /*else if( ( rc = sigprocmask( SIG_BLOCK, &ss, NULL ) ) != 0 ){
-        pfelog( sigprocmask );
-    }*/
-    else if( ( rc = sigwait( &ss, &signo ) ) != 0 ){
-        pfelog( sigwait );
-    }
-    else {
-        plog( "catch signal: %d", signo );
-        kill( 0, signo );
+    if( !( pf = afd_prefork_alloc( socks, 1, 2, AFD_PREFORK_PIN, test_worker,
+                                   NULL ) ) ){
+        pfelog( afd_prefork_alloc );
+        return EXIT_FAILURE;
     }
     
-    return rc;
-}
-
-
-int main (int argc, const char * argv[]) 
-{
-    // insert code here...
-    test_listen();
-    wait4signal();
+    plog( "startup: master %d", getpid() );
+    plog( "try to ab -c 10 -n 100000 -k http://127.0.0.1:8080/" );
+    plog( "kill -HUP to reload workers, -USR2 to upgrade binary, -QUIT to drain" );
+    if( afd_prefork_run( pf, (char *const*)argv ) == -1 ){
+        pfelog( afd_prefork_run );
+    }
+    plog( "shutdown: master %d", getpid() );
+    afd_prefork_dealloc( pf );
+    afd_sock_dealloc( socks[0] );
     
     return 0;
 }
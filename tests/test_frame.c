@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "libasyncfd_frame.h"
+
+/*
+    message framing test
+    
+    input is written to a pipe in pieces, and each piece is read by
+    afd_frame_read to reassemble frames that cross reads.
+*/
+
+static int nfail = 0;
+
+#define check(cond,...) do { \
+    if( !(cond) ){ \
+        nfail++; \
+        printf( "FAIL %s:%d: ", __FILE__, __LINE__ ); \
+        printf( __VA_ARGS__ ); \
+        printf( "\n" ); \
+    } \
+}while(0)
+
+#define MAXMSG  128
+
+// received frames
+static char msgs[MAXMSG][64];
+static int nmsg = 0;
+// number of callbacks, and the callback number that stops parsing
+static int ncb = 0;
+static int stopat = 0;
+static int pfd[2];
+
+static int frame_cb( afd_frame_t *f, struct iovec *iov, int n )
+{
+    int i = 0;
+    
+    for(; i < n && nmsg < MAXMSG; i++, nmsg++ )
+    {
+        size_t len = iov[i].iov_len < sizeof( msgs[0] ) - 1 ?
+                     iov[i].iov_len : sizeof( msgs[0] ) - 1;
+        
+        memcpy( msgs[nmsg], iov[i].iov_base, len );
+        msgs[nmsg][len] = 0;
+    }
+    
+    return ( ++ncb == stopat ) ? -1 : 0;
+}
+
+static void setup( afd_frame_t *f, afd_frame_conf_t *conf )
+{
+    nmsg = 0;
+    ncb = 0;
+    stopat = 0;
+    if( pipe( pfd ) == -1 || afd_frame_init( f, conf, frame_cb, NULL ) == -1 ){
+        perror( "setup" );
+        exit( EXIT_FAILURE );
+    }
+}
+
+static void teardown( afd_frame_t *f )
+{
+    afd_frame_dispose( f );
+    close( pfd[0] );
+    close( pfd[1] );
+}
+
+// write data to pipe, and read it by afd_frame_read
+static ssize_t feed( afd_frame_t *f, const void *data, size_t len )
+{
+    if( write( pfd[1], data, len ) != (ssize_t)len ){
+        perror( "write" );
+        exit( EXIT_FAILURE );
+    }
+    
+    return afd_frame_read( f, pfd[0] );
+}
+
+// feed data byte by byte
+static void feed_split( afd_frame_t *f, const char *name, const char *data,
+                        size_t len )
+{
+    size_t i = 0;
+    
+    for(; i < len; i++ ){
+        check( feed( f, data + i, 1 ) == 1, "%s: read byte %zu", name, i );
+    }
+}
+
+static void test_prefix_split( void )
+{
+    afd_frame_conf_t conf = { .prefix = 4, .maxlen = 64 };
+    afd_frame_t f;
+    
+    setup( &f, &conf );
+    feed_split( &f, "be4", "\0\0\0\5hello\0\0\0\0\0\0\0\3abc", 20 );
+    check( nmsg == 3, "be4: %d frames", nmsg );
+    check( !strcmp( msgs[0], "hello" ), "be4: frame 0 '%s'", msgs[0] );
+    check( msgs[1][0] == 0, "be4: empty frame '%s'", msgs[1] );
+    check( !strcmp( msgs[2], "abc" ), "be4: frame 2 '%s'", msgs[2] );
+    teardown( &f );
+    
+    conf = (afd_frame_conf_t){ .prefix = 2, .le = 1, .maxlen = 64 };
+    setup( &f, &conf );
+    feed_split( &f, "le2", "\5\0hello", 7 );
+    check( nmsg == 1 && !strcmp( msgs[0], "hello" ), "le2: %d frames", nmsg );
+    teardown( &f );
+}
+
+static void test_prefix_inclusive( void )
+{
+    afd_frame_conf_t conf = { .prefix = 2, .inclusive = 1, .maxlen = 64 };
+    afd_frame_t f;
+    ssize_t rc = 0;
+    
+    setup( &f, &conf );
+    rc = feed( &f, "\0\7hello\0\2", 9 );
+    check( rc == 9, "inclusive: read returns %zd", rc );
+    check( nmsg == 2 && !strcmp( msgs[0], "hello" ) && msgs[1][0] == 0,
+           "inclusive: %d frames", nmsg );
+    teardown( &f );
+    
+    // exclusive length counts only the payload
+    conf.inclusive = 0;
+    setup( &f, &conf );
+    rc = feed( &f, "\0\5hello", 7 );
+    check( rc == 7 && nmsg == 1 && !strcmp( msgs[0], "hello" ),
+           "exclusive: %d frames", nmsg );
+    teardown( &f );
+}
+
+static void test_delim_split( void )
+{
+    afd_frame_conf_t conf = { .dlen = 2, .delim = "\r\n", .maxlen = 64 };
+    afd_frame_t f;
+    
+    setup( &f, &conf );
+    check( feed( &f, "abc\r", 4 ) == 4 && nmsg == 0,
+           "delim: frame before delimiter completed" );
+    check( feed( &f, "\ndef\r\n\r", 7 ) == 7 && nmsg == 2,
+           "delim: %d frames", nmsg );
+    check( !strcmp( msgs[0], "abc" ) && !strcmp( msgs[1], "def" ),
+           "delim: frames '%s' '%s'", msgs[0], msgs[1] );
+    // a lone first byte of delimiter is a part of payload
+    check( feed( &f, "x\r\n", 3 ) == 3 && nmsg == 3,
+           "delim: %d frames", nmsg );
+    check( !strcmp( msgs[2], "\rx" ), "delim: frame '%s'", msgs[2] );
+    teardown( &f );
+}
+
+static void test_delim_resume( void )
+{
+    afd_frame_conf_t conf = { .dlen = 1, .delim = "\n", .maxlen = 64 };
+    char *buf = malloc( AFD_FRAME_BUFSIZE );
+    afd_frame_t f;
+    ssize_t rc = 0;
+    
+    if( !buf ){
+        perror( "malloc" );
+        exit( EXIT_FAILURE );
+    }
+    // fill buffer with complete frames and 9 bytes of incomplete frame, so
+    // that it will be moved to the head of buffer at next read.
+    memset( buf, 'a', AFD_FRAME_BUFSIZE );
+    for( rc = 63; rc < AFD_FRAME_BUFSIZE - 9; rc += 64 ){
+        buf[rc] = '\n';
+    }
+    buf[AFD_FRAME_BUFSIZE - 10] = '\n';
+    memcpy( buf + AFD_FRAME_BUFSIZE - 9, "abcdefghi", 9 );
+    
+    setup( &f, &conf );
+    stopat = -1;
+    rc = feed( &f, buf, AFD_FRAME_BUFSIZE );
+    check( rc == AFD_FRAME_BUFSIZE, "resume: read returns %zd", rc );
+    nmsg = 0;
+    rc = feed( &f, "jk\n", 3 );
+    check( rc == 3 && nmsg == 1, "resume: %d frames", nmsg );
+    check( !strcmp( msgs[0], "abcdefghijk" ), "resume: frame '%s'",
+           msgs[0] );
+    teardown( &f );
+    free( buf );
+}
+
+static void test_errors( void )
+{
+    afd_frame_conf_t conf = { .prefix = 1, .maxlen = 4 };
+    afd_frame_t f;
+    ssize_t rc = 0;
+    
+    setup( &f, &conf );
+    rc = feed( &f, "\12", 1 );
+    check( rc == -1 && errno == EMSGSIZE, "prefix too long: returns %zd", rc );
+    teardown( &f );
+    
+    conf = (afd_frame_conf_t){ .prefix = 2, .inclusive = 1, .maxlen = 64 };
+    setup( &f, &conf );
+    rc = feed( &f, "\0\1", 2 );
+    check( rc == -1 && errno == EBADMSG, "short prefix: returns %zd", rc );
+    teardown( &f );
+    
+    // complete frames before the error are passed
+    conf = (afd_frame_conf_t){ .dlen = 1, .delim = "\n", .maxlen = 8 };
+    setup( &f, &conf );
+    rc = feed( &f, "ok\n123456789", 12 );
+    check( rc == -1 && errno == EMSGSIZE, "delim too long: returns %zd", rc );
+    check( nmsg == 1 && !strcmp( msgs[0], "ok" ),
+           "delim too long: %d frames", nmsg );
+    teardown( &f );
+}
+
+static void test_stop( void )
+{
+    afd_frame_conf_t conf = { .dlen = 1, .delim = "\n", .maxlen = 64 };
+    char buf[( AFD_FRAME_BATCH + 1 ) * 2];
+    afd_frame_t f;
+    ssize_t rc = 0;
+    int i = 0;
+    
+    for(; i < AFD_FRAME_BATCH + 1; i++ ){
+        buf[i * 2] = 'a' + i % 26;
+        buf[i * 2 + 1] = '\n';
+    }
+    setup( &f, &conf );
+    stopat = 1;
+    rc = feed( &f, buf, sizeof( buf ) );
+    check( rc == -1 && errno == ECANCELED, "stop: read returns %zd", rc );
+    check( nmsg == AFD_FRAME_BATCH, "stop: %d frames", nmsg );
+    // remaining frame is passed by afd_frame_parse
+    check( afd_frame_parse( &f ) == 0, "stop: parse failed" );
+    check( nmsg == AFD_FRAME_BATCH + 1 && ncb == 2, "stop: %d frames", nmsg );
+    check( msgs[AFD_FRAME_BATCH][0] == 'a' + AFD_FRAME_BATCH % 26,
+           "stop: last frame '%s'", msgs[AFD_FRAME_BATCH] );
+    teardown( &f );
+}
+
+
+int main( void )
+{
+    test_prefix_split();
+    test_prefix_inclusive();
+    test_delim_split();
+    test_delim_resume();
+    test_errors();
+    test_stop();
+    
+    if( nfail ){
+        printf( "%d failures\n", nfail );
+        return EXIT_FAILURE;
+    }
+    printf( "ok\n" );
+    
+    return EXIT_SUCCESS;
+}
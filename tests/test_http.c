@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "libasyncfd_http.h"
+
+/*
+    incremental http request parser test
+    
+    each request is fed to afd_http_parse_req byte by byte, and with the
+    whole buffer at once.
+*/
+
+static int nfail = 0;
+
+#define check(cond,...) do { \
+    if( !(cond) ){ \
+        nfail++; \
+        printf( "FAIL %s:%d: ", __FILE__, __LINE__ ); \
+        printf( __VA_ARGS__ ); \
+        printf( "\n" ); \
+    } \
+}while(0)
+
+#define REQ_GET \
+    "GET /index.html HTTP/1.1\r\n" \
+    "Host: localhost\r\n" \
+    "\r\n"
+
+#define REQ_POST \
+    "POST /form HTTP/1.1\r\n" \
+    "Content-Length: 11\r\n" \
+    "Connection: close\r\n" \
+    "\r\n" \
+    "hello world"
+
+// feed buf from 1 byte, and return the result of the first complete parse
+static ssize_t parse_split( afd_http_req_t *req, const char *buf, size_t len,
+                            size_t *at )
+{
+    ssize_t rc = AFD_HTTP_EAGAIN;
+    size_t i = 1;
+    
+    afd_http_req_init( req );
+    for(; i <= len; i++ )
+    {
+        if( ( rc = afd_http_parse_req( req, buf, i ) ) != AFD_HTTP_EAGAIN ){
+            break;
+        }
+    }
+    *at = i;
+    
+    return rc;
+}
+
+static void test_split( const char *name, const char *buf, size_t len,
+                        size_t clen )
+{
+    afd_http_req_t req;
+    size_t at = 0;
+    ssize_t rc = parse_split( &req, buf, len, &at );
+    
+    check( rc == (ssize_t)len, "%s: split parse returns %zd(expect %zu)",
+           name, rc, len );
+    check( at == len, "%s: completed at %zu of %zu bytes", name, at, len );
+    check( req.clen == clen, "%s: clen %zu(expect %zu)", name, req.clen,
+           clen );
+    if( clen ){
+        check( req.body == buf + len - clen, "%s: body pointer", name );
+    }
+    
+    // once more with the whole buffer and the same req
+    afd_http_req_init( &req );
+    rc = afd_http_parse_req( &req, buf, len );
+    check( rc == (ssize_t)len, "%s: whole parse returns %zd(expect %zu)",
+           name, rc, len );
+}
+
+static void test_pipeline( void )
+{
+    const char buf[] = REQ_GET REQ_POST REQ_GET;
+    size_t len = sizeof( buf ) - 1;
+    const char *p = buf;
+    afd_http_req_t req;
+    ssize_t rc = 0;
+    int n = 0;
+    
+    afd_http_req_init( &req );
+    while( p < buf + len &&
+           ( rc = afd_http_parse_req( &req, p, buf + len - p ) ) > 0 )
+    {
+        switch( n++ ){
+            case 0:
+            case 2:
+                check( rc == (ssize_t)( sizeof( REQ_GET ) - 1 ),
+                       "pipeline: request %d length %zd", n, rc );
+                check( req.keepalive == 1, "pipeline: request %d keepalive",
+                       n );
+            break;
+            case 1:
+                check( rc == (ssize_t)( sizeof( REQ_POST ) - 1 ),
+                       "pipeline: request %d length %zd", n, rc );
+                check( req.keepalive == 0, "pipeline: request %d keepalive",
+                       n );
+                check( req.body && !memcmp( req.body, "hello world", 11 ),
+                       "pipeline: request %d body", n );
+            break;
+        }
+        p += rc;
+    }
+    check( n == 3 && p == buf + len, "pipeline: parsed %d requests", n );
+}
+
+static void test_invalid( void )
+{
+    afd_http_req_t req;
+    char *buf = NULL;
+    ssize_t rc = 0;
+    
+    // copy to the exact size to detect overrun
+    if( !( buf = malloc( 4 ) ) ){
+        perror( "malloc" );
+        exit( EXIT_FAILURE );
+    }
+    memcpy( buf, "\r\n\r\n", 4 );
+    afd_http_req_init( &req );
+    rc = afd_http_parse_req( &req, buf, 4 );
+    check( rc == -1 && errno == EINVAL, "empty lines: returns %zd", rc );
+    free( buf );
+    
+    afd_http_req_init( &req );
+    rc = afd_http_parse_req( &req, "GET / HTTP/1.1\r\nBad Header\r\n\r\n", 30 );
+    check( rc == -1 && errno == EINVAL, "invalid header: returns %zd", rc );
+}
+
+
+int main( void )
+{
+    test_split( "get", REQ_GET, sizeof( REQ_GET ) - 1, 0 );
+    test_split( "post", REQ_POST, sizeof( REQ_POST ) - 1, 11 );
+    test_pipeline();
+    test_invalid();
+    
+    if( nfail ){
+        printf( "%d failures\n", nfail );
+        return EXIT_FAILURE;
+    }
+    printf( "ok\n" );
+    
+    return EXIT_SUCCESS;
+}
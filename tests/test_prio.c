@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "libasyncfd.h"
+
+/*
+    priority class test
+    
+    the events of an iteration are dispatched in the order of control,
+    normal and bulk class regardless of received order, and the bulk
+    events over the budget are carried over and dispatched exactly once.
+*/
+
+static int nfail = 0;
+
+#define check(cond,...) do { \
+    if( !(cond) ){ \
+        nfail++; \
+        printf( "FAIL %s:%d: ", __FILE__, __LINE__ ); \
+        printf( __VA_ARGS__ ); \
+        printf( "\n" ); \
+    } \
+}while(0)
+
+#define NWATCH  6
+
+static int sv[NWATCH][2];
+static afd_watch_t ws[NWATCH];
+// index of watches in dispatched order
+static int order[NWATCH * 4];
+static int norder = 0;
+
+static void read_cb( afd_loop_t *loop, afd_watch_t *w, afd_evflag_e flg,
+                     int hup )
+{
+    char c = 0;
+    
+    if( norder < NWATCH * 4 ){
+        order[norder++] = (int)( w - ws );
+    }
+    // consume input to be readable only once
+    if( read( w->fd, &c, 1 ) != 1 ){
+        check( 0, "read watch %d: %s", (int)( w - ws ), strerror( errno ) );
+    }
+}
+
+// register watches with attributes, and make them readable in index order
+static void setup( afd_loop_t *loop, const int *attr )
+{
+    int i = 0;
+    
+    norder = 0;
+    for(; i < NWATCH; i++ )
+    {
+        if( afd_watch_init( &ws[i], sv[i][0], AS_EV_READ|attr[i], read_cb,
+                            NULL ) == -1 ||
+            afd_watch( loop, &ws[i] ) == -1 ){
+            perror( "setup" );
+            exit( EXIT_FAILURE );
+        }
+    }
+    for( i = 0; i < NWATCH; i++ )
+    {
+        if( write( sv[i][1], "", 1 ) != 1 ){
+            perror( "write" );
+            exit( EXIT_FAILURE );
+        }
+    }
+}
+
+static void teardown( afd_loop_t *loop )
+{
+    int i = 0;
+    
+    for(; i < NWATCH; i++ ){
+        afd_unwatch( loop, 0, &ws[i] );
+    }
+}
+
+static void test_order( afd_loop_t *loop )
+{
+    // received in the order of bulk, normal and control
+    const int attr[NWATCH] = {
+        AS_EV_BULK, AS_EV_BULK, 0, 0, AS_EV_CONTROL, AS_EV_CONTROL
+    };
+    const int expect[NWATCH] = { 4, 5, 2, 3, 0, 1 };
+    struct timespec tmo = { 1, 0 };
+    int rc = 0;
+    
+    afd_loop_bulk_budget( loop, 0 );
+    setup( loop, attr );
+    rc = afd_loop_once( loop, &tmo );
+    check( rc == NWATCH, "order: received %d events", rc );
+    check( norder == NWATCH, "order: dispatched %d events", norder );
+    check( !memcmp( order, expect, sizeof( expect ) ),
+           "order: %d %d %d %d %d %d", order[0], order[1], order[2],
+           order[3], order[4], order[5] );
+    teardown( loop );
+}
+
+static void test_carry( afd_loop_t *loop )
+{
+    const int attr[NWATCH] = {
+        AS_EV_BULK, AS_EV_BULK, AS_EV_BULK, AS_EV_BULK, 0, 0
+    };
+    struct timespec tmo = { 0, 0 };
+    int count[NWATCH];
+    int iter = 0;
+    int i = 0;
+    
+    // dispatch one bulk event per iteration
+    afd_loop_bulk_budget( loop, 1 );
+    setup( loop, attr );
+    for(; iter < NWATCH * 2; iter++ )
+    {
+        i = norder;
+        check( afd_loop_once( loop, &tmo ) != -1, "carry: %s",
+               strerror( errno ) );
+        // normal events are not delayed by bulk events
+        if( iter == 0 ){
+            check( norder - i == 3 && order[0] == 4 && order[1] == 5,
+                   "carry: dispatched %d events at first", norder - i );
+        }
+    }
+    
+    memset( count, 0, sizeof( count ) );
+    for( i = 0; i < norder; i++ ){
+        count[order[i]]++;
+    }
+    for( i = 0; i < NWATCH; i++ ){
+        check( count[i] == 1, "carry: watch %d dispatched %d times", i,
+               count[i] );
+    }
+    teardown( loop );
+}
+
+
+int main( void )
+{
+    afd_loop_t *loop = NULL;
+    int i = 0;
+    
+    for(; i < NWATCH; i++ )
+    {
+        // duplicated dispatch fails to read instead of blocking
+        if( socketpair( AF_UNIX, SOCK_STREAM, 0, sv[i] ) == -1 ||
+            fcntl( sv[i][0], F_SETFL, O_NONBLOCK ) == -1 ){
+            perror( "socketpair" );
+            return EXIT_FAILURE;
+        }
+    }
+    if( !( loop = afd_loop_alloc( NULL, NWATCH, NULL, NULL ) ) ){
+        perror( "afd_loop_alloc" );
+        return EXIT_FAILURE;
+    }
+    
+    test_order( loop );
+    test_carry( loop );
+    
+    afd_loop_dealloc( loop );
+    for( i = 0; i < NWATCH; i++ ){
+        close( sv[i][0] );
+        close( sv[i][1] );
+    }
+    
+    if( nfail ){
+        printf( "%d failures\n", nfail );
+        return EXIT_FAILURE;
+    }
+    printf( "ok\n" );
+    
+    return EXIT_SUCCESS;
+}
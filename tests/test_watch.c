@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "libasyncfd.h"
+
+/*
+    watch reuse test in an iteration
+    
+    two readable watches receive events in the same iteration, and the
+    callback that runs first deregisters the other watch whose event
+    remains in the received batch.
+*/
+
+static int nfail = 0;
+
+#define check(cond,...) do { \
+    if( !(cond) ){ \
+        nfail++; \
+        printf( "FAIL %s:%d: ", __FILE__, __LINE__ ); \
+        printf( __VA_ARGS__ ); \
+        printf( "\n" ); \
+    } \
+}while(0)
+
+static int sv[3][2];
+static afd_watch_t *ws[2];
+// number of callbacks of each watch in current iteration
+static int ncb[2];
+// the other watch has been deregistered
+static int acted = 0;
+// 1 to release the other watch, or 0 to reinit and register it again
+static int release = 0;
+// number of deallocations, and the value at the end of callback
+static int nfree = 0;
+static int nfree_cb = -1;
+
+static void free_cb( afd_watch_t *w )
+{
+    nfree++;
+    free( (void*)w );
+}
+
+static void read_cb( afd_loop_t *loop, afd_watch_t *w, afd_evflag_e flg,
+                     int hup )
+{
+    int self = ( w == ws[1] );
+    afd_watch_t *other = ws[!self];
+    
+    ncb[self]++;
+    if( acted ){
+        return;
+    }
+    acted = 1;
+    check( afd_unwatch( loop, 0, other ) == 0, "unwatch: %s",
+           strerror( errno ) );
+    if( release ){
+        check( afd_watch_release( loop, other, free_cb ) == 0,
+               "release: %s", strerror( errno ) );
+        nfree_cb = nfree;
+    }
+    // reuse memory of the other watch for a descriptor that is not readable
+    else {
+        check( afd_watch_init( other, sv[2][0], AS_EV_READ, read_cb,
+                               NULL ) == 0, "init: %s", strerror( errno ) );
+        check( afd_watch( loop, other ) == 0, "watch: %s",
+               strerror( errno ) );
+    }
+}
+
+// register two readable watches, and run an iteration
+static void iterate( afd_loop_t *loop )
+{
+    struct timespec tmo = { 1, 0 };
+    int i = 0;
+    
+    memset( ncb, 0, sizeof( ncb ) );
+    acted = 0;
+    for(; i < 2; i++ )
+    {
+        if( !( ws[i] = malloc( sizeof( afd_watch_t ) ) ) ||
+            afd_watch_init( ws[i], sv[i][0], AS_EV_READ, read_cb,
+                            NULL ) == -1 ||
+            afd_watch( loop, ws[i] ) == -1 ||
+            write( sv[i][1], "", 1 ) != 1 ){
+            perror( "setup" );
+            exit( EXIT_FAILURE );
+        }
+    }
+    check( afd_loop_once( loop, &tmo ) > 0, "loop: %s", strerror( errno ) );
+}
+
+static void test_reuse( afd_loop_t *loop )
+{
+    int i = 0;
+    
+    release = 0;
+    iterate( loop );
+    // event of old registration is dropped, and new one is not readable
+    check( ncb[0] + ncb[1] == 1, "reuse: %d + %d callbacks", ncb[0], ncb[1] );
+    for(; i < 2; i++ ){
+        afd_unwatch( loop, 0, ws[i] );
+        free( (void*)ws[i] );
+    }
+}
+
+static void test_release( afd_loop_t *loop )
+{
+    afd_watch_t *w = NULL;
+    
+    release = 1;
+    nfree = 0;
+    iterate( loop );
+    check( ncb[0] + ncb[1] == 1, "release: %d + %d callbacks", ncb[0],
+           ncb[1] );
+    check( nfree_cb == 0, "release: freed in callback" );
+    check( nfree == 1, "release: freed %d times after iteration", nfree );
+    
+    // released immediately if the loop is not dispatching
+    w = ws[!ncb[0]];
+    afd_unwatch( loop, 0, w );
+    check( afd_watch_release( loop, w, free_cb ) == 0 && nfree == 2,
+           "release: freed %d times outside of iteration", nfree );
+}
+
+
+int main( void )
+{
+    afd_loop_t *loop = NULL;
+    char c = 0;
+    int i = 0;
+    
+    for(; i < 3; i++ )
+    {
+        if( socketpair( AF_UNIX, SOCK_STREAM, 0, sv[i] ) == -1 ){
+            perror( "socketpair" );
+            return EXIT_FAILURE;
+        }
+    }
+    if( !( loop = afd_loop_alloc( NULL, 4, NULL, NULL ) ) ){
+        perror( "afd_loop_alloc" );
+        return EXIT_FAILURE;
+    }
+    
+    test_reuse( loop );
+    // discard input of previous test
+    for( i = 0; i < 2; i++ )
+    {
+        if( read( sv[i][0], &c, 1 ) != 1 ){
+            perror( "read" );
+            return EXIT_FAILURE;
+        }
+    }
+    test_release( loop );
+    
+    afd_loop_dealloc( loop );
+    for( i = 0; i < 3; i++ ){
+        close( sv[i][0] );
+        close( sv[i][1] );
+    }
+    
+    if( nfail ){
+        printf( "%d failures\n", nfail );
+        return EXIT_FAILURE;
+    }
+    printf( "ok\n" );
+    
+    return EXIT_SUCCESS;
+}